@@ -30,6 +30,7 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * --/COPYRIGHT--*/
 #include <Arduino.h>
+#include "dc_blocker.h"
 extern volatile uint8_t    npeakflag;
 
 /****************************************************************/
@@ -48,6 +49,8 @@ extern volatile uint8_t    npeakflag;
 
 #define SAMPLING_RATE					125
 #define TWO_SEC_SAMPLES  				2 * SAMPLING_RATE
+/* after lead-on the first threshold comes from a shorter window */
+#define SEED_SAMPLES  					(SAMPLING_RATE * 3 / 2)	// one beat at 40 bpm
 
 /*threshold = 0.7 * maxima*/
 #define QRS_THRESHOLD_FRACTION	0.7					
@@ -59,8 +62,8 @@ extern volatile uint8_t    npeakflag;
 
 											// 1 - 60 Hz Notch filter
 
-/* DC Removal Numerator Coeff*/
-#define NRCOEFF (0.992)
+/* DC Removal pole 0.992, in Q31: the same as the double version (dc_blocker.h) */
+typedef DCBlocker<short, int64_t, 31, Q31(0.992)> DCRemoval;
 
 /****************************************************************/
 //
@@ -78,6 +81,15 @@ static unsigned short QRS_B4_Buffer_ptr = 0 ;
 unsigned short QRS_Heart_Rate = 0 ;
 unsigned char HR_flag;
 
+/* Lead-on recovery: ECG_Restart() sets the flags, each stage clears its own */
+static unsigned char Filter_Restart = FALSE;
+static unsigned char QRS_Restart = FALSE;
+static unsigned char Average_Restart = FALSE;
+static unsigned char Seed_Threshold = TRUE;
+/* TRUE until the first average of MAX_PEAK_TO_SEARCH peaks, the heart rate
+   is then the average of the intervals found so far (from 2 beats) */
+unsigned char QRS_HR_Provisional = TRUE;
+
 /* 	Variable which holds the threshold value to calculate the maxima*/
 short QRS_Threshold_Old = 0;
 short QRS_Threshold_New = 0;
@@ -220,11 +232,11 @@ void ECG_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut)
 {
 
  	static unsigned short ECG_bufStart=0, ECG_bufCur = FILTERORDER-1, ECGFirstFlag = 1;
- 	static short ECG_Pvev_DC_Sample, ECG_Pvev_Sample;/* Working Buffer Used for Filtering*/
+ 	static DCRemoval ECG_DCRemoval;
 	static short ECG_WorkingBuff[2 * FILTERORDER];
  	short *CoeffBuf;
  	
- 	short temp1, temp2, ECGData;
+ 	short ECGData;
  	
 
 	/* Count variable*/
@@ -233,21 +245,20 @@ void ECG_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut)
 //	short FilterOut[2];
 	CoeffBuf = CoeffBuf_40Hz_LowPass;					// Default filter option is 40Hz LowPass
 	
-	if  ( ECGFirstFlag )								// First Time initialize static variables.
+	if  ( ECGFirstFlag || Filter_Restart )				// First Time initialize static variables.
 	{
-		for ( Cur_Chan =0 ; Cur_Chan < FILTERORDER; Cur_Chan++)
+		/* pre-fill: the DC removal starts from the current sample, not from 0
+		   or the samples before lead-off, so there is no step to settle down,
+		   and the DC removed delay line is all 0, its steady state */
+		for ( Cur_Chan =0 ; Cur_Chan < 2 * FILTERORDER; Cur_Chan++)
 		{
 			ECG_WorkingBuff[Cur_Chan] = 0;
 		} 
-		ECG_Pvev_DC_Sample = 0;
-		ECG_Pvev_Sample = 0;
+		ECG_DCRemoval.restart(CurrAqsSample[0]);
 		ECGFirstFlag = 0;
+		Filter_Restart = FALSE;
 	}
-	temp1 = NRCOEFF * ECG_Pvev_DC_Sample;				//First order IIR
-	ECG_Pvev_DC_Sample = (CurrAqsSample[0]  - ECG_Pvev_Sample) + temp1;
-	ECG_Pvev_Sample = CurrAqsSample[0];
-	temp2 = ECG_Pvev_DC_Sample >> 2;
-	ECGData = (short) temp2;
+	ECGData = ECG_DCRemoval.process(CurrAqsSample[0]) >> 2;	//First order IIR
 
 	/* Store the DC removed value in Working buffer in millivolts range*/
 	ECG_WorkingBuff[ECG_bufCur] = ECGData;
@@ -301,6 +312,22 @@ static void QRS_check_sample_crossing_threshold( unsigned short scaled_result )
 	unsigned short max = 0 ;
 	unsigned short HRAvg;
 
+	if( TRUE == QRS_Restart )
+	{
+		s_array_index = 0 ;
+		m_array_index = 0 ;
+		threshold_crossed = FALSE ;
+		maxima_search = 0 ;
+		peak_detected = FALSE ;
+		skip_window = 0 ;
+		maxima_sum = 0 ;
+		peak = 0 ;
+		sample_sum = 0 ;
+		nopeak = 0 ;
+		sample_count = 0 ;
+		Start_Sample_Count_Flag = 0 ;
+		QRS_Restart = FALSE ;
+	}
 	
 	if( TRUE == threshold_crossed  )
 	{
@@ -354,6 +381,7 @@ static void QRS_check_sample_crossing_threshold( unsigned short scaled_result )
 			QRS_Heart_Rate =  QRS_Heart_Rate/ HRAvg ;
 				if(QRS_Heart_Rate > 250)
 					QRS_Heart_Rate = 250 ;
+			QRS_HR_Provisional = FALSE;
 			}
 			else
 			{
@@ -413,6 +441,14 @@ static void QRS_check_sample_crossing_threshold( unsigned short scaled_result )
 			sample_sum += sample_index[ s_array_index ] - sample_index[ s_array_index - 1 ] ;
 		}
 		s_array_index ++ ;
+
+		/* provisional heart rate from the intervals so far, 2 beats = 1 interval */
+		if(( TRUE == QRS_HR_Provisional ) && ( s_array_index >= 2 ) && ( sample_sum > 0 ) && ( LeadStatus == 0 ))
+		{
+			QRS_Heart_Rate = (unsigned short)(60 * SAMPLING_RATE * (s_array_index - 1) / sample_sum);
+			if(QRS_Heart_Rate > 250)
+				QRS_Heart_Rate = 250 ;
+		}
 	}
 
 	else if(( scaled_result < QRS_Threshold_New ) && (Start_Sample_Count_Flag == 1))
@@ -496,6 +532,9 @@ static void QRS_process_buffer( void )
 
 	static short max = 0 ;
 
+	if( QRS_B4_Buffer_ptr == 0 )						// new window, also after ECG_Restart()
+		max = 0;
+
 	/* calculating first derivative*/
 	first_derivative = QRS_Next_Sample - QRS_Prev_Sample  ;
 
@@ -514,7 +553,8 @@ static void QRS_process_buffer( void )
 	}
 
 	QRS_B4_Buffer_ptr++;
-	if (QRS_B4_Buffer_ptr ==  TWO_SEC_SAMPLES)
+	if ((QRS_B4_Buffer_ptr ==  TWO_SEC_SAMPLES) ||
+		((TRUE == Seed_Threshold) && (QRS_B4_Buffer_ptr == SEED_SAMPLES) && (max > 70)))
 	{
 		QRS_Threshold_Old = ((max *7) /10 ) ;
 		QRS_Threshold_New = QRS_Threshold_Old ;
@@ -523,6 +563,7 @@ static void QRS_process_buffer( void )
 		first_peak_detect = TRUE ;
 		max = 0;
 		QRS_B4_Buffer_ptr = 0;
+		Seed_Threshold = FALSE;
 	}
 
 
@@ -554,6 +595,16 @@ void QRS_Algorithm_Interface(short CurrSample)
 	static short prev_data[32] ={0};
 	short i;
 	long Mac=0;
+
+	if( TRUE == Average_Restart )
+	{
+		/* start the moving average and the derivatives from this sample */
+		for ( i = 0; i < 32; i++ )
+			prev_data[i] = CurrSample;
+		QRS_Second_Prev_Sample = QRS_Prev_Sample = QRS_Current_Sample =
+		QRS_Next_Sample = QRS_Second_Next_Sample = (CurrSample * 32) >> 2;
+		Average_Restart = FALSE;
+	}
 	prev_data[0] = CurrSample;
 	for ( i=31; i > 0; i--)
 	{
@@ -573,4 +624,29 @@ void QRS_Algorithm_Interface(short CurrSample)
 }
 /*********************************************************************************************************/
 
+/*********************************************************************************************************
+** 	Function Name : ECG_Restart                                          								**
+** 	Description -   Called at lead-on. The filter and the QRS detector   								**
+** 					start again from the next sample: the filter delay   								**
+** 					line is pre-filled, the QRS threshold is seeded from 								**
+** 					SEED_SAMPLES instead of TWO_SEC_SAMPLES and a        								**
+** 					provisional heart rate is given from the 2nd beat.   								**
+** 	Parameters  : None                                                   								**
+** 	Return		: None                                                   								**
+*********************************************************************************************************/
+void ECG_Restart(void)
+{
+	Filter_Restart = TRUE;
+	Average_Restart = TRUE;
+	QRS_Restart = TRUE;
+	Seed_Threshold = TRUE;
+	QRS_HR_Provisional = TRUE;
+	QRS_Heart_Rate = 0;
+	QRS_B4_Buffer_ptr = 0;
+	QRS_Threshold_Old = 0;
+	QRS_Threshold_New = 0;
+	first_peak_detect = FALSE;
+}
+/*********************************************************************************************************/
+
 // End of File
@@ -30,6 +30,7 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * --/COPYRIGHT--*/
 #include <stdlib.h>
+#include "dc_blocker.h"
 
 /****************************************************************/
 /* Constants*/
@@ -43,8 +44,8 @@
 #define TRUE	1
 #define FALSE	0
 
-/* DC Removal Numerator Coeff*/
-#define NRCOEFF (0.992)
+/* DC Removal pole 0.992, in Q31: the same as the double version (dc_blocker.h) */
+typedef DCBlocker<short, int64_t, 31, Q31(0.992)> DCRemoval;
 
 /****************************************************************/
 /* Global functions*/
@@ -209,8 +210,8 @@ void Resp_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut)
 {
 
  	static unsigned short bufStart=0, bufCur = FILTERORDER-1, FirstFlag = 1;
- 	static short Pvev_DC_Sample, Pvev_Sample;
- 	short temp1, temp2, RESPData;
+ 	static DCRemoval RESP_DCRemoval;
+ 	short RESPData;
  	
 	/* Count variable*/
 	unsigned short Cur_Chan;
@@ -223,15 +224,10 @@ void Resp_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut)
 			RESP_WorkingBuff[Cur_Chan] = 0;
 		}
 
-		Pvev_DC_Sample = 0;
-		Pvev_Sample = 0;
+		RESP_DCRemoval.restart(0);
 		FirstFlag = 0;
 	}
-	temp1 = NRCOEFF * Pvev_DC_Sample;
-	Pvev_DC_Sample = (CurrAqsSample[0]  - Pvev_Sample) + temp1;
-	Pvev_Sample = CurrAqsSample[0];
-	temp2 = Pvev_DC_Sample >> 2;
-	RESPData = (short) temp2;
+	RESPData = RESP_DCRemoval.process(CurrAqsSample[0]) >> 2;
 
 	/* Store the DC removed value in RESP_WorkingBuff buffer in millivolts range*/
 	RESP_WorkingBuff[bufCur] = RESPData;
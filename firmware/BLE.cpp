@@ -45,6 +45,9 @@
 #define DATASTREAM_SERVICE_UUID         (uint16_t(0x1122)) 
 #define ECG_STREAM_CHARACTERISTIC_UUID  (uint16_t(0x1424))
 #define PPG_STREAM_CHARACTERISTIC_UUID  (uint16_t(0x1425)) 
+#define BACKFILL_CHARACTERISTIC_UUID    "01bf1528-970f-8d96-d44d-9023c47faddc"
+#define NACK_CHARACTERISTIC_UUID        "01bf1529-970f-8d96-d44d-9023c47faddc"
+#define DIAG_CHARACTERISTIC_UUID        "01bf152a-970f-8d96-d44d-9023c47faddc"
 
 #define TEMP_SERVICE_UUID               (uint16_t(0x1809)) 
 #define TEMP_CHARACTERISTIC_UUID        (uint16_t(0x2a6e))
@@ -55,6 +58,10 @@
 #define HRV_SERVICE_UUID                "cd5c7491-4448-7db8-ae4c-d1da8cba36d0"
 #define HRV_CHARACTERISTIC_UUID         "01bfa86f-970f-8d96-d44d-9023c47faddc"
 #define HIST_CHARACTERISTIC_UUID        "01bf1525-970f-8d96-d44d-9023c47faddc"
+#define PAT_CHARACTERISTIC_UUID         "01bf1527-970f-8d96-d44d-9023c47faddc"
+
+#define ALERT_SERVICE_UUID              "cd5c7492-4448-7db8-ae4c-d1da8cba36d0"
+#define FALL_CHARACTERISTIC_UUID        "01bf1526-970f-8d96-d44d-9023c47faddc"
 
 /*---------------------------------------------------------------------------------
  local declarations
@@ -64,10 +71,15 @@ BLECharacteristic *heartRate_Characteristic   = NULL;
 BLECharacteristic *spo2_Characteristic        = NULL;
 BLECharacteristic *ecgStream_Characteristic   = NULL;
 BLECharacteristic *ppgStream_Characteristic   = NULL;
+BLECharacteristic *backfill_Characteristic    = NULL;
+BLECharacteristic *nack_Characteristic        = NULL;
+BLECharacteristic *diag_Characteristic        = NULL;
 BLECharacteristic *battery_Characteristic     = NULL;
 BLECharacteristic *temp_Characteristic        = NULL;
 BLECharacteristic *hist_Characteristic        = NULL;
 BLECharacteristic *hrv_Characteristic         = NULL;
+BLECharacteristic *pat_Characteristic         = NULL;
+BLECharacteristic *fall_Characteristic        = NULL;
 
 volatile bool  bleDeviceConnected = false;
          bool  oldDeviceConnected = false;
@@ -87,7 +99,7 @@ Queue	ecg_queue(ECG_QUEUE_LEN, ECG_QUEUE_SIZE, FIFO);
  extern variables
 ---------------------------------------------------------------------------------*/
 extern uint8_t  hrv_array[HVR_ARRAY_SIZE];
-extern uint8_t  heart_rate_pack[3];
+extern uint8_t  heart_rate_pack[HEART_RATE_PACK_SIZE];
 extern uint8_t  battery_percent, old_battery_percent;
 extern int16_t  body_temp_times10, old_body_temp_times10;
 extern uint8_t  histogram_percent[HISTGRM_PERCENT_SIZE];
@@ -101,12 +113,12 @@ class MyServerCallbacks: public BLEServerCallbacks
   {
     bleDeviceConnected = true;
     pServer->startAdvertising();
-    Serial.println("BLE: connected");
+    LOG_I(LOG_BLE, "BLE: connected");
   }
 
   void onDisconnect(BLEServer *pServer)
   {
-    Serial.println("BLE: disconnected");
+    LOG_I(LOG_BLE, "BLE: disconnected");
     bleDeviceConnected = false;
   }
 };
@@ -162,8 +174,9 @@ class ppgCallbackHandler: public BLECharacteristicCallbacks
       if ((value[0]='O')&&(value[0]='K'))
       {
         // re-send everything when re-connect ble
-        Serial.println("BLE: re-send");
+        LOG_I(LOG_BLE, "BLE: re-send");
         old_ecg_heart_rate  = 0xff;
+        hrFusionReady       = true;
         old_spo2_percent    = 0xff;
         old_body_temp_times10  = 0xffff;
         old_battery_percent = 0xff;
@@ -171,6 +184,7 @@ class ppgCallbackHandler: public BLECharacteristicCallbacks
         histogramReady      = true;
         ppg_queue.flush();
         ecg_queue.flush();    
+        backfillAnnounce();     // the app may ask for the recorded data
       }
     }
   }
@@ -189,6 +203,26 @@ class ppgCallbackHandler: public BLECharacteristicCallbacks
     }     
   }*/
 };
+class backfillCallbackHandler: public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *characteristic)
+  {
+    std::string value = characteristic->getValue();
+
+    // a time range, a resume, stop or status, done in loop()
+    backfillRequest((const uint8_t *)value.data(), value.length());
+  }
+};
+class nackCallbackHandler: public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *characteristic)
+  {
+    std::string value = characteristic->getValue();
+
+    // missing stream packets, resent in loop()
+    retransmitNack((const uint8_t *)value.data(), value.length());
+  }
+};
 /*---------------------------------------------------------------------------------
  called in the loop()
 ---------------------------------------------------------------------------------*/
@@ -210,7 +244,7 @@ void handleBLE(void)
   if (!bleDeviceConnected && oldDeviceConnected) {
       delay(500); // give the bluetooth stack the chance to get things ready
       pServer->startAdvertising(); // restart advertising
-      Serial.println("start advertising");
+      LOG_I(LOG_BLE, "start advertising");
       oldDeviceConnected = bleDeviceConnected;
   }
   // connecting
@@ -227,28 +261,32 @@ void handleBLE(void)
   // send to BLE
   ////////////////////////////////////////////
 
-  //heart rate
-  #define HEART_BEAT_READ_INTERVAL  1000
-  static unsigned long heartBeatTimer = 0;
-
-  if (millis() - heartBeatTimer > HEART_BEAT_READ_INTERVAL)
-  { 
-    heartBeatTimer = millis();     
-
-    //when ECG lead off, use PPG heart rate replace
-    if ((LeadStatus!=0)&&(ppg_heart_rate!=0))  
-      ecg_heart_rate = ppg_heart_rate; 
+  //fall alert, first of all, it waits here until the app connects
+  if (fallAlertReady){
+    fall_Characteristic->setValue(&fall_alert[0], sizeof(fall_alert));
+    fall_Characteristic->notify();
+    fallAlertReady = false;
+    delay(3);
+    LOG_I(LOG_BLE, "ble:send fall");
+  }
 
-    if(old_ecg_heart_rate!= ecg_heart_rate)
+  //heart rate, fused from the ECG and PPG beats, sent at the beat
+  if (hrFusionReady){
+    hrFusionReady = false;
+    if((old_ecg_heart_rate != hr_fused)||(heart_rate_pack[5] != hr_confidence)||(heart_rate_pack[6] != hr_disagree))
     {
-      heart_rate_pack[0]  = ecg_heart_rate; // calculated by QRS_Algorithm_Interface()
+      heart_rate_pack[0]  = hr_fused;       // calculated by hr_fusion.cpp
       heart_rate_pack[1]  = ppg_heart_rate; 
       heart_rate_pack[2]  = ecg_lead_off; 
-      old_ecg_heart_rate  = ecg_heart_rate;
+      heart_rate_pack[3]  = ecg_sqi; 
+      heart_rate_pack[4]  = ppg_sqi; 
+      heart_rate_pack[5]  = hr_confidence; 
+      heart_rate_pack[6]  = hr_disagree; 
+      old_ecg_heart_rate  = hr_fused;
       heartRate_Characteristic->setValue(&heart_rate_pack[0], sizeof(heart_rate_pack));
       heartRate_Characteristic->notify();
       delay(3);
-      Serial.printf("ble:send heart %u\r\n", ecg_heart_rate);
+      LOG_I(LOG_BLE, "ble:send heart %u (%u%%)", hr_fused, hr_confidence);
     }  
   }
   
@@ -256,10 +294,11 @@ void handleBLE(void)
   //spo2 percentage
   if (old_spo2_percent!= spo2_percent) { 
     old_spo2_percent = spo2_percent;
-    spo2_Characteristic->setValue(&spo2_percent, sizeof(spo2_percent));
+    uint8_t spo2_pack[2] = {spo2_percent, ppg_sqi};
+    spo2_Characteristic->setValue(spo2_pack, sizeof(spo2_pack));
     spo2_Characteristic->notify();
     delay(3);
-    Serial.printf("ble:send spo2 %u\r\n",spo2_percent);
+    LOG_I(LOG_BLE, "ble:send spo2 %u", spo2_percent);
   }
 
   //body temperature
@@ -274,7 +313,7 @@ void handleBLE(void)
     temp_Characteristic->setValue(tx.b, sizeof(tx.b));
     temp_Characteristic->notify();
     delay(3);
-    Serial.printf("ble:send temp %f\r\n", ((float) body_temp_times10)/10);
+    LOG_I(LOG_BLE, "ble:send temp %f", ((float) body_temp_times10)/10);
   }  
    
   //battery life
@@ -283,7 +322,7 @@ void handleBLE(void)
     battery_Characteristic->setValue(&battery_percent, sizeof(battery_percent));
     battery_Characteristic->notify();
     delay(3);
-    Serial.println("ble:send battery");
+    LOG_I(LOG_BLE, "ble:send battery");
   }  
   
   //heart rate variability
@@ -292,7 +331,7 @@ void handleBLE(void)
     hrv_Characteristic->notify();
     hrvDataReady = false;
     delay(3);
-    Serial.println("ble:send hrv");
+    LOG_I(LOG_BLE, "ble:send hrv");
   }
 
   //heart rate histogram
@@ -301,7 +340,15 @@ void handleBLE(void)
     hist_Characteristic->notify();
     histogramReady = false;
     delay(3);
-    Serial.println("ble:send hist");
+    LOG_I(LOG_BLE, "ble:send hist");
+  }
+
+  //pulse arrival time, at each beat paired with ECG
+  if (patReady){
+    pat_Characteristic->setValue(&pat_pack[0], sizeof(pat_pack));
+    pat_Characteristic->notify();
+    patReady = false;
+    delay(3);
   }
 
   // ECG
@@ -310,9 +357,12 @@ void handleBLE(void)
       ecg_queue.pop(&ecg_tx_data[i]);
     ecg_tx_data[ecg_tx_size] = ecg_serial_number++;
 
+    TRACE_BEGIN(TR_BLE_ECG);
     ecgStream_Characteristic->setValue((uint8_t *)ecg_tx_data, sizeof(ecg_tx_data));
     ecgStream_Characteristic->notify();
+    retransmitSent(BLE_ECG, ecg_tx_data[ecg_tx_size], (uint8_t *)ecg_tx_data, sizeof(ecg_tx_data));
     delay(3);
+    TRACE_END(TR_BLE_ECG);
   }
 
   // PPG
@@ -321,9 +371,55 @@ void handleBLE(void)
       ppg_queue.pop(&ppg_tx_data[i]);
     ppg_tx_data[ppg_tx_size] = ppg_serial_number++;
 
+    TRACE_BEGIN(TR_BLE_PPG);
     ppgStream_Characteristic->setValue((uint8_t *)ppg_tx_data, sizeof(ppg_tx_data));
     ppgStream_Characteristic->notify();
+    retransmitSent(BLE_PPG, ppg_tx_data[ppg_tx_size], (uint8_t *)ppg_tx_data, sizeof(ppg_tx_data));
+    delay(3);
+    TRACE_END(TR_BLE_PPG);
+  }
+
+  // stream packets the app missed (NACK), the same bytes again, one a pass
+  // without a delay(): retransmit.cpp paces them
+  {
+    uint8_t   retx_packet[RETX_PACKET_MAX];
+    uint8_t   retx_size;
+    BleStream stream;
+
+    if (retransmitNext(&stream, retx_packet, &retx_size)){
+      BLECharacteristic *characteristic = (stream == BLE_ECG) ? ecgStream_Characteristic : ppgStream_Characteristic;
+      characteristic->setValue(retx_packet, retx_size);
+      characteristic->notify();
+    }
+  }
+
+  //NACK and resend counters, after each NACK
+  if (retransmitReady){
+    nack_Characteristic->setValue(&retransmit_pack[0], sizeof(retransmit_pack));
+    nack_Characteristic->notify();
     delay(3);
+    retransmitReady = false;
+  }
+
+  //time of the loop() stages, profile.cpp
+  if (profileReady){
+    diag_Characteristic->setValue(&profile_pack[0], sizeof(profile_pack));
+    diag_Characteristic->notify();
+    delay(3);
+    profileReady = false;
+  }
+
+  // recorded data, after the live data, one packet a pass without a delay():
+  // backfill.cpp paces it and caps its bandwidth, loop() must not miss an ECG sample
+  {
+    uint8_t backfill_packet[BACKFILL_PACKET_MAX];
+    int     backfill_size = min(pServer->getPeerMTU(pServer->getConnId()) - 3, BACKFILL_PACKET_MAX);
+    int     length = backfillNext(backfill_packet, backfill_size);
+
+    if (length > 0){
+      backfill_Characteristic->setValue(backfill_packet, length);
+      backfill_Characteristic->notify();
+    }
   }
 
 }
@@ -333,6 +429,7 @@ void handleBLE(void)
 void initBLE(void)
 {
   BLEDevice::init(BLEDeviceName);                 // Create Device
+  BLEDevice::setMTU(BACKFILL_PACKET_MAX + 3);     // the app may ask for a larger MTU, for backfill
   pServer = BLEDevice::createServer();            // Create Server
   pServer->setCallbacks(new MyServerCallbacks());
 
@@ -343,6 +440,7 @@ void initBLE(void)
   BLEService *batteryService    = pServer->createService(BATTERY_SERVICE_UUID);
   BLEService *hrvService        = pServer->createService(HRV_SERVICE_UUID);
   BLEService *datastreamService = pServer->createService(DATASTREAM_SERVICE_UUID);
+  BLEService *alertService      = pServer->createService(ALERT_SERVICE_UUID);
 
   // add the characteristic to the service 
   // the indicate feature is not working on flutter_blue of the iOS app.
@@ -357,8 +455,13 @@ void initBLE(void)
   battery_Characteristic      = batteryService->createCharacteristic   (BATTERY_CHARACTERISTIC_UUID,PROPERTY);
   hrv_Characteristic          = hrvService->createCharacteristic       (HRV_CHARACTERISTIC_UUID,PROPERTY);
   hist_Characteristic         = hrvService->createCharacteristic       (HIST_CHARACTERISTIC_UUID,PROPERTY);
+  pat_Characteristic          = hrvService->createCharacteristic       (PAT_CHARACTERISTIC_UUID,PROPERTY);
   ecgStream_Characteristic    = datastreamService->createCharacteristic(ECG_STREAM_CHARACTERISTIC_UUID,PROPERTY);
   ppgStream_Characteristic    = datastreamService->createCharacteristic(PPG_STREAM_CHARACTERISTIC_UUID,PROPERTY);
+  backfill_Characteristic     = datastreamService->createCharacteristic(BACKFILL_CHARACTERISTIC_UUID,PROPERTY);
+  nack_Characteristic         = datastreamService->createCharacteristic(NACK_CHARACTERISTIC_UUID,PROPERTY);
+  diag_Characteristic         = datastreamService->createCharacteristic(DIAG_CHARACTERISTIC_UUID,PROPERTY);
+  fall_Characteristic         = alertService->createCharacteristic     (FALL_CHARACTERISTIC_UUID,PROPERTY);
 
   heartRate_Characteristic  ->addDescriptor(new BLE2902());
   spo2_Characteristic       ->addDescriptor(new BLE2902());
@@ -366,11 +469,18 @@ void initBLE(void)
   battery_Characteristic    ->addDescriptor(new BLE2902());
   hist_Characteristic       ->addDescriptor(new BLE2902());
   hrv_Characteristic        ->addDescriptor(new BLE2902());
+  pat_Characteristic        ->addDescriptor(new BLE2902());
   ecgStream_Characteristic  ->addDescriptor(new BLE2902());
   ppgStream_Characteristic  ->addDescriptor(new BLE2902());
+  backfill_Characteristic   ->addDescriptor(new BLE2902());
+  nack_Characteristic       ->addDescriptor(new BLE2902());
+  diag_Characteristic       ->addDescriptor(new BLE2902());
+  fall_Characteristic       ->addDescriptor(new BLE2902());
 
   ecgStream_Characteristic  ->setCallbacks (new ecgCallbackHandler());
   ppgStream_Characteristic  ->setCallbacks (new ppgCallbackHandler()); 
+  backfill_Characteristic   ->setCallbacks (new backfillCallbackHandler());
+  nack_Characteristic       ->setCallbacks (new nackCallbackHandler());
 
   // Start the service
   heartRateService  ->start();
@@ -379,6 +489,7 @@ void initBLE(void)
   batteryService    ->start();
   hrvService        ->start();
   datastreamService ->start();
+  alertService      ->start();
 
   // Start advertising
   BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
@@ -388,6 +499,7 @@ void initBLE(void)
   pAdvertising->addServiceUUID(BATTERY_SERVICE_UUID);
   pAdvertising->addServiceUUID(HRV_SERVICE_UUID);
   pAdvertising->addServiceUUID(DATASTREAM_SERVICE_UUID);
+  pAdvertising->addServiceUUID(ALERT_SERVICE_UUID);
   pAdvertising->setScanResponse(false);
   pAdvertising->setMinPreferred(0x00);  // set value to 0x00 to not advertise this parameter
   BLEDevice::startAdvertising();
@@ -88,12 +88,30 @@ enum MMA8452Q_ODR
 	ODR_6,		//6.25Hz
 	ODR_1		//1.56Hz
 }; // possible data rates
-// Possible portrait/landscape settings
-#define PORTRAIT_U 0
-#define PORTRAIT_D 1
-#define LANDSCAPE_R 2
-#define LANDSCAPE_L 3
-#define LOCKOUT 0x40
+// Possible portrait/landscape settings: PORTRAIT_U ... LOCKOUT, see firmware.h
+
+#if   (ACCEL_ODR_HZ == 12)
+  #define ACCEL_ODR         ODR_12
+  #define ACCEL_PERIOD_US   80000
+#elif (ACCEL_ODR_HZ == 50)
+  #define ACCEL_ODR         ODR_50
+  #define ACCEL_PERIOD_US   20000
+#elif (ACCEL_ODR_HZ == 100)
+  #define ACCEL_ODR         ODR_100
+  #define ACCEL_PERIOD_US   10000
+#else
+  #error ACCEL_ODR_HZ must be 12, 50 or 100
+#endif
+#if (ACCEL_SCALE_G != 2) && (ACCEL_SCALE_G != 4) && (ACCEL_SCALE_G != 8)
+  #error ACCEL_SCALE_G must be 2, 4 or 8
+#endif
+
+// Interrupt sources, same bits in CTRL_REG4 (enable), CTRL_REG5 (1 = INT1) and INT_SOURCE
+#define INT_DRDY    0x01
+#define INT_FF_MT   0x04
+#define INT_PULSE   0x08
+#define INT_LNDPRT  0x10
+#define INT_TRANS   0x20
 
 /*	I2C address 
 	0x1C when SA0=0
@@ -143,6 +161,9 @@ class MMA8452Q
 
 	void setScale(MMA8452Q_Scale fsr);
 	void setDataRate(MMA8452Q_ODR odr);
+	void setupTransient(byte ths, uint16_t ms);
+	void setupFreefall(byte ths, uint16_t ms);
+	void setupInterrupts(byte enable, byte int1);
 
   private:
 	TwoWire *_i2cPort = NULL; //The generic connection to user's chosen I2C hardware
@@ -151,6 +172,7 @@ class MMA8452Q
 	void standby();
 	void active();
 	bool isActive();
+	byte msToCount(uint16_t ms);
 	void setupPL();
 	void setupTap(byte xThs, byte yThs, byte zThs);
 	void writeRegister(MMA8452Q_Register reg, byte data);
@@ -161,75 +183,292 @@ class MMA8452Q
 
 MMA8452Q accel;         // create instance of the MMA8452 class
 
-// Choose your adventure! There are a few options when it comes
-// to initializing the MMA8452Q:
-  
+/*---------------------------------------------------------------------------------
+  Interrupt driven sampling
+
+  INT1 = data ready. The ISR only takes the timestamp, handelAcceleromter() then
+  submits one 7-byte burst read (STATUS, OUT_X_MSB..OUT_Z_LSB) to the I2C task, which
+  also clears data ready. ZYXOW in STATUS counts an overwritten sample (overrun.cpp).
+  Samples go to a ring, other stages read them by index:
+
+    static uint32_t next = accelSampleCount();
+    AccelSample     s;
+    while (next != accelSampleCount())
+      if (accelGetSample(next++, &s)) ...
+
+  INT2 = tap, transient, freefall and portrait/landscape. INT_SOURCE is read first, then the
+  source register of each active event, reading it clears the event. An event is
+  latched with the time of its INT2 edge (the INT_SOURCE poll without the pins),
+  each stage takes only its own events with accelTakeEvents(mask).
+
+  Both pins are active low and stay low until the interrupt is cleared, so a read
+  lost on a full I2C queue is submitted again while the pin is still low.
+  Without the INT pins (ACCEL_INT_WIRED false), INT_SOURCE is polled once per
+  sample period of the current ODR instead (poll_period_us, 10ms in a burst), and
+  data ready is taken from there.
+---------------------------------------------------------------------------------*/
+AccelSample         accel_ring[ACCEL_RING_SIZE];
+volatile uint32_t   accel_head    = 0;
+volatile uint8_t    accel_events  = 0;
+volatile uint32_t   accel_event_us[ACCEL_EVENTS];     // micros() of each latched event
+volatile uint8_t    accel_pl      = LOCKOUT;
+bool                accel_ready   = false;
+
+volatile bool       accel_drdy_flag   = false;
+volatile bool       accel_event_flag  = false;
+volatile uint32_t   accel_drdy_us;
+volatile uint32_t   accel_int2_us;
+portMUX_TYPE        accelMux = portMUX_INITIALIZER_UNLOCKED;
+
+static I2CTransaction xyzRead, sourceRead, pulseRead, transientRead, ffmtRead, plRead;
+static uint8_t        xyzData[7];    // STATUS, x, y, z
+static uint8_t        intSource, pulseSrc, transientSrc, ffmtSrc, plStatus;
+static uint32_t       xyzTimestamp, sourceTimestamp;
+static volatile uint32_t poll_period_us = ACCEL_PERIOD_US;   // of the current ODR, accelSetBurst()
+
+void IRAM_ATTR accel_drdy_handler(void)
+{
+  portENTER_CRITICAL_ISR(&accelMux);
+  accel_drdy_us   = micros();
+  accel_drdy_flag = true;
+  portEXIT_CRITICAL_ISR (&accelMux);
+  TRACE_MARK(TR_ACCEL_DRDY, 0);
+}
+
+void IRAM_ATTR accel_event_handler(void)
+{
+  portENTER_CRITICAL_ISR(&accelMux);
+  accel_int2_us    = micros();
+  accel_event_flag = true;
+  portEXIT_CRITICAL_ISR (&accelMux);
+}
+
+// I2C task: store the sample, a failed read leaves data ready set and is retried
+static void onXYZData(I2CTransaction *t)
+{
+  if (t->error)
+    return;
+
+  AccelSample *s  = &accel_ring[accel_head & (ACCEL_RING_SIZE - 1)];
+  s->timestamp_us = xyzTimestamp;
+  s->x = ((short)(xyzData[1] << 8 | xyzData[2])) >> 4;
+  s->y = ((short)(xyzData[3] << 8 | xyzData[4])) >> 4;
+  s->z = ((short)(xyzData[5] << 8 | xyzData[6])) >> 4;
+  accel_head++;                 // publish after the sample is stored
+  if (xyzData[0] & 0x80)        // ZYXOW, a sample was not read before the next one
+    overrunMissed(OVR_ACCEL, 1);
+}
+
+static void addEvent(uint8_t event)
+{
+  portENTER_CRITICAL(&accelMux);
+  for (int i = 0; i < ACCEL_EVENTS; i++)
+    if (event & (1 << i))
+      accel_event_us[i] = sourceTimestamp;
+  accel_events |= event;
+  portEXIT_CRITICAL(&accelMux);
+}
+
+// I2C task: source register of one event, the read has cleared it
+static void onEventSource(I2CTransaction *t)
+{
+  if (t->error)
+    return;
+
+  if ((t == &pulseRead) && (pulseSrc & 0x80))           // EA, event active
+  {
+    addEvent(ACCEL_EVENT_TAP);
+    LOG_D(LOG_MOTION, "Tap");
+  }
+  if ((t == &transientRead) && (transientSrc & 0x40))   // EA
+    addEvent(ACCEL_EVENT_TRANSIENT);
+  if ((t == &ffmtRead) && (ffmtSrc & 0x80))             // EA
+    addEvent(ACCEL_EVENT_FREEFALL);
+  if (t == &plRead)
+  {
+    accel_pl = (plStatus & 0x40) ? LOCKOUT : (plStatus & 0x6) >> 1;
+    if (plStatus & 0x80)                                // NEWLC, orientation changed
+      addEvent(ACCEL_EVENT_ORIENTATION);
+  }
+}
+
+// I2C task: read the source register of every active event
+static void onIntSource(I2CTransaction *t)
+{
+  if (t->error)
+    return;
+
+#if !ACCEL_INT_WIRED
+  sourceTimestamp = t->submit_us;
+  if ((intSource & INT_DRDY) && xyzRead.done)
+  {
+    xyzTimestamp = t->submit_us;
+    i2cBus.submit(&xyzRead);
+  }
+#endif
+  if ((intSource & INT_PULSE) && pulseRead.done)
+    i2cBus.submit(&pulseRead);
+  if ((intSource & INT_TRANS) && transientRead.done)
+    i2cBus.submit(&transientRead);
+  if ((intSource & INT_FF_MT) && ffmtRead.done)
+    i2cBus.submit(&ffmtRead);
+  if ((intSource & INT_LNDPRT) && plRead.done)
+    i2cBus.submit(&plRead);
+}
+
+static void setupRead(I2CTransaction *t, MMA8452Q_Register reg, uint8_t *data, uint8_t length,
+                      void (*callback)(I2CTransaction *t))
+{
+  memset(t, 0, sizeof(I2CTransaction));
+  t->address  = MMA8452Q_DEFAULT_ADDRESS;
+  t->reg      = reg;
+  t->data     = data;
+  t->length   = length;
+  t->op       = I2C_READ;
+  t->priority = I2C_PRIORITY_LOW;
+  t->callback = callback;
+  t->done     = true;           // idle
+}
+
+static bool eventsIdle(void)
+{
+  return sourceRead.done && pulseRead.done && transientRead.done && ffmtRead.done && plRead.done;
+}
 
 void initAcceleromter() {
-  //  1. Default init. This will set the accelerometer up
-  //     with a full-scale range of +/-2g, and an output data rate
-  //     of 800 Hz (fastest).
-  //  accel.init();
-  if (accel.begin(Wire, MMA8452Q_DEFAULT_ADDRESS) == false) {
+  /* Output data rate (ODR) is ACCEL_ODR_HZ, 12.5, 50 or 100 Hz, the
+     event timings (tap, transient, orientation debounce) follow it.
+     See data sheet for relationship between voltage and ODR (pg. 7) */
+  i2cBus.lock();                // setup still uses Wire directly
+  accel_ready = accel.begin(Wire, MMA8452Q_DEFAULT_ADDRESS);
+  if (accel_ready) {
+    // Multiply parameter by 0.0625g to calculate threshold.
+    accel.setupTransient(0x08, 50);           // 0.5g for 50ms, high-pass filtered
+    accel.setupFreefall (0x08, 60);           // all axes below 0.5g for 60ms
+    accel.setupInterrupts(INT_DRDY | INT_PULSE | INT_TRANS | INT_FF_MT | INT_LNDPRT, INT_DRDY);
+  }
+  i2cBus.unlock();
+
+  if (!accel_ready) {
     Serial.println("!! accleromter missing.");
     system_init_error++;
+    return;
   }
 
-  /* Default output data rate (ODR) is 800 Hz (fastest)
-     Set data rate using ODR_800, ODR_400, ODR_200, 
-     ODR_100, ODR_50, ODR_12, ODR_6, ODR_1
-     Sets data rate to 800, 400, 200, 100, 50, 12.5, 
-     6.25, or 1.56 Hz respectively 
-     See data sheet for relationship between voltage
-     and ODR (pg. 7) */
-  // accel.setDataRate(ODR_100);
-  
-  /* Default scale is +/-2g (full-scale range)
-     Set scale using SCALE_2G, SCALE_4G, SCALE_8G
-     Sets scale to +/-2g, 4g, or 8g respectively */
-  // accel.setScale(SCALE_4G);
-
+  setupRead(&xyzRead,       STATUS_MMA8452Q, xyzData,     7, onXYZData);
+  setupRead(&sourceRead,    INT_SOURCE,    &intSource,    1, onIntSource);
+  setupRead(&pulseRead,     PULSE_SRC,     &pulseSrc,     1, onEventSource);
+  setupRead(&transientRead, TRANSIENT_SRC, &transientSrc, 1, onEventSource);
+  setupRead(&ffmtRead,      FF_MT_SRC,     &ffmtSrc,      1, onEventSource);
+  setupRead(&plRead,        PL_STATUS,     &plStatus,     1, onEventSource);
+
+#if ACCEL_INT_WIRED
+  pinMode(ACCEL_INT1_PIN, INPUT_PULLUP);
+  pinMode(ACCEL_INT2_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(ACCEL_INT1_PIN), accel_drdy_handler,  FALLING);
+  attachInterrupt(digitalPinToInterrupt(ACCEL_INT2_PIN), accel_event_handler, FALLING);
+#endif
 }
 
 void handelAcceleromter() {
-  if (accel.available()) {      // Wait for new data from accelerometer
-    
-	// Acceleration of x, y, and z directions in g units
-/*
-	Serial.printf("\r\n%1.2f %1.2f %1.2f ",
-		accel.getCalculatedX(), 
-		accel.getCalculatedY(), 
-		accel.getCalculatedZ());
-
-	// read raw data of acceleration of x, y, and z directions
-    // Serial.print(accel.getX());
-  	// Serial.print(accel.getX());
-  	// Serial.print(accel.getX());
-
-	// Orientation of board (Right, Left, Down, Up);
-    if (accel.isRight() == true) {
-      Serial.print("Right");
-    }
-    else if (accel.isLeft() == true) {
-      Serial.print("Left");
-    }
-    else if (accel.isUp() == true) {
-      Serial.print("Up");
-    }
-    else if (accel.isDown() == true) {
-      Serial.print("Down");
-    }
-    else if (accel.isFlat() == true) {
-      Serial.print("Flat");
-    }
-*/
+  if (!accel_ready)
+    return;
+
+#if ACCEL_INT_WIRED
+  if (xyzRead.done && (accel_drdy_flag || (digitalRead(ACCEL_INT1_PIN) == LOW)))
+  {
+    portENTER_CRITICAL(&accelMux);
+    xyzTimestamp    = accel_drdy_flag ? accel_drdy_us : micros();
+    accel_drdy_flag = false;
+    portEXIT_CRITICAL(&accelMux);
+    i2cBus.submit(&xyzRead);
+  }
 
-   	// Prints "Tap" each time accelerometer detects a tap
-    if (accel.readTap() > 0) {
-      Serial.print("Tap");
-    }
+  if (eventsIdle() && (accel_event_flag || (digitalRead(ACCEL_INT2_PIN) == LOW)))
+  {
+    portENTER_CRITICAL(&accelMux);
+    sourceTimestamp  = accel_event_flag ? accel_int2_us : micros();
+    accel_event_flag = false;
+    portEXIT_CRITICAL(&accelMux);
+    i2cBus.submit(&sourceRead);
+  }
+#else
+  static uint32_t lastPoll = 0;
+  uint32_t        period   = poll_period_us;
+
+  if (eventsIdle() && xyzRead.done && (micros() - lastPoll >= period))
+  {
+    // on the ODR grid, a poll late by the loop() does not move the next one
+    lastPoll += period;
+    if (micros() - lastPoll >= period)
+      lastPoll = micros();
+    i2cBus.submit(&sourceRead);
   }
+#endif
+}
 
+uint32_t accelSampleCount(void)
+{
+  return accel_head;
+}
+
+// false if the sample is not there yet, or already overwritten
+bool accelGetSample(uint32_t index, AccelSample *sample)
+{
+  uint32_t age = accel_head - index;
+
+  if ((age == 0) || (age >= ACCEL_RING_SIZE))
+    return false;
+  *sample = accel_ring[index & (ACCEL_RING_SIZE - 1)];
+  return (accel_head - index) < ACCEL_RING_SIZE;   // not overwritten while copying
+}
+
+// the events of mask since the last call, the others stay for their own stage,
+// event_us = micros() of the lowest ACCEL_EVENT_* taken
+uint8_t accelTakeEvents(uint8_t mask, uint32_t *event_us)
+{
+  uint8_t events;
+
+  portENTER_CRITICAL(&accelMux);
+  events        = accel_events & mask;
+  accel_events &= ~mask;
+  if (event_us && events)
+    for (int i = ACCEL_EVENTS - 1; i >= 0; i--)
+      if (events & (1 << i))
+        *event_us = accel_event_us[i];
+  portEXIT_CRITICAL(&accelMux);
+  return events;
+}
+
+uint8_t accelOrientation(void)
+{
+  return accel_pl;
+}
+
+// for an event only, it waits for the bus
+uint8_t accelReadOrientation(void)
+{
+  if (!accel_ready)
+    return LOCKOUT;
+
+  i2cBus.lock();
+  accel_pl = accel.readPL();
+  i2cBus.unlock();
+  return accel_pl;
+}
+
+// Raise the ODR to 100Hz for a short capture, e.g. a fall impact. The event
+// counters keep their ACCEL_ODR_HZ values, so they run shorter meanwhile.
+// Without the INT pins the poll follows the ODR.
+void accelSetBurst(bool on)
+{
+  if (!accel_ready || (ACCEL_ODR == ODR_100))
+    return;
+
+  i2cBus.lock();
+  accel.setDataRate(on ? ODR_100 : ACCEL_ODR);
+  i2cBus.unlock();
+  poll_period_us = on ? 10000 : ACCEL_PERIOD_US;   // ODR_100
 }
 
 
@@ -283,8 +522,8 @@ bool MMA8452Q::begin(TwoWire &wirePort, uint8_t deviceAddress)
 		return false;
 	}
 
-	scale = SCALE_2G; // SCALE_2G, SCALE_4G, or SCALE_8G	
-	odr   = ODR_800;  // data rate, 1~800~Hz
+	scale = (MMA8452Q_Scale)ACCEL_SCALE_G;  // SCALE_2G, SCALE_4G, or SCALE_8G	
+	odr   = ACCEL_ODR; // data rate, 12.5, 50 or 100 Hz
 
 	setScale(scale);  // Set up accelerometer scale
 	setDataRate(odr); // Set up output data rate
@@ -492,12 +731,12 @@ void MMA8452Q::setupTap(byte xThs, byte yThs, byte zThs)
 	// Set up single and/or double tap detection on each axis individually.
 	writeRegister(PULSE_CFG, temp | 0x40);
 	// Set the time limit - the maximum time that a tap can be above the thresh
-	writeRegister(PULSE_TMLT, 0x30); // 30ms time limit at 800Hz odr
+	writeRegister(PULSE_TMLT, msToCount(30));  // 30ms time limit
 	// Set the pulse latency - the minimum required time between pulses
-	writeRegister(PULSE_LTCY, 0xA0); // 200ms (at 800Hz odr) between taps min
+	writeRegister(PULSE_LTCY, msToCount(200)); // 200ms between taps min
 	// Set the second pulse window - maximum allowed time between end of
 	//	latency and start of second pulse
-	writeRegister(PULSE_WIND, 0xFF); // 5. 318ms (max value) between taps max
+	writeRegister(PULSE_WIND, msToCount(318)); // 5. 318ms between taps max
 
 	// Return to active state when done
 	// Must be in active state to read data
@@ -533,13 +772,78 @@ void MMA8452Q::setupPL()
 	// 1. Enable P/L
 	writeRegister(PL_CFG, readRegister(PL_CFG) | 0x40); // Set PL_EN (enable)
 	// 2. Set the debounce rate
-	writeRegister(PL_COUNT, 0x50); // Debounce counter at 100ms (at 800 hz)
+	writeRegister(PL_COUNT, msToCount(100)); // Debounce counter at 100ms
 
 	// Return to active state when done
 	// Must be in active state to read data
 	active();
 }
 
+// SET UP TRANSIENT DETECTION
+//	A transient is a high-pass filtered acceleration above "ths" (0.0625g/LSB)
+//	on any axis for "ms", i.e. a movement, not the gravity or a slow tilt.
+//	The event flag is latched until TRANSIENT_SRC is read.
+void MMA8452Q::setupTransient(byte ths, uint16_t ms)
+{
+	// Must be in standby mode to make changes!
+	if (isActive() == true)
+		standby();
+
+	writeRegister(TRANSIENT_CFG, 0x1E);	// ELE latch, x/y/z event flags, high-pass on
+	writeRegister(TRANSIENT_THS, ths & 0x7F);
+	writeRegister(TRANSIENT_COUNT, msToCount(ms));
+
+	active();
+}
+
+// SET UP FREEFALL DETECTION
+//	Freefall is when x, y and z are all below "ths" (0.0625g/LSB) for "ms",
+//	the event flag is latched until FF_MT_SRC is read.
+void MMA8452Q::setupFreefall(byte ths, uint16_t ms)
+{
+	// Must be in standby mode to make changes!
+	if (isActive() == true)
+		standby();
+
+	writeRegister(FF_MT_CFG, 0xB8);		// ELE latch, OAE = 0 freefall (AND), x/y/z
+	writeRegister(FF_MT_THS, ths & 0x7F);	// DBCNTM = 0, debounce counter decrements
+	writeRegister(FF_MT_COUNT, msToCount(ms));
+
+	active();
+}
+
+// SET UP INTERRUPTS
+//	"enable" is the INT_* sources to enable (CTRL_REG4), "int1" the ones routed
+//	to the INT1 pin (CTRL_REG5), the others go to INT2. Push-pull, active low.
+void MMA8452Q::setupInterrupts(byte enable, byte int1)
+{
+	// Must be in standby mode to make changes!
+	if (isActive() == true)
+		standby();
+
+	writeRegister(CTRL_REG3, 0x00);		// IPOL = 0 active low, PP_OD = 0 push-pull
+	writeRegister(CTRL_REG4, enable);
+	writeRegister(CTRL_REG5, int1);
+
+	active();
+}
+
+// TIME TO EVENT COUNTER
+//	The debounce and time counters of the embedded functions (pulse, transient,
+//	portrait/landscape) step about once per sample in normal mode, so the
+//	register value for a time depends on the ODR. Clamped to 1..255.
+byte MMA8452Q::msToCount(uint16_t ms)
+{
+	static const uint16_t odrHz10[] = {8000, 4000, 2000, 1000, 500, 125, 63, 16};
+	uint32_t count = (uint32_t)ms * odrHz10[odr] / 10000;
+
+	if (count < 1)
+		count = 1;
+	if (count > 255)
+		count = 255;
+	return count;
+}
+
 // READ PORTRAIT/LANDSCAPE STATUS
 //	This function reads the portrait/landscape status register of the MMA8452Q.
 //	It will return either PORTRAIT_U, PORTRAIT_D, LANDSCAPE_R, LANDSCAPE_L,
@@ -0,0 +1,211 @@
+/*---------------------------------------------------------------------------------
+  Backfill - the recorded blocks (recorder.cpp) to the app, after a reconnect
+
+  The app writes a request to the backfill characteristic:
+    BACKFILL_RANGE   u32 from_ms, u32 to_ms       recorder time (recorderNow())
+    BACKFILL_RESUME  u32 seq, u32 end_seq         from the last block it got
+    BACKFILL_STOP
+    BACKFILL_STATUS
+  and gets notifications:
+    BACKFILL_DATA    u32 seq, u8 part, u8 parts, the block bytes (RecBlock, header
+                     and data) cut to the MTU
+    BACKFILL_STATUS  u32 cursor, u32 end, u32 oldest, u32 newest, u32 now_ms, sent
+                     at a status request, at the end of a range and at "OK"
+  The seq of the blocks is the resume cursor: after a disconnect the app resumes
+  from the last seq it got complete. A block lost in flash is skipped, the app
+  sees the seq jump.
+
+  The blocks go out after the live data of each handleBLE(), one notification a
+  pass and BACKFILL_PACE_US apart, no more than BACKFILL_BYTES_PER_S (token
+  bucket, BACKFILL_BURST bytes at once). loop() never waits for the backfill, an
+  ECG sample comes every 8ms and the ADS1292R keeps only one: the ECG samples
+  lost while sending are counted (overrun.cpp) and shown by "backfill".
+  host/backfill_test.cpp measures the drain time of a full partition.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define BACKFILL_BYTES_PER_S  12000
+#define BACKFILL_BURST        1024      // bytes, tokens kept at most
+#define BACKFILL_PACE_US      3000      // between two notifications, as the delay(3) of handleBLE()
+#define BACKFILL_DATA_HEADER  7         // type, seq, part, parts
+#define BACKFILL_STATUS_SIZE  21
+
+enum BackfillType {BACKFILL_DATA = 1, BACKFILL_RANGE, BACKFILL_RESUME, BACKFILL_STOP, BACKFILL_STATUS};
+
+static volatile bool  request_pending = false;    // written by the BLE task
+static uint8_t   request[9];
+
+static bool      active        = false;
+static bool      status_pending = false;
+static uint32_t  cursor        = 0;     // next block
+static uint32_t  end_seq       = 0;     // exclusive
+static RecBlock  block;
+static bool      block_valid   = false;
+static uint8_t   part          = 0;
+static uint32_t  tokens        = 0;
+static uint32_t  tokens_ms     = 0;
+static uint32_t  sent_us       = 0;     // the last notification
+static uint32_t  missed_start  = 0;     // ECG samples lost (overrun.cpp) when sending started
+
+static uint32_t  backfill_blocks = 0, backfill_skipped = 0, backfill_bytes = 0, backfill_missed = 0;
+
+static uint32_t get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+/*---------------------------------------------------------------------------------
+ called by the characteristic callback (BLE task), done in loop()
+---------------------------------------------------------------------------------*/
+void backfillRequest(const uint8_t *data, int length)
+{
+  if ((length < 1) || request_pending)
+    return;
+  memset(request, 0, sizeof(request));
+  memcpy(request, data, min(length, (int)sizeof(request)));
+  request_pending = true;
+}
+
+// the app is back ("OK"), tell it what is recorded
+void backfillAnnounce(void)
+{
+  status_pending = true;
+}
+
+static void setActive(bool on)
+{
+  if (active)
+    backfill_missed += overrunCount(OVR_ECG) - missed_start;
+  missed_start = overrunCount(OVR_ECG);
+  active       = on;
+  recorderHold(on);                     // the blocks being sent are not erased ahead
+}
+
+static void startRequest(void)
+{
+  switch (request[0])
+  {
+    case BACKFILL_RANGE:
+      cursor  = recorderFind(get32(&request[1]));
+      end_seq = min(recorderFind(get32(&request[5])) + 1, recorderNewest());
+      setActive(true);
+      break;
+    case BACKFILL_RESUME:
+      cursor  = max(get32(&request[1]), recorderOldest());
+      end_seq = min(get32(&request[5]), recorderNewest());
+      setActive(true);
+      break;
+    case BACKFILL_STOP:
+      setActive(false);
+      break;
+    case BACKFILL_STATUS:
+      break;
+    default:
+      return;
+  }
+  block_valid    = false;
+  status_pending = true;
+  LOG_I(LOG_REC, "Backfill: request %u, blocks %u..%u", request[0], cursor, end_seq);
+}
+
+/*---------------------------------------------------------------------------------
+ the next notification, called by handleBLE() once a pass, 0: none this pass
+ max: the characteristic value size (MTU - 3)
+---------------------------------------------------------------------------------*/
+int backfillNext(uint8_t *packet, int max)
+{
+  uint32_t  now = millis();
+  int       size, parts, length;
+
+  if (micros() - sent_us < BACKFILL_PACE_US)
+    return 0;
+  if (request_pending)
+  {
+    startRequest();
+    request_pending = false;
+  }
+
+  if (status_pending)
+  {
+    packet[0] = BACKFILL_STATUS;
+    put32(&packet[1],  cursor);
+    put32(&packet[5],  active ? end_seq : cursor);
+    put32(&packet[9],  recorderOldest());
+    put32(&packet[13], recorderNewest());
+    put32(&packet[17], recorderNow());
+    status_pending = false;
+    sent_us        = micros();
+    return BACKFILL_STATUS_SIZE;
+  }
+  if (!active)
+    return 0;
+
+  // bandwidth cap
+  tokens    = min(tokens + (now - tokens_ms) * BACKFILL_BYTES_PER_S / 1000, (uint32_t)BACKFILL_BURST);
+  tokens_ms = now;
+  if (tokens < (uint32_t)max)
+    return 0;
+
+  while (!block_valid)
+  {
+    if ((cursor < recorderOldest()) || (cursor >= end_seq))
+    {
+      // overwritten while sending, or done
+      if (cursor >= end_seq)
+      {
+        setActive(false);
+        status_pending = true;
+        return backfillNext(packet, max);
+      }
+      backfill_skipped += recorderOldest() - cursor;
+      cursor = recorderOldest();
+      continue;
+    }
+    block_valid = recorderRead(cursor, &block);
+    part        = 0;
+    if (!block_valid)
+    {
+      backfill_skipped++;
+      cursor++;
+    }
+  }
+
+  size   = REC_HEADER_SIZE + block.length;
+  max   -= BACKFILL_DATA_HEADER;
+  parts  = (size + max - 1) / max;
+  length = min(size - part * max, max);
+
+  packet[0] = BACKFILL_DATA;
+  put32(&packet[1], cursor);
+  packet[5] = part;
+  packet[6] = parts;
+  memcpy(&packet[BACKFILL_DATA_HEADER], (uint8_t *)&block + part * max, length);
+
+  if (++part >= parts)
+  {
+    block_valid = false;
+    cursor++;
+    backfill_blocks++;
+  }
+  length += BACKFILL_DATA_HEADER;
+  tokens -= length;
+  backfill_bytes += length;
+  sent_us         = micros();
+  return length;
+}
+
+void printBackfill(void)
+{
+  uint32_t missed = backfill_missed + (active ? overrunCount(OVR_ECG) - missed_start : 0);
+
+  Serial.printf("backfill %s, blocks %u..%u, sent %u blocks %u bytes, skipped %u, ECG missed %u while sending\r\n",
+                active ? "sending" : "idle", cursor, end_seq, backfill_blocks, backfill_bytes, backfill_skipped, missed);
+}
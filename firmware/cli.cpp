@@ -6,39 +6,97 @@
   Reference:
   https://www.norwegiancreations.com/2018/02/creating-a-command-line-interface-in-arduinos-serial-monitor/
 
+  handleCLI() takes only the bytes already received, at most CLI_BYTES_PER_CALL
+  each loop(), into a fixed line buffer and runs the command when the line ends,
+  so typing never stops loop() (readStringUntil() waited up to 1s for the '\n').
+    backspace     erases the last character
+    up / down     the last CLI_HISTORY lines (VT100 arrow keys)
+  The commands are in a table, other modules add theirs with cliAddCommand() and
+  read the arguments with cliArg().
 ---------------------------------------------------------------------------------*/
 #include "firmware.h"
 
 int  cmd_help();
 int  cmd_reg();
-void help_help();
-void help_reg();
+int  cmd_i2c();
+int  cmd_motion();
+int  cmd_sqi();
+int  cmd_hist();
+int  cmd_hr();
+int  cmd_pat();
+int  cmd_rec();
+int  cmd_ble();
+int  cmd_stream();
 
 #if CLI_FEATURE
 #define LINE_BUF_SIZE   128     //Maximum input string length
 #define ARG_BUF_SIZE    64      //Maximum argument string length
 #define MAX_NUM_ARGS    8       //Maximum number of arguments
- 
+#define CLI_HISTORY     4       //Lines kept for the up arrow
+#define CLI_BYTES_PER_CALL  64  //Bytes taken from the UART in a loop()
+
+struct CliCommand
+{
+  const char *name;
+  CliFunc     func;
+  const char *help;
+};
+
 bool    error_flag = false;
  
 char line[LINE_BUF_SIZE];
 char args[MAX_NUM_ARGS][ARG_BUF_SIZE];
 
-//List of functions pointers corresponding to each command
-int (*commands_func[])(){
-    &cmd_help,
-    &cmd_reg
+//List of the commands of this file
+static const CliCommand builtin[] = {
+    {"help",   cmd_help,   "help [command]"},
+    {"reg",    cmd_reg,    "reg address value, set an ADS1292R register (hex)"},
+    {"i2c",    cmd_i2c,    "latency and errors of each I2C device"},
+    {"motion", cmd_motion, "motion [on|off], PPG motion artifact cancellation"},
+    {"sqi",    cmd_sqi,    "signal quality of the last ECG and PPG windows"},
+    {"hist",   cmd_hist,   "heart rate histogram"},
+    {"hr",     cmd_hr,     "fused heart rate, confidence, ECG and PPG rates"},
+    {"pat",    cmd_pat,    "pulse arrival time and its trend"},
+    {"rec",    cmd_rec,    "flash recorder and backfill"},
+    {"ble",    cmd_ble,    "NACKs from the app and packets sent again"},
+    {"stream", cmd_stream, "stream [on [baud]|off], binary frames on the serial port"},
 };
- 
-//List of command names
-const char *commands_str[] = {
-    "help",
-    "reg",
-};
- 
-int num_commands = sizeof(commands_str) / sizeof(char *);
+static const int num_builtin = sizeof(builtin) / sizeof(builtin[0]);
+
+//Commands added by the other modules
+static CliCommand added[CLI_MAX_COMMANDS];
+static int        num_added = 0;
+
+static int        line_length = 0;
+static char       history[CLI_HISTORY][LINE_BUF_SIZE];
+static uint32_t   history_count = 0;    // lines entered
+static uint32_t   history_back  = 0;    // 0 = the new line, 1 = the last one, ...
+static uint8_t    escape = 0;           // 1 after ESC, 2 after ESC [
+
+/*---------------------------------------------------------------------------------
+ command table
+---------------------------------------------------------------------------------*/
+bool cliAddCommand(const char *name, CliFunc func, const char *help){
+    if(num_added >= CLI_MAX_COMMANDS)
+        return false;
+    added[num_added++] = {name, func, help};
+    return true;
+}
+
+const char *cliArg(int i){
+    return ((i >= 0) && (i < MAX_NUM_ARGS)) ? args[i] : "";
+}
+
+static const CliCommand *findCommand(const char *name){
+    for(int i=0; i<num_builtin; i++)
+        if(strcmp(name, builtin[i].name) == 0)
+            return &builtin[i];
+    for(int i=0; i<num_added; i++)
+        if(strcmp(name, added[i].name) == 0)
+            return &added[i];
+    return NULL;
+}
 
- 
 void parse_line(){
     char *argument;
     int counter = 0;
@@ -65,48 +123,34 @@ void parse_line(){
 }
  
 int execute(){  
-    for(int i=0; i<num_commands; i++){
-        if(strcmp(args[0], commands_str[i]) == 0){
-            return(*commands_func[i])();
-        }
-    }
+    const CliCommand *command = findCommand(args[0]);
+
+    if(command != NULL)
+        return command->func();
  
     Serial.println("Invalid command. Type \"help\" for more.");
     return 0;
 }
 
 int cmd_help(){
-    if(args[1] == NULL){
-        help_help();
-    }
-    else if(strcmp(args[1], commands_str[0]) == 0){
-        help_help();
-    }
-    else if(strcmp(args[1], commands_str[1]) == 0){
-        help_reg();
-    }
-    else{
-        help_help();
+    const CliCommand *command = findCommand(args[1]);
+
+    if(command != NULL){
+        Serial.printf("  %-8s %s\r\n", command->name, command->help);
+        return 0;
     }
-}
- 
-void help_help(){
+
     Serial.println("The following commands are available:");
- 
-    for(int i=0; i<num_commands; i++){
-        Serial.print("  ");
-        Serial.println(commands_str[i]);
-    }
+    for(int i=0; i<num_builtin; i++)
+        Serial.printf("  %-8s %s\r\n", builtin[i].name, builtin[i].help);
+    for(int i=0; i<num_added; i++)
+        Serial.printf("  %-8s %s\r\n", added[i].name, added[i].help);
     Serial.println("");
     Serial.println("You can for instance type \"help reg\" for more info on the reg command.");
+    return 0;
 }
 
 //-----------------------------------------
-void help_reg(){
-    Serial.print("Set ADS1292R's register by \"reg adress value\n");
-    Serial.println("  ");
-}
- 
 extern void set_ads1292_register(uint8_t address, uint8_t data); 
 int cmd_reg(){
     int8_t address, value;
@@ -120,37 +164,171 @@ int cmd_reg(){
     //Serial.printf("set register @ %x = %x.\r\n", address, value);
     set_ads1292_register(address, value);
 }
+//-----------------------------------------
+int cmd_i2c(){
+    i2cBus.printStats();    // latency and errors of each I2C device
+    return 0;
+}
+//-----------------------------------------
+int cmd_motion(){
+    // "motion on" / "motion off" switch the PPG motion artifact cancellation
+    if(strncmp(args[1], "on", 2) == 0)
+        motion_cancel_on = true;
+    else if(strncmp(args[1], "off", 3) == 0)
+        motion_cancel_on = false;
+
+    Serial.printf("motion cancel %s, index %u mg\r\n", motion_cancel_on ? "on" : "off", motion_index);
+    return 0;
+}
+//-----------------------------------------
+int cmd_sqi(){
+    printQuality();         // signal quality of the last ECG and PPG windows
+    return 0;
+}
+//-----------------------------------------
+int cmd_hist(){
+    printHistogram();       // heart rate histogram, median and 5/95 percentiles
+    return 0;
+}
+//-----------------------------------------
+int cmd_hr(){
+    printFusion();          // fused heart rate, confidence, ECG and PPG rates
+    return 0;
+}
+//-----------------------------------------
+int cmd_pat(){
+    printPat();             // pulse arrival time and its trend
+    return 0;
+}
+//-----------------------------------------
+int cmd_rec(){
+    printRecorder();        // flash recorder blocks, errors and wear
+    printBackfill();        // blocks sent to the app after a reconnect
+    return 0;
+}
+//-----------------------------------------
+int cmd_ble(){
+    printRetransmit();      // NACKs from the app and stream packets sent again
+    return 0;
+}
+//-----------------------------------------
+int cmd_stream(){
+    // "stream on [baud]" binary frames on the serial port, "stream off" back to text
+    if(strncmp(args[1], "on", 2) == 0)
+        serialStreamSet(args[2][0] ? strtoul(args[2], NULL, 10) : SERIAL_STREAM_BAUD);
+    else if(strncmp(args[1], "off", 3) == 0)
+        serialStreamSet(0);
+    else
+        Serial.printf("binary stream %s\r\n", serial_streaming ? "on" : "off");
+    return 0;
+}
 /*---------------------------------------------------------------------------------
- called from firmware.ino
+ line editing
 ---------------------------------------------------------------------------------*/
-void handleCLI(){
-  static String line_string;
-    if(!Serial.available()) return; // check if there is new serial data
- 
-    if(Serial.available()){
-        line_string = Serial.readStringUntil('\n');
-        if(line_string.length() < LINE_BUF_SIZE){
-          line_string.toCharArray(line, LINE_BUF_SIZE);
-          Serial.println(line_string);
-        }
-        else{
-          Serial.println("Input too long.");
-          error_flag = true;
-        }
-    }
+static void echo(const char *text){
+    if(!serial_streaming)           // the binary frames own the port
+        Serial.print(text);
+}
 
-    if(!error_flag){
-        parse_line();
+static void showLine(){
+    echo("\r\x1b[K");               // start of the line, erase it
+    echo(line);
+}
+
+static void recallHistory(int step){
+    uint32_t stored = min(history_count, (uint32_t)CLI_HISTORY);
+
+    if((step > 0) && (history_back < stored))
+        history_back++;
+    else if((step < 0) && (history_back > 0))
+        history_back--;
+    else
+        return;
+
+    if(history_back == 0)
+        line[0] = 0;
+    else
+        strcpy(line, history[(history_count - history_back) % CLI_HISTORY]);
+    line_length = strlen(line);
+    showLine();
+}
+
+static void runLine(){
+    if((line_length == 0) && !error_flag)
+        return;                     // the '\n' of "\r\n", or an empty line
+
+    echo("\r\n");
+    if(error_flag){
+        Serial.println("Input too long.");
     }
-    if(!error_flag){
-        execute();
+    else{
+        if((history_count == 0) || strcmp(line, history[(history_count - 1) % CLI_HISTORY]))
+            strcpy(history[history_count++ % CLI_HISTORY], line);
+        parse_line();
+        if(!error_flag){
+            execute();
+        }
     }
- 
+
     memset(line, 0, LINE_BUF_SIZE);
     memset(args, 0, sizeof(args[0][0]) * MAX_NUM_ARGS * ARG_BUF_SIZE);
- 
-    error_flag = false;
+    line_length  = 0;
+    history_back = 0;
+    error_flag   = false;
+}
+
+/*---------------------------------------------------------------------------------
+ called from firmware.ino, never waits
+---------------------------------------------------------------------------------*/
+void handleCLI(){
+    int n = min(Serial.available(), CLI_BYTES_PER_CALL);
+
+    while(n-- > 0){
+        char c = Serial.read();
+
+        if(escape == 1){
+            escape = (c == '[') ? 2 : 0;
+            continue;
+        }
+        if(escape == 2){
+            escape = 0;
+            if(c == 'A') recallHistory(1);
+            if(c == 'B') recallHistory(-1);
+            continue;
+        }
+
+        switch(c){
+            case '\r':
+            case '\n':                  // "\r\n" ends the line once, the empty one is skipped
+                runLine();
+                break;
+            case '\b':
+            case 0x7F:
+                if(line_length > 0){
+                    line[--line_length] = 0;
+                    echo("\b \b");
+                }
+                break;
+            case 0x1B:
+                escape = 1;
+                break;
+            default:
+                if((c < ' ') || error_flag)
+                    break;
+                if(line_length < LINE_BUF_SIZE - 1){
+                    line[line_length++] = c;
+                    line[line_length]   = 0;
+                    char text[2] = {c, 0};
+                    echo(text);
+                }
+                else
+                    error_flag = true;  // the rest of the line is dropped
+                break;
+        }
+    }
 }
 #else
 void handleCLI(){}
+bool cliAddCommand(const char *name, CliFunc func, const char *help){ return false; }
+const char *cliArg(int i){ return ""; }
 #endif //CLI_FEATURE
\ No newline at end of file
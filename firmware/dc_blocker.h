@@ -0,0 +1,56 @@
+/*---------------------------------------------------------------------------------
+  One pole DC blocker (high pass) in fixed point
+
+    y[n] = x[n] - x[n-1] + p * y[n-1]           DC blocker, gain 1
+    y[n] = p * (x[n] - x[n-1] + y[n-1])         EMA form, y = x - EMA(x), a = 1 - p
+
+  The pole p is a Q15 (32 bits product) or Q31 (64 bits product) constant, set
+  at compile time:
+
+    DCBlocker<int16_t, int64_t, 31, Q31(0.992)>       ecgDC;
+    DCBlocker<int32_t, int64_t, 31, Q31(0.8), true>   ppgDC;
+
+  The DC blocker truncates the product toward zero, like the "short temp1 =
+  0.992 * y" it replaces, without the software double multiply (the ESP32 FPU is
+  single precision only). With 16 bits samples a Q31 pole gives the same output
+  as the double version: Q31(0.992) is above 0.992 by less than 1e-10, so the
+  product of a 16 bits y is above 0.992 * y by less than 1e-5, while 124y/125 is
+  an integer or 0.008 from one, and the truncation of both is the same. host/bench
+  checks it for every y and on the ECG and random samples. A Q15 pole (0.992004)
+  is not: its product is off by up to 0.13, fed back with gain 1 / (1 - p), 7 LSB
+  on random samples. The EMA form rounds, its error is fed back the same way.
+---------------------------------------------------------------------------------*/
+#pragma once
+#include <stdint.h>
+
+#define Q15(x)    ((int32_t)((x) * 32768.0 + 0.5))
+#define Q31(x)    ((int64_t)((x) * 2147483648.0 + 0.5))
+
+template <typename T, typename Acc, int Q, int64_t POLE, bool EMA = false>
+class DCBlocker
+{
+  public:
+    // start from x, as if x had always been the input (output 0)
+    void restart(T x)
+    {
+      x1 = x;
+      y1 = 0;
+    }
+
+    T process(T x)
+    {
+      Acc acc;
+
+      if (EMA)
+        acc = (((Acc)x - x1 + y1) * (Acc)POLE + ((Acc)1 << (Q - 1))) >> Q;
+      else
+        acc = (Acc)x - x1 + (T)((Acc)POLE * y1 / ((Acc)1 << Q));
+      x1 = x;
+      y1 = (T)acc;
+      return y1;
+    }
+
+  private:
+    T x1 = 0;
+    T y1 = 0;
+};
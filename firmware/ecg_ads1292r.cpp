@@ -61,6 +61,8 @@ extern unsigned short QRS_Heart_Rate, Respiration_Rate;
 void QRS_Algorithm_Interface(short CurrSample);
 void RESP_Algorithm_Interface(short CurrSample);
 void ECG_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut);
+void ECG_Restart(void);
+extern unsigned char QRS_HR_Provisional;
 void Resp_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut);
 extern Queue ecg_queue;
  
@@ -73,10 +75,27 @@ tCLK = (use 2us) 1775~2170 ns, when DVDD = 3.3V, when CLK_DIV = 0
 tMOD = (use 8us) 4 tCLK, when CLK_DIV = 0. 
 */
 #define CS_LOW_TIME    0 // tCSSC - CS low to first SCLK, setup time. > 6 ns 
-#define CS_HIGH_TIME   0 // tCSH  - CS high pulse, > 2 tCLK (use 4us)
+#define CS_HOLD_TIME   8 // tSCCS - last SCLK to CS high, > 4 tCLK (use 8us)
+#define CS_HIGH_TIME   4 // tCSH  - CS high pulse, > 2 tCLK (use 4us)
 #define PWDN_TIME_LOW  2 // hold > 29 tMOD to power down the device is. (use 250 us)
 #define PWDN_TIME_HIGH 40// tPOR Wait after power-up until reset > 4096 tMOD (32ms)
 #define START_TIME     3 // START Pin, wait >4100 tMOD to use (2ms)
+
+/*
+SPI clock
+Opcodes and register data are decoded by the device every byte, multi-byte commands 
+need 4 tCLK (tSDECODE, 7.8us) between the bytes: 8 SCLK >= 8us -> SCLK <= 1MHz.
+This is why the higher global SPI clock made ECG stop working.
+Reading the 9 bytes data in RDATAC mode has no decode delay, SCLK can be the 
+datasheet maximum (tSCLK > 50ns, 20MHz). 8MHz is used to leave margin for wiring.
+*/
+#define SPI_COMMAND_CLOCK   1000000
+#define SPI_DATA_CLOCK      8000000
+
+const SPIDevice ads1292rCommand = {ADS1292_CS_PIN, SPI_COMMAND_CLOCK, SPI_MODE1, 
+                                   CS_LOW_TIME, CS_HOLD_TIME, CS_HIGH_TIME};
+const SPIDevice ads1292rData    = {ADS1292_CS_PIN, SPI_DATA_CLOCK,    SPI_MODE1, 
+                                   CS_LOW_TIME, CS_HOLD_TIME, CS_HIGH_TIME};
  
 // Register Read Commands
 #define RREG    0x20    //Read n nnnn registers starting at address r rrrr
@@ -129,21 +148,28 @@ uint8_t register_settings[SETTING_SIZE] = {
   0b00000011, //#REG_RESP2	  0x0A  respiration: Calib OFF, respiration freq defaults
   0b00001100  //#REG_GPIO     0x0B
 }; 
-#define HISTGRM_CALC_TH        10
-
-uint32_t  heart_rate_histogram[HISTGRM_DATA_SIZE];
-uint8_t   histogram_percent   [HISTGRM_PERCENT_SIZE];
-uint8_t   hr_percent_count    = 0;
 uint8_t   hrv_array[HVR_ARRAY_SIZE];
-uint8_t   heart_rate_pack  [3];
+uint8_t   heart_rate_pack  [HEART_RATE_PACK_SIZE];
 bool      hrvDataReady        = false;
-bool      histogramReady      = false;
-uint8_t   ecg_lead_off        = false;
+uint8_t   ecg_lead_off        = true;
+uint32_t  ecg_first_hr_ms     = 0;    // lead-on to the first (provisional) heart rate
+uint32_t  ecg_stable_hr_ms    = 0;    // lead-on to the first averaged heart rate
 uint8_t   LeadStatus;
 
 volatile uint8_t    npeakflag   = 0;
 volatile uint8_t    respirationRate = 0;
 volatile bool       ads1292r_interrupt_flag   = false;
+volatile uint32_t   ads1292r_drdy_us          = 0;
+volatile uint32_t   ads1292r_drdy_count       = 0;    // DRDYs, more than the samples read is an overrun
+
+#define ECG_SAMPLE_US         8000      // 125 SPS
+
+// the QRS detector input is behind the R wave by the filter delay
+#if (ECG_DETECTOR_FILTER == ECG_FILTER_IIR)
+#define ECG_DETECT_DELAY_US   8000      // about 1 sample
+#else
+#define ECG_DETECT_DELAY_US   640000    // 161 taps FIR, 80 samples
+#endif
 
 ADS1292R    ads1292r;
 
@@ -151,7 +177,10 @@ void IRAM_ATTR ads1292r_interrupt_handler(void)
 {
   portENTER_CRITICAL_ISR(&ads1292rMux);
   ads1292r_interrupt_flag = true;
+  ads1292r_drdy_us        = micros();
+  ads1292r_drdy_count++;
   portEXIT_CRITICAL_ISR (&ads1292rMux);  
+  TRACE_MARK(TR_ECG_DRDY, ads1292r_drdy_count);
 }
  
 void pin_level_high(uint8_t pin, uint32_t ms)
@@ -172,8 +201,6 @@ void ADS1292R :: init(void)
   uint8_t data_rx[SETTING_SIZE]; 
   int i, address;
 
-  SPI.setDataMode(SPI_MODE1);
-
   // after power on, wait device boot up
   while (millis()<PWDN_TIME_HIGH)
   {
@@ -182,7 +209,7 @@ void ADS1292R :: init(void)
   }
 
   // reset device
-  pin_level_high(ADS1292_CS_PIN,CS_HIGH_TIME); //initial CS
+  pin_level_high(ADS1292_CS_PIN,0);              //initial CS
   pin_level_low(ADS1292_PWDN_PIN,PWDN_TIME_LOW);  
   pin_level_high(ADS1292_PWDN_PIN,PWDN_TIME_HIGH);  
 
@@ -192,10 +219,10 @@ void ADS1292R :: init(void)
   pin_level_low(ADS1292_START_PIN,START_TIME);       // stop 
 
   //------------------------------------------------
-  pin_level_low(ADS1292_CS_PIN,CS_LOW_TIME);
+  vspiBus.select(ads1292rCommand);
   //------------------------------------------------
            
-  SPI.transfer(SDATAC);         // stop data reading mode before write regiters
+  vspiBus.transfer(SDATAC);     // stop data reading mode before write regiters
 
   //------------------------------------------------
   // test functions (connect with 1Hz test square test signal)
@@ -215,12 +242,12 @@ void ADS1292R :: init(void)
   // 000nnnnn, nnnnn = the number of registers to write – 1
   uint8_t OPCODE2 = SETTING_SIZE - 1;                   
   
-  SPI.transfer(OPCODE1);   
-  SPI.transfer(OPCODE2);	
+  vspiBus.transfer(OPCODE1);   
+  vspiBus.transfer(OPCODE2);	
      
   for(i = 0,address = 0x00; i<SETTING_SIZE; address++, i++)	
     register_settings[i] = mask_register_bits(address, register_settings[i]);
-  SPI.transferBytes(register_settings, data_rx, SETTING_SIZE);
+  vspiBus.transferBytes(register_settings, data_rx, SETTING_SIZE);
 
   //------------------------------------------------
   // verify registers
@@ -230,10 +257,10 @@ void ADS1292R :: init(void)
   OPCODE1 = 0x00 | RREG;  
   // 000nnnnn, nnnnn = the number of registers to write – 1
   OPCODE2 = SETTING_SIZE - 1;                 
-  SPI.transfer(OPCODE1);   
-  SPI.transfer(OPCODE2);	
+  vspiBus.transfer(OPCODE1);   
+  vspiBus.transfer(OPCODE2);	
 
-  SPI.transferBytes(register_settings, data_rx, SETTING_SIZE);
+  vspiBus.transferBytes(register_settings, data_rx, SETTING_SIZE);
 
   for(i=0; i<SETTING_SIZE; i++)	
   {
@@ -248,10 +275,10 @@ void ADS1292R :: init(void)
   } 
 
   // start to read data continuously
-  SPI.transfer(RDATAC);  
+  vspiBus.transfer(RDATAC);  
   
   //------------------------------------------------
-  pin_level_high(ADS1292_CS_PIN,CS_HIGH_TIME);
+  vspiBus.deselect(ads1292rCommand);
   //------------------------------------------------
   
   // Conversions begin, when "START pin is high" OR "START opcode is received"
@@ -264,7 +291,15 @@ void ADS1292R :: init(void)
 void ADS1292R :: getData()
 {
   int16_t     ecg_wave_sample,  ecg_filterout;
+  int16_t     ecg_detect;       // QRS detector input
   int16_t     res_wave_sample,  resp_filterout;
+  bool        ecg_saturated;
+  uint32_t    sample_us;        // micros() at data ready
+  uint32_t    drdy_count;
+  static uint32_t drdy_read = 0;  // DRDY count of the last sample read
+  static uint32_t drdy_read_us;   // and its time
+  uint32_t    missed;           // samples since the last one read, 1 = none lost
+  static uint32_t lead_on_time;
   uint16_t    ecg_stream_cnt = 0;
   
   union ads { 
@@ -282,17 +317,29 @@ void ADS1292R :: getData()
   if (ads1292r_interrupt_flag==false)
     return;   //wait data to be ready
 
+  TRACE_BEGIN(TR_ECG_DATA);
   portENTER_CRITICAL_ISR(&ads1292rMux);
   ads1292r_interrupt_flag = false;
+  sample_us               = ads1292r_drdy_us;
+  drdy_count              = ads1292r_drdy_count;
   portEXIT_CRITICAL_ISR (&ads1292rMux);  
 
-  SPI.setDataMode(SPI_MODE1);
+  // DRDY came again before the last sample was read, that one is lost. With the
+  // interrupts off (a flash erase stalls both cores) the DRDYs of the stall are
+  // one interrupt at its end, the time since the last one tells how many
+  if (drdy_read != 0)
+  {
+    missed = max(drdy_count - drdy_read, (uint32_t)((sample_us - drdy_read_us + ECG_SAMPLE_US / 2) / ECG_SAMPLE_US));
+    if (missed > 1)
+      overrunMissed(OVR_ECG, missed - 1);
+  }
+  drdy_read    = drdy_count;
+  drdy_read_us = sample_us;
 
   // read the data 
-  pin_level_low (ADS1292_CS_PIN,CS_LOW_TIME);
-  SPI.transferBytes(SPI_TxBuffer, SPI_RxBuffer, SPI_BUFFER_SIZE);
-
-  pin_level_high(ADS1292_CS_PIN,CS_HIGH_TIME); 
+  vspiBus.select(ads1292rData);
+  vspiBus.transferBytes(SPI_TxBuffer, SPI_RxBuffer, SPI_BUFFER_SIZE);
+  vspiBus.deselect(ads1292rData);
 
   //channel 1 - take the lower bits of respiration ADC
   ads_sample.u_sample8[1] = SPI_RxBuffer[3];
@@ -305,6 +352,8 @@ void ADS1292R :: getData()
   ads_sample.u_sample8[2] = SPI_RxBuffer[6];
   ads_sample.u_sample8[1] = SPI_RxBuffer[7];
   ads_sample.u_sample8[0] = SPI_RxBuffer[8];
+  // ADC code at the rail (24 bits), the input is overdriven
+  ecg_saturated = (ads_sample.u_sample32 == 0x7FFFFF) || (ads_sample.u_sample32 == 0x800000);
   ads_sample.u_sample32   = ads_sample.u_sample32>>4;
   ecg_wave_sample         = ads_sample.sample16[0];
 
@@ -344,9 +393,20 @@ void ADS1292R :: getData()
     ecg_filterout     = 0;
     resp_filterout    = 0;      
     ecg_heart_rate    = 0;
+    ecgQualityReset();
   }  
   else 
   { // the measure lead is ON the body 
+    if (ecg_lead_off)
+    { // lead-on: filters and QRS detector start from this sample
+      ECG_Restart();
+      ECG_IIRRestart(ecg_wave_sample);
+      hrFusionEcgRestart();
+      patEcgRestart();
+      lead_on_time      = millis();
+      ecg_first_hr_ms   = 0;
+      ecg_stable_hr_ms  = 0;
+    }
     ecg_lead_off      = false;
     // filter out the line noise @40Hz cutoff 161 order
     Resp_ProcessCurrSample (&res_wave_sample, &resp_filterout); //filter current resp sample
@@ -354,9 +414,42 @@ void ADS1292R :: getData()
     //= Respiration_Rate;
     //FIXME add code process above data, send to BLE
 
-    ECG_ProcessCurrSample (&ecg_wave_sample, &ecg_filterout);   //filter ecg sample
-    QRS_Algorithm_Interface(ecg_filterout); //calculate heart rate
-    ecg_heart_rate = QRS_Heart_Rate;  //changed by QRS_Algorithm_Interface
+    TRACE_BEGIN(TR_ECG_FILTER);
+    ECG_ProcessCurrSample (&ecg_wave_sample, &ecg_filterout);   //filter ecg sample, display
+  #if (ECG_DETECTOR_FILTER == ECG_FILTER_IIR)
+    ecg_detect = ECG_IIRProcess(ecg_wave_sample);                // low latency, detector
+  #else
+    ecg_detect = ecg_filterout;
+  #endif
+    TRACE_END(TR_ECG_FILTER);
+    ecgQualityAdd(ecg_detect, ecg_saturated);
+
+    // every sample to the detector, so its history and sample counts go on
+    // through a bad window; the heart rate and the beats only if the last 2s
+    // window was good enough
+    QRS_Algorithm_Interface(ecg_detect); //calculate heart rate
+    if (ecgQualityGood())
+    {
+      ecg_heart_rate = QRS_Heart_Rate;  //changed by QRS_Algorithm_Interface
+      patEcgSample(ecg_detect, sample_us - ECG_DETECT_DELAY_US, npeakflag);  // R wave time
+
+      // time to the first heart rate after lead-on
+      if (ecg_heart_rate && !ecg_first_hr_ms)
+      {
+        ecg_first_hr_ms = millis() - lead_on_time;
+        LOG_I(LOG_ECG, "ECG: first heart rate %u after %ums", ecg_heart_rate, ecg_first_hr_ms);
+      }
+      if (ecg_heart_rate && !QRS_HR_Provisional && !ecg_stable_hr_ms)
+      {
+        ecg_stable_hr_ms = millis() - lead_on_time;
+        LOG_I(LOG_ECG, "ECG: averaged heart rate %u after %ums", ecg_heart_rate, ecg_stable_hr_ms);
+      }
+    }
+    else
+    {
+      ecg_heart_rate = 0;
+      npeakflag      = 0;               // a beat in noise, not for HRV, histogram and fusion
+    }
     //-------------------------------------------
     // only enable this line, and use Aduino 
     // Serial Plotter to display ecg graphic
@@ -367,14 +460,21 @@ void ADS1292R :: getData()
     if(npeakflag == 1)
     {
       fillTxBuffer((uint8_t)ecg_heart_rate, respirationRate);
-      add_heart_rate_histogram((uint8_t)ecg_heart_rate);
+      hrHistogramAdd((uint8_t)ecg_heart_rate);
+      hrFusionEcgBeat(sample_us - ECG_DETECT_DELAY_US);
       npeakflag = 0;
     }
 
-    // store to ble tx queque
-    if (bleDeviceConnected)
-      ecg_queue.push(&ecg_filterout);
+    // wired binary stream, full rate raw and filtered
+    {
+      int32_t channels[4] = {ecg_wave_sample, ecg_filterout, res_wave_sample, resp_filterout};
+      serialStreamSample(SER_ECG, sample_us, channels);
+    }
+
+    // store to ble tx queque, or to flash while not connected, after the gap markers
+    overrunSample(OVR_ECG, ecg_filterout);
   }
+  TRACE_END(TR_ECG_DATA);
 } 
 /*--------------------------------------------------------------------------------- 
  heart rate variability (HRV)
@@ -505,32 +605,6 @@ uint8_t* ADS1292R :: fillTxBuffer(uint8_t peakvalue,uint8_t respirationRate)
   }
 }
 
-void ADS1292R :: add_heart_rate_histogram(uint8_t hr)
-{
-  uint8_t   index = hr/10;
-  uint32_t  sum   = 0;
-
-  heart_rate_histogram[index-4]++;
-
-  if(hr_percent_count++ > HISTGRM_CALC_TH)
-  {
-    hr_percent_count = 0;
-
-    for(int i = 0; i < HISTGRM_DATA_SIZE; i++)
-      sum += heart_rate_histogram[i];
-
-    if(sum != 0)
-    {
-      for(int i = 0; i < HISTGRM_DATA_SIZE/4; i++)
-      {
-        uint32_t percent = ((heart_rate_histogram[i] * 100) / sum);
-        histogram_percent[i] = percent;
-      }
-    }
-    histogramReady = true;
-  }
-}
-
 uint8_t ADS1292R::mask_register_bits(uint8_t address, uint8_t data_in)
 {
   uint8_t data = data_in;
@@ -553,8 +627,8 @@ uint8_t ADS1292R::mask_register_bits(uint8_t address, uint8_t data_in)
 void set_ads1292_register(uint8_t address, uint8_t data)
 {
   //------------------------------------------------
-  pin_level_low(ADS1292_CS_PIN,CS_LOW_TIME);
-  SPI.transfer(SDATAC);         // stop data reading mode before write regiters
+  vspiBus.select(ads1292rCommand);
+  vspiBus.transfer(SDATAC);     // stop data reading mode before write regiters
   //------------------------------------------------
   // write registers
   // write n nnnn registers starting @ address r rrrr
@@ -563,9 +637,9 @@ void set_ads1292_register(uint8_t address, uint8_t data)
   // 000nnnnn, nnnnn = the number of registers to write – 1
   uint8_t OPCODE2 = 0x00; //write one byte                  
   
-  SPI.transfer(OPCODE1);   
-  SPI.transfer(OPCODE2);	 
-  SPI.transfer(data);	
+  vspiBus.transfer(OPCODE1);   
+  vspiBus.transfer(OPCODE2);	 
+  vspiBus.transfer(data);	
   //------------------------------------------------
   // verify registers
 
@@ -575,17 +649,17 @@ void set_ads1292_register(uint8_t address, uint8_t data)
   // 000nnnnn, nnnnn = the number of registers to write – 1
   OPCODE2 = 0x00;         //read one byte    
 
-  SPI.transfer(OPCODE1);   
-  SPI.transfer(OPCODE2);	
+  vspiBus.transfer(OPCODE1);   
+  vspiBus.transfer(OPCODE2);	
 
-  if (SPI.transfer(0x00)==data)
+  if (vspiBus.transfer(0x00)==data)
     Serial.println("write ok");
   else   
     Serial.println("write error!");
   // start to read data continuously
-  SPI.transfer(RDATAC);  
+  vspiBus.transfer(RDATAC);  
   
-  pin_level_high(ADS1292_CS_PIN,CS_HIGH_TIME);
+  vspiBus.deselect(ads1292rCommand);
 }
 
 /*---------------------------------------------------------------------------------
@@ -0,0 +1,100 @@
+/*---------------------------------------------------------------------------------
+  ECG low latency filter - cascaded biquads for the QRS detector
+
+  The 161 taps FIR in ADS1x9x_ECG_Processing.cpp is linear phase: the waveform
+  shape is kept, good for display, but every sample is 80 samples (0.64s) late,
+  and costs 161 MACs. Beat detection only needs the QRS band without baseline
+  and mains, so three biquads (RBJ cookbook, fs = 125 SPS) do it in 15 MACs:
+
+    high pass   0.5Hz, Q 0.707    baseline wander, replaces the DC removal
+    notch       50Hz,  Q 5        mains (ECG_MAINS_HZ 60 for 60Hz)
+    low pass    40Hz,  Q 0.707    muscle noise, same corner as the FIR
+
+  The group delay in the QRS band (5~15Hz) is about 1 sample.
+
+  Fixed point: coefficients are Q30 (range -2..2), direct form I with the
+  samples in Q8 (int16 << 8) and a 64 bits accumulator, rounded back to Q8.
+  Form I has no internal overflow between the sections, and the high pass
+  poles near z = 1 need the Q30 precision.
+
+  The output has the same scale as ECG_ProcessCurrSample() (DC removed >> 2),
+  so the QRS detector thresholds do not change.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define ECG_MAINS_HZ    50
+#define IIR_Q           30
+#define IIR_SAMPLE_Q    8
+#define IIR_OUT_SHIFT   (IIR_SAMPLE_Q + 2)   // >> 2 as the FIR path
+
+struct BiquadCoeff
+{
+  int32_t b0, b1, b2;
+  int32_t a1, a2;             // negated, y += a1 * y1 + a2 * y2
+};
+
+struct BiquadState
+{
+  int32_t x1, x2;
+  int32_t y1, y2;
+};
+
+enum { IIR_HIGH_PASS, IIR_NOTCH, IIR_LOW_PASS, IIR_SECTIONS };
+
+const BiquadCoeff ecgBiquads[IIR_SECTIONS] = {
+  // high pass 0.5Hz
+  { 1054828156, -2109656312, 1054828156,  2109323133, -1036247667 },
+#if   (ECG_MAINS_HZ == 50)
+  // notch 50Hz
+  { 1014132605,  1640901024, 1014132605, -1640901024,  -954523386 },
+#elif (ECG_MAINS_HZ == 60)
+  // notch 60Hz
+  { 1060450851,  2104177758, 1060450851, -2104177758, -1047159877 },
+#else
+  #error ECG_MAINS_HZ must be 50 or 60
+#endif
+  // low pass 40Hz
+  {  466796074,   933592148,  466796074,  -557595703,  -235846769 },
+};
+
+static BiquadState ecgStates[IIR_SECTIONS];
+
+static int32_t biquad(const BiquadCoeff *c, BiquadState *s, int32_t x)
+{
+  int64_t acc = (int64_t)1 << (IIR_Q - 1);   // rounding
+
+  acc += (int64_t)c->b0 * x;
+  acc += (int64_t)c->b1 * s->x1;
+  acc += (int64_t)c->b2 * s->x2;
+  acc += (int64_t)c->a1 * s->y1;
+  acc += (int64_t)c->a2 * s->y2;
+
+  s->x2 = s->x1;
+  s->x1 = x;
+  s->y2 = s->y1;
+  s->y1 = (int32_t)(acc >> IIR_Q);
+  return s->y1;
+}
+
+// pre-fill: steady state for a constant input "sample", the output starts at 0
+void ECG_IIRRestart(int16_t sample)
+{
+  memset(ecgStates, 0, sizeof(ecgStates));
+  ecgStates[IIR_HIGH_PASS].x1 = (int32_t)sample << IIR_SAMPLE_Q;
+  ecgStates[IIR_HIGH_PASS].x2 = (int32_t)sample << IIR_SAMPLE_Q;
+}
+
+int16_t ECG_IIRProcess(int16_t sample)
+{
+  int32_t y = (int32_t)sample << IIR_SAMPLE_Q;
+
+  for (int i = 0; i < IIR_SECTIONS; i++)
+    y = biquad(&ecgBiquads[i], &ecgStates[i], y);
+
+  y = (y + (1 << (IIR_OUT_SHIFT - 1))) >> IIR_OUT_SHIFT;
+  if (y > INT16_MAX)
+    y = INT16_MAX;
+  else if (y < INT16_MIN)
+    y = INT16_MIN;
+  return (int16_t)y;
+}
@@ -0,0 +1,111 @@
+/*---------------------------------------------------------------------------------
+  Fall detection - freefall, impact and orientation afterwards
+
+  The MMA8452Q freefall engine (FF_MT) watches for all axes below 0.5g, so
+  nothing runs here until it fires. A fall is then confirmed in three steps:
+
+  1. capture   - ODR is raised to 100Hz for FALL_CAPTURE_MS, the peak of |a|
+                 in the samples is the impact magnitude
+  2. settle    - if the impact is above FALL_IMPACT_MG, wait FALL_SETTLE_MS
+                 for the body to come to rest
+  3. posture   - readPL(), a fall leaves the wearer out of FALL_UPRIGHT
+
+  The alert is sent before anything else by handleBLE(). It is written whole
+  when it is queued, never while it waits for the app: a newer fall replaces an
+  unsent alert, except an upright one a confirmed fall.
+
+    byte 0    1 = fall confirmed, 0 = freefall and impact, but upright after
+    byte 1    orientation, PORTRAIT_U/D, LANDSCAPE_R/L or LOCKOUT (flat)
+    byte 2-3  impact in mg
+    byte 4-7  millis() of the freefall
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define FALL_CAPTURE_MS     1000
+#define FALL_SETTLE_MS      2000
+#define FALL_IMPACT_MG      2500
+#define FALL_UPRIGHT        PORTRAIT_U    // orientation of the board when standing
+
+enum FallState
+{
+  FALL_IDLE,
+  FALL_CAPTURE,
+  FALL_SETTLE
+};
+
+bool      fallAlertReady = false;
+uint8_t   fall_alert[FALL_ALERT_SIZE];
+
+void handleFallDetection(void)
+{
+  static FallState  state = FALL_IDLE;
+  static uint32_t   eventTime;
+  static uint32_t   next;           // next sample to scan
+  static int32_t    peak2;          // peak |a|^2 in LSB^2
+  static uint16_t   impact_mg;
+  AccelSample       s;
+  uint32_t          freefall_us;
+  int32_t           mag2;
+  uint8_t           orientation;
+
+  switch (state)
+  {
+    case FALL_IDLE:
+      if (accelTakeEvents(ACCEL_EVENT_FREEFALL, &freefall_us) == 0)
+        return;
+      // millis() of the freefall, not of this loop which noticed it
+      eventTime = millis() - (micros() - freefall_us) / 1000;
+      next      = accelSampleCount();
+      peak2     = 0;
+      accelSetBurst(true);
+      state     = FALL_CAPTURE;
+      LOG_I(LOG_MOTION, "fall: freefall");
+      break;
+
+    case FALL_CAPTURE:
+      while (next != accelSampleCount())
+      {
+        if (!accelGetSample(next++, &s))
+          continue;
+        mag2 = (int32_t)s.x * s.x + (int32_t)s.y * s.y + (int32_t)s.z * s.z;
+        if (mag2 > peak2)
+          peak2 = mag2;
+      }
+      if (millis() - eventTime < FALL_CAPTURE_MS)
+        return;
+
+      accelSetBurst(false);
+      impact_mg = sqrt((float)peak2) * 1000 / ACCEL_1G;
+      LOG_I(LOG_MOTION, "fall: impact %umg", impact_mg);
+      if (impact_mg < FALL_IMPACT_MG)
+      {
+        state = FALL_IDLE;          // e.g. sitting down quickly
+        return;
+      }
+      state = FALL_SETTLE;
+      break;
+
+    case FALL_SETTLE:
+      if (millis() - eventTime < FALL_CAPTURE_MS + FALL_SETTLE_MS)
+        return;
+
+      orientation = accelReadOrientation();
+      if (!fallAlertReady || !fall_alert[0] || (orientation != FALL_UPRIGHT))
+      {
+        fall_alert[0] = (orientation != FALL_UPRIGHT);
+        fall_alert[1] = orientation;
+        fall_alert[2] = impact_mg & 0xff;
+        fall_alert[3] = impact_mg >> 8;
+        fall_alert[4] = eventTime & 0xff;
+        fall_alert[5] = (eventTime >>  8) & 0xff;
+        fall_alert[6] = (eventTime >> 16) & 0xff;
+        fall_alert[7] = (eventTime >> 24) & 0xff;
+        fallAlertReady = true;
+      }
+      accelTakeEvents(ACCEL_EVENT_FREEFALL);    // drop the freefalls of the fall itself
+      state = FALL_IDLE;
+      LOG_W(LOG_MOTION, "fall: %s, orientation %u",
+            (orientation != FALL_UPRIGHT) ? "confirmed" : "upright", orientation);
+      break;
+  }
+}
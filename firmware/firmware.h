@@ -9,6 +9,9 @@
 #define BLE_FEATURE true
 #define WEB_FEATURE false
 #define CLI_FEATURE true
+#define RECORDER_FEATURE true   // record to flash while BLE is not connected
+#define PROFILE_FEATURE  true   // time the loop() stages, "stats" in CLI
+#define TRACE_FEATURE    false  // timed events of the ISRs and handlers, "trace" in CLI
 
 /*---------------------------------------------------------------------------------
   
@@ -22,12 +25,40 @@
 
 #define SPO2_TYPE        OXI_MAX30102   
 
+// AFE4490 shares VSPI with ADS1292R. Move it to HSPI only when the board routes 
+// AFE4490 to its own SPI pins, then both buses run in parallel. The HSPI default
+// pins 12~15 are used by ADS1292R, define the pins of the board here:
+#define AFE4490_ON_HSPI  false
+//#define AFE4490_HSPI_SCK   -1
+//#define AFE4490_HSPI_MISO  -1
+//#define AFE4490_HSPI_MOSI  -1
+#if AFE4490_ON_HSPI && !(defined(AFE4490_HSPI_SCK) && defined(AFE4490_HSPI_MISO) && defined(AFE4490_HSPI_MOSI))
+  #error AFE4490_ON_HSPI needs AFE4490_HSPI_SCK, AFE4490_HSPI_MISO and AFE4490_HSPI_MOSI of the board
+#endif
+
+// QRS detector input filter, the BLE display stream always uses the FIR
+#define ECG_FILTER_FIR   0      // 161 taps linear phase, 0.64s delay
+#define ECG_FILTER_IIR   1      // 3 biquads, about 1 sample delay
+#define ECG_DETECTOR_FILTER   ECG_FILTER_IIR
+
 // temperature sensor define
 #define TEMP_SENSOR_MAX30325  true
 #define TEMP_SENSOR_TMP117    false
 #if (TEMP_SENSOR_MAX30325&&TEMP_SENSOR_TMP117)
   #error You must only enable at least one!
 #endif 
+
+// accelerometer output data rate in Hz: 12 (12.5Hz), 50 or 100
+#define ACCEL_ODR_HZ     50
+// accelerometer full scale +/-2, 4 or 8 g, a fall impact is above 2g
+#define ACCEL_SCALE_G    4
+// MMA8452Q INT1/INT2 wired to ACCEL_INT1_PIN/ACCEL_INT2_PIN, only on a board which
+// routes them (homeicu-v2 does not), false = poll INT_SOURCE over I2C once per
+// sample period
+#define ACCEL_INT_WIRED  false
+// PPG motion artifact cancellation, accelerometer as the noise reference
+#define MOTION_CANCEL        true   // default, "motion on/off" in CLI
+#define MOTION_FILTER_ORDER  8      // taps per axis at 25Hz, covers 320ms delay
 /*---------------------------------------------------------------------------------
   Test Parameters
 ---------------------------------------------------------------------------------*/
@@ -49,6 +80,8 @@ const uint8_t SPO2_START_PIN    = 4;    //high to power on SPO2 chip, low to pow
 const uint8_t PUSH_BUTTON_PIN   = 0;
 const uint8_t LED_PIN           = 2;
 const uint8_t SENSOR_VP_PIN     = 36; 
+const uint8_t ACCEL_INT1_PIN    = 32;   // MMA8452Q data ready, with ACCEL_INT_WIRED
+const uint8_t ACCEL_INT2_PIN    = 33;   // MMA8452Q tap, transient, orientation, with ACCEL_INT_WIRED
 
 #if SIM_TEMPERATURE
 const int SENSOR_TEMP       = 35;   //GPIO35 ADC
@@ -66,8 +99,8 @@ I2C
 */
 
 #define HVR_ARRAY_SIZE          13
-#define HISTGRM_DATA_SIZE       12*4
-#define HISTGRM_PERCENT_SIZE    HISTGRM_DATA_SIZE/4
+#define HEART_RATE_PACK_SIZE    7   // fused hr, ppg hr, lead off, ecg sqi, ppg sqi, confidence, disagree
+#define HISTGRM_PERCENT_SIZE    12  // heart rate histogram bins
  
 /* 
 Blank project with OTA take 39% program space, 13% of dynamic memory.
@@ -90,6 +123,162 @@ extern int system_init_error;
 /*---------------------------------------------------------------------------------
  public functions & classes
 ---------------------------------------------------------------------------------*/
+/***********************
+ * spi_bus.cpp
+ ***********************/
+struct SPIDevice
+{
+  uint8_t   cs_pin;
+  uint32_t  clock;          // SCLK, Hz
+  uint8_t   mode;           // SPI_MODE0 ~ SPI_MODE3
+  uint16_t  cs_setup_us;    // CS low  -> first SCLK
+  uint16_t  cs_hold_us;     // last SCLK -> CS high
+  uint16_t  cs_high_us;     // CS high pulse before next select
+};
+
+class SPIClass;
+class SPIBus
+{
+public:
+  SPIBus(SPIClass *port);
+  void      begin(int8_t sck = -1, int8_t miso = -1, int8_t mosi = -1);
+  void      select  (const SPIDevice &device);
+  void      deselect(const SPIDevice &device);
+  uint8_t   transfer(uint8_t data);
+  void      transferBytes(const uint8_t *tx, uint8_t *rx, uint32_t size);
+private:
+  SPIClass          *spi;
+  SemaphoreHandle_t  mutex;
+};
+extern  SPIBus        vspiBus;
+#if AFE4490_ON_HSPI
+extern  SPIBus        hspiBus;
+#endif
+/***********************
+ * i2c_bus.cpp
+ ***********************/
+enum I2COperation { I2C_READ, I2C_WRITE, I2C_PROBE };
+enum I2CPriority  { I2C_PRIORITY_HIGH, I2C_PRIORITY_LOW };
+
+#define I2C_EXPIRED       0xF0    // deadline passed before the transaction started
+#define I2C_SHORT_READ    0xF1    // device returned less bytes than requested
+#define I2C_QUEUE_FULL    0xF2    // not queued, submit() returned false
+
+struct I2CTransaction
+{
+  uint8_t         address;        // 7-bit device address
+  uint8_t         reg;            // first register
+  uint8_t        *data;           // write source or read destination
+  uint8_t         length;         // bytes, <= 32
+  I2COperation    op;
+  I2CPriority     priority;
+  uint32_t        deadline;       // millis(), 0 = no deadline
+  void          (*callback)(struct I2CTransaction *t);
+  void           *context;        // free for the callback
+  // set by the scheduler
+  volatile bool   done;
+  uint8_t         error;
+  uint32_t        submit_us;
+};
+
+class I2CBus
+{
+public:
+  void      begin(void);
+  bool      submit  (I2CTransaction *t);    // non-blocking, false if queue full (done, I2C_QUEUE_FULL)
+  uint8_t   transfer(I2CTransaction *t);    // blocking, return error code
+  void      lock    (void);                 // for direct Wire access
+  void      unlock  (void);
+  void      printStats(void);
+private:
+  SemaphoreHandle_t mutex;
+  SemaphoreHandle_t pending;
+  QueueHandle_t     highQueue;
+  QueueHandle_t     lowQueue;
+  TaskHandle_t      taskHandle;
+  uint8_t   execute(I2CTransaction *t);
+  void      run    (I2CTransaction *t);
+  static void task (void *parameter);
+};
+extern  I2CBus        i2cBus;
+/***********************
+ * accelerometer.cpp
+ ***********************/
+#define ACCEL_RING_SIZE   64        // samples, power of 2
+
+struct AccelSample
+{
+  uint32_t  timestamp_us;           // micros() at data ready
+  int16_t   x, y, z;                // 12 bits, 2048 = ACCEL_SCALE_G
+};
+#define ACCEL_1G          (2048 / ACCEL_SCALE_G)
+
+#define ACCEL_EVENT_TAP           0x01
+#define ACCEL_EVENT_TRANSIENT     0x02
+#define ACCEL_EVENT_ORIENTATION   0x04
+#define ACCEL_EVENT_FREEFALL      0x08
+#define ACCEL_EVENTS              4
+
+#define PORTRAIT_U    0
+#define PORTRAIT_D    1
+#define LANDSCAPE_R   2
+#define LANDSCAPE_L   3
+#define LOCKOUT       0x40
+
+uint32_t  accelSampleCount(void);   // total samples, index of the next one
+bool      accelGetSample  (uint32_t index, AccelSample *sample);
+uint8_t   accelTakeEvents (uint8_t mask, uint32_t *event_us = NULL);  // ACCEL_EVENT_* of mask since last call
+uint8_t   accelOrientation(void);   // PORTRAIT_U/D, LANDSCAPE_R/L or LOCKOUT
+uint8_t   accelReadOrientation(void);     // blocking readPL()
+void      accelSetBurst   (bool on);      // 100Hz ODR for a short capture
+/***********************
+ * motion_artifact.cpp
+ ***********************/
+enum MotionChannel
+{
+  MOTION_IR,
+  MOTION_RED,
+  MOTION_CHANNELS
+};
+extern    bool      motion_cancel_on;
+extern    uint16_t  motion_index;       // rms acceleration of the last window, mg
+void      motionReference(uint32_t timestamp_us);
+uint32_t  motionCancel   (MotionChannel channel, uint32_t sample);
+bool      motionUsable   (uint8_t hold);
+/***********************
+ * signal_quality.cpp
+ ***********************/
+#define SQI_PASS          50        // 0..100, below it the window is not used
+extern    uint8_t   ecg_sqi, ppg_sqi;
+void      ecgQualityAdd  (int16_t sample, bool saturated);
+void      ecgQualityReset(void);
+bool      ecgQualityGood (void);
+uint8_t   ppgQuality     (const uint32_t *buffer, int length);
+void      printQuality   (void);
+/***********************
+ * hr_histogram.cpp
+ ***********************/
+#define HISTGRM_BIN_FIRST 40        // bpm, the lower rates go in the first bin
+#define HISTGRM_BIN_WIDTH 10        // bpm
+#define HISTGRM_BINS      HISTGRM_PERCENT_SIZE
+enum HrQuantile {HR_P5, HR_MEDIAN, HR_P95, HR_QUANTILES};
+extern    bool      histogramReady;
+extern    uint8_t   histogram_percent[HISTGRM_PERCENT_SIZE];
+void      hrHistogramAdd(uint8_t hr);
+uint8_t   hrQuantile    (HrQuantile which);
+void      printHistogram(void);
+/***********************
+ * fall_detection.cpp
+ ***********************/
+#define FALL_ALERT_SIZE   8
+void      handleFallDetection(void);
+extern    bool      fallAlertReady;
+extern    uint8_t   fall_alert[FALL_ALERT_SIZE];
+/***********************
+ * ecg_iir_filter.cpp
+ ***********************/
+void      ECG_IIRRestart(int16_t sample);
+int16_t   ECG_IIRProcess(int16_t sample);
 /***********************
  * ads1292r.cpp (ECG)
  ***********************/
@@ -101,14 +290,12 @@ public:
   void      getData(void);
 private:
   uint8_t * fillTxBuffer  (uint8_t peakvalue,uint8_t respirationRate);
-  void      add_heart_rate_histogram(uint8_t hr);
   uint8_t   mask_register_bits(uint8_t address, uint8_t data_in);
 };
 extern  ADS1292R      ads1292r;
 extern  void          ads1292r_interrupt_handler(void);
 extern  portMUX_TYPE  ads1292rMux;
 extern  bool          hrvDataReady  ;
-extern  bool          histogramReady;
 /***********************
  * oximeter_afe4490.cpp
  ***********************/
@@ -119,8 +306,8 @@ class AFE4490
     void    getData (void);
 
   private:  
-    void          writeData(uint8_t address, uint32_t data);
-    unsigned long readData (uint8_t address);
+    void          writeData (uint8_t address, uint32_t data);
+    void          readValues(int32_t *value);
 };
 extern class AFE4490  afe4490;
 /***********************
@@ -130,10 +317,11 @@ extern uint8_t    ppg_heart_rate;
 extern uint8_t    ecg_heart_rate, old_ecg_heart_rate;
 extern uint8_t    spo2_percent,   old_spo2_percent;
 extern uint8_t    ecg_lead_off;
+extern uint32_t   ecg_first_hr_ms, ecg_stable_hr_ms;   // lead-on to heart rate
 /***********************
  * spo
  ***********************/
-void clear_interrupt();
+uint32_t clear_interrupt();   // returns the data ready count
 extern volatile bool spo2_interrupt_flag;
 /***********************
  * spo2_max3010x.cpp
@@ -142,6 +330,324 @@ void initMax3010xSpo2();
 void handleMax3010xSpo2();
 void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer,
                                             float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+/***********************
+ * spo2_max3010x_heartRate.cpp
+ ***********************/
+#define PBA_SAMPLE_RATE   25        // SPS, 25 or 100
+#define PBA_FIR_DELAY     ((PBA_SAMPLE_RATE == 100) ? 11 : 2)   // samples
+bool      checkForBeat(int32_t sample);
+extern    int16_t   IR_AC_Signal_Current, IR_AC_Signal_Previous, IR_AC_Signal_min;
+extern    uint16_t  IR_AC_Signal_min_age, IR_AC_Signal_max_age;
+/***********************
+ * ppg_beat.cpp
+ ***********************/
+#define PPG_BEAT_RING_SIZE  8       // beats, power of 2
+
+struct PpgBeat
+{
+  uint32_t  foot_us;                // micros() of the pulse foot (onset)
+  uint32_t  peak_us;                // micros() of the pulse peak, 0 until it is found
+  uint16_t  ibi_ms;                 // inter-beat interval, 0 for the first beat
+  uint8_t   heart_rate;             // instantaneous, 60000 / ibi_ms
+};
+extern    uint8_t   ppg_beat_rate;      // instantaneous heart rate of the last beat
+void      ppgBeatAdd     (uint32_t ir, uint32_t timestamp_us);
+bool      ppgBeatTracking(void);
+uint32_t  ppgBeatCount   (void);
+bool      ppgGetBeat     (uint32_t index, PpgBeat *beat);
+/***********************
+ * hr_fusion.cpp
+ ***********************/
+extern    uint8_t   hr_fused, hr_confidence;    // bpm, 0..100
+extern    bool      hr_disagree;                // ECG and PPG rates differ
+extern    bool      hrFusionReady;
+void      hrFusionEcgBeat   (uint32_t r_us);
+void      hrFusionEcgRestart(void);
+void      handleHrFusion    (void);
+void      printFusion       (void);
+/***********************
+ * pat.cpp
+ ***********************/
+#define PAT_PACK_SIZE     5         // PAT ms (16 bits), trend 0.1ms (16 bits), accepted %
+
+class SampleClock
+{
+public:
+  SampleClock(uint32_t nominal_us) : period_us(nominal_us) {}
+  void      received(uint32_t now_us, uint32_t count);  // count = samples received so far
+  uint32_t  time    (uint32_t index);                   // micros() of the sample
+private:
+  float     period_us;
+  uint32_t  anchor_index = 0, anchor_us = 0;
+  uint32_t  window_index = 0, window_us = 0;
+  uint32_t  last_count   = 0;
+  bool      started      = false;
+  bool      period_measured = false;
+};
+extern    uint8_t   pat_pack[PAT_PACK_SIZE];
+extern    bool      patReady;
+void      patEcgSample (int16_t x, uint32_t t_us, bool qrs);
+void      patEcgRestart(void);
+void      handlePat    (void);
+void      printPat     (void);
+/***********************
+ * resampler.cpp
+ ***********************/
+class Resampler
+{
+public:
+  Resampler(uint32_t out_period_us, uint32_t max_gap_us);
+  void      restart (void);
+  void      put     (int16_t x, uint32_t t_us);     // an input sample and its micros()
+  bool      get     (int16_t *y, uint32_t *t_us);   // the next output, at a multiple of the period
+private:
+  uint32_t  period_us, max_gap_us;
+  int16_t   x[4];
+  uint32_t  t[4];
+  uint8_t   count;
+  bool      first;
+  int32_t   c1, c2, c3;                             // Farrow coefficients x6
+  uint32_t  inverse;                                // 2^31 / input interval
+  uint32_t  next_us;
+};
+/***********************
+ * flash_partition.cpp
+ ***********************/
+#define FLASH_SECTOR_SIZE 4096      // erase size
+#define FLASH_PAGE_SIZE   256       // write size
+
+class FlashPartition
+{
+public:
+  FlashPartition(const char *label) : label(label) {}
+  bool      begin (void);                                     // find the partition
+  uint32_t  size  (void) { return bytes; }
+  bool      read  (uint32_t offset, void *data, uint32_t length);
+  bool      write (uint32_t offset, const void *data, uint32_t length); // erased flash only
+  bool      erase (uint32_t offset);                          // the sector of offset
+private:
+  const char *label;
+  void     *handle = NULL;                                    // esp_partition_t, a FILE on the host
+  uint32_t  bytes  = 0;
+};
+/***********************
+ * recorder.cpp
+ ***********************/
+#define REC_BLOCK_SIZE    FLASH_PAGE_SIZE
+#define REC_HEADER_SIZE   20
+#define REC_DATA_SIZE     (REC_BLOCK_SIZE - REC_HEADER_SIZE)
+#define VITALS_PACK_SIZE  8
+
+enum RecStream {REC_ECG, REC_PPG, REC_VITALS, REC_STREAMS};
+
+struct RecBlock
+{
+  uint8_t   magic;
+  uint8_t   stream;                 // RecStream
+  uint8_t   samples;                // samples, or vitals records
+  uint8_t   length;                 // bytes in data
+  uint32_t  seq;                    // blocks since the partition was blank
+  uint32_t  time_ms;                // first sample, recorderNow()
+  uint16_t  span_ms;                // first to last sample
+  uint16_t  wear;                   // erase count of the sector
+  uint16_t  crc;                    // header (crc 0) and data
+  uint16_t  reserved;
+  uint8_t   data[REC_DATA_SIZE];
+};
+
+void      initRecorder   (void);
+void      handleRecorder (void);
+bool      recorderService(void);                    // the recorder task, true if it did something
+void      recorderSample (RecStream stream, int16_t x);
+uint32_t  recorderNow    (void);                    // recorder time, ms
+uint32_t  recorderOldest (void);                    // seq
+uint32_t  recorderNewest (void);                    // seq, exclusive
+uint32_t  recorderFind   (uint32_t time_ms);        // seq
+bool      recorderRead   (uint32_t seq, RecBlock *block);
+int       recorderDecode (const RecBlock *block, int16_t *x, int max);
+void      printRecorder  (void);
+void      recorderHold   (bool hold);               // no erase ahead, a backfill reads
+void      packVitals     (uint8_t *p);              // VITALS_PACK_SIZE bytes
+uint16_t  crc16          (const uint8_t *data, uint32_t length);  // CRC-16/CCITT-FALSE
+/***********************
+ * backfill.cpp
+ ***********************/
+#define BACKFILL_PACKET_MAX   244   // bytes, MTU 247
+void      backfillRequest (const uint8_t *data, int length);   // from the app
+void      backfillAnnounce(void);
+int       backfillNext    (uint8_t *packet, int max);          // once a pass, 0: nothing to send now
+void      printBackfill   (void);
+/***********************
+ * retransmit.cpp
+ ***********************/
+#define RETX_PACKETS      64        // per stream, power of 2
+#define RETX_PACKET_MAX   22        // bytes, the ECG packet
+#define RETX_PACK_SIZE    16        // NACK ranges, asked, resent, expired (32 bits each)
+
+enum BleStream {BLE_ECG, BLE_PPG, BLE_STREAMS};
+
+class PacketRing
+{
+public:
+  void      put   (uint16_t serial, const uint8_t *packet, uint8_t size);
+  bool      get   (uint16_t serial, uint8_t *packet, uint8_t *size);
+private:
+  uint8_t   data   [RETX_PACKETS][RETX_PACKET_MAX];
+  uint8_t   length [RETX_PACKETS];  // 0 = empty
+  uint16_t  serials[RETX_PACKETS];
+};
+extern    uint8_t   retransmit_pack[RETX_PACK_SIZE];
+extern    bool      retransmitReady;
+void      retransmitSent (BleStream stream, uint16_t serial, const uint8_t *packet, uint8_t size);
+void      retransmitNack (const uint8_t *data, int length);   // from the app
+bool      retransmitNext (BleStream *stream, uint8_t *packet, uint8_t *size);
+void      printRetransmit(void);
+/***********************
+ * serial_stream.cpp
+ ***********************/
+#define SERIAL_STREAM_BAUD  2000000   // "stream on" without a baud rate
+#define SERIAL_TX_BUFFER    8192      // UART driver TX ring, bytes
+
+enum SerialStream {SER_ECG, SER_PPG, SER_ACCEL, SER_VITALS, SER_STREAMS};
+
+extern    bool      serial_streaming;
+void      serialStreamSample(SerialStream stream, uint32_t time_us, const int32_t *values);
+void      handleSerialStream(void);
+void      serialStreamSet   (uint32_t baud);      // 0 = off, text
+/***********************
+ * cli.cpp
+ ***********************/
+#define CLI_MAX_COMMANDS  8           // added by the modules
+
+typedef int (*CliFunc)(void);
+
+bool        cliAddCommand(const char *name, CliFunc func, const char *help);
+const char *cliArg(int i);            // "" after the last argument
+
+/***********************
+ * overrun.cpp
+ ***********************/
+enum OverrunPath {OVR_ECG, OVR_PPG, OVR_ACCEL, OVR_PATHS};
+
+#define GAP_MARKER        INT16_MIN               // a lost sample in the ECG and PPG streams
+#define OVERRUN_PACK_SIZE (OVR_PATHS * 4)         // missed, queue full of each path
+
+void      overrunMissed(OverrunPath path, uint32_t samples);
+void      overrunSample(OverrunPath path, int16_t sample);
+uint32_t  overrunCount (OverrunPath path);       // missed so far
+void      packOverrun  (uint8_t *p);
+void      printOverrun (void);
+
+/***********************
+ * profile.cpp
+ ***********************/
+enum ProfileStage {PROF_CLI, PROF_TIMER, PROF_BUTTON, PROF_OTA, PROF_BLE, PROF_ECG, PROF_PPG,
+                   PROF_TEMP, PROF_ACCEL, PROF_FALL, PROF_FUSION, PROF_PAT, PROF_RECORDER,
+                   PROF_STREAM, PROF_BATTERY, PROF_LOOP, PROF_STAGES};
+
+#define PROFILE_PACK_SIZE (PROF_STAGES * 4 + OVERRUN_PACK_SIZE)   // mean and max us of each stage, overruns
+
+inline uint32_t profileCycles(void)
+{
+#ifdef HOST_BUILD
+  return micros();
+#else
+  return ESP.getCycleCount();               // wraps after 17s at 240MHz
+#endif
+}
+
+#if PROFILE_FEATURE
+#define PROFILE(stage, call)  do { uint32_t t0_ = profileCycles(); call; \
+                                   profileAdd(stage, profileCycles() - t0_); } while (0)
+#else
+#define PROFILE(stage, call)  call
+#endif
+
+extern    uint8_t   profile_pack[PROFILE_PACK_SIZE];
+extern    bool      profileReady;
+void      initProfile  (void);
+void      profileAdd   (ProfileStage stage, uint32_t cycles);
+void      handleProfile(void);
+void      printProfile (void);
+
+/***********************
+ * trace.cpp
+ ***********************/
+enum TraceEvent {TR_ECG_DRDY, TR_PPG_DRDY, TR_ACCEL_DRDY, TR_ECG_DATA, TR_PPG_DATA, TR_ECG_FILTER,
+                 TR_SPO2, TR_I2C, TR_BLE_ECG, TR_BLE_PPG, TR_MISSED_ECG, TR_MISSED_PPG,
+                 TR_MISSED_ACCEL, TR_QUEUE_FULL, TR_EVENTS};   // TR_MISSED_ECG + OverrunPath
+
+enum TracePhase {TRACE_PH_BEGIN, TRACE_PH_END, TRACE_PH_MARK};
+
+#if TRACE_FEATURE
+#define TRACE_BEGIN(event)      traceAdd(event, TRACE_PH_BEGIN, 0)
+#define TRACE_END(event)        traceAdd(event, TRACE_PH_END, 0)
+#define TRACE_MARK(event, arg)  traceAdd(event, TRACE_PH_MARK, arg)
+#else
+#define TRACE_BEGIN(event)      do {} while (0)
+#define TRACE_END(event)        do {} while (0)
+#define TRACE_MARK(event, arg)  do {} while (0)
+#endif
+
+void      initTrace(void);
+void      traceAdd (TraceEvent event, TracePhase phase, uint16_t arg);
+
+/***********************
+ * log.cpp
+ ***********************/
+#define LOG_LEVEL_NONE    0
+#define LOG_LEVEL_ERROR   1
+#define LOG_LEVEL_WARN    2
+#define LOG_LEVEL_INFO    3
+#define LOG_LEVEL_DEBUG   4
+#define LOG_LEVEL         LOG_LEVEL_INFO    // the lower levels are not compiled
+#define LOG_ARGS          4
+
+typedef uintptr_t LogArg;               // an integer, a pointer or the bits of a float
+enum LogTag {LOG_SYS, LOG_BLE, LOG_ECG, LOG_PPG, LOG_MOTION, LOG_REC, LOG_TAGS};
+
+extern    uint8_t   log_level[LOG_TAGS];
+void      initLog    (void);
+bool      logService (void);                  // the log task, true if it printed
+void      logWrite   (uint8_t level, uint8_t tag, const char *format, const LogArg *args, uint8_t count);
+void      logSetLevel(const char *tag, int level);
+void      printLog   (void);
+
+inline LogArg logArg(float x)   { uint32_t bits; memcpy(&bits, &x, sizeof(bits)); return bits; }
+inline LogArg logArg(double x)  { return logArg((float)x); }
+template <typename T>
+inline LogArg logArg(T x)       { return (LogArg)x; }
+
+template <typename... T>
+inline void logEvent(uint8_t level, uint8_t tag, const char *format, T... args)
+{
+  static_assert(sizeof...(T) <= LOG_ARGS, "too many log arguments");
+  LogArg a[sizeof...(T) + 1] = {logArg(args)...};
+
+  if (level <= log_level[tag])
+    logWrite(level, tag, format, a, sizeof...(T));
+}
+
+#if (LOG_LEVEL >= LOG_LEVEL_ERROR)
+#define LOG_E(tag, ...)   logEvent(LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#else
+#define LOG_E(tag, ...)   do {} while (0)
+#endif
+#if (LOG_LEVEL >= LOG_LEVEL_WARN)
+#define LOG_W(tag, ...)   logEvent(LOG_LEVEL_WARN,  tag, __VA_ARGS__)
+#else
+#define LOG_W(tag, ...)   do {} while (0)
+#endif
+#if (LOG_LEVEL >= LOG_LEVEL_INFO)
+#define LOG_I(tag, ...)   logEvent(LOG_LEVEL_INFO,  tag, __VA_ARGS__)
+#else
+#define LOG_I(tag, ...)   do {} while (0)
+#endif
+#if (LOG_LEVEL >= LOG_LEVEL_DEBUG)
+#define LOG_D(tag, ...)   logEvent(LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#else
+#define LOG_D(tag, ...)   do {} while (0)
+#endif
 /***********************
  * for firmware.ino
  ***********************/
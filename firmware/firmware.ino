@@ -26,6 +26,7 @@ void handleCLI();
 volatile uint32_t buttonInterruptTime = 0;
 volatile int      buttonEventPending = false;
 volatile bool     spo2_interrupt_flag = false;
+volatile uint32_t spo2_interrupt_count = 0;   // data ready of the AFE4490, for overrun.cpp
 volatile SemaphoreHandle_t timerSemaphore;
 hw_timer_t * timer = NULL;
 
@@ -87,14 +88,21 @@ void IRAM_ATTR oximeter_interrupt_handler()
 {
   portENTER_CRITICAL_ISR(&oximeterMux);
   spo2_interrupt_flag = true;
+  spo2_interrupt_count++;
   portEXIT_CRITICAL_ISR (&oximeterMux);  
+  TRACE_MARK(TR_PPG_DRDY, spo2_interrupt_count);
 }
  
-void clear_interrupt()
+// returns the interrupts counted so far
+uint32_t clear_interrupt()
 {
+  uint32_t count;
+
   portENTER_CRITICAL_ISR(&oximeterMux);
   spo2_interrupt_flag = false;
+  count = spo2_interrupt_count;
   portEXIT_CRITICAL_ISR (&oximeterMux);  
+  return count;
 }
 
 /*---------------------------------------------------------------------------------
@@ -264,17 +272,17 @@ void measureTemperature()
  VSPI	GPIO23	GPIO19	GPIO18	GPIO5
  HSPI	GPIO13	GPIO12	GPIO14	GPIO15
 
- This design only uses VSPI, the default CS pin is IO5.
+ This design uses VSPI for both ADS1292R and AFE4490, the default CS pin is IO5 (not used).
+ The clock and SPI mode of each device are set by its SPIDevice (see spi_bus.cpp).
  
 ---------------------------------------------------------------------------------*/
 void initSPI()
 {
-  SPI.begin();
-  SPI.setBitOrder     (MSBFIRST);
+  vspiBus.begin();
 
-  // the higher speed will cause ecg stop working
-  // example code use SPI_CLOCK_DIV16 
-  SPI.setClockDivider (SPI_CLOCK_DIV32);  
+  #if AFE4490_ON_HSPI
+  hspiBus.begin(AFE4490_HSPI_SCK, AFE4490_HSPI_MISO, AFE4490_HSPI_MOSI);
+  #endif
 }
 /*---------------------------------------------------------------------------------
 The setup() function is called when a sketch starts. Use it to initialize variables, 
@@ -287,7 +295,11 @@ void setup()
 
   // Make sure serial port on first
   // Setup serial port U0UXD for programming and reset/boot
+  Serial.setTxBufferSize(SERIAL_TX_BUFFER);  // binary stream, written without waiting
   Serial.begin  (115200);   // Baudrate for serial communication
+  initLog();                // LOG_x() lines printed by a low priority task
+  initProfile();            // "stats" in CLI, time of the loop() stages
+  initTrace();              // "trace" in CLI, with TRACE_FEATURE
   chipid=ESP.getEfuseMac(); // chip ID is MAC address(6 bytes).
   
   Serial.println("************************************************");
@@ -324,13 +336,15 @@ void setup()
   Wire.begin( I2C_SDA_PIN,    // initialize I2C
               I2C_SCL_PIN,
               400000);        //standard speed is 100000, fast speed is 400000
+  i2cBus.begin();             // I2C task, all sensor I2C access goes through it
   {
-    uint8_t error, address;
+    uint8_t address;
+    I2CTransaction probe = {0};
+    probe.op = I2C_PROBE;
     Serial.println("Scanning I2C...");
     for(address = 1; address < 127; address++ ) {
-      Wire.beginTransmission(address);
-      error = Wire.endTransmission();
-      if (error == 0) {
+      probe.address = address;
+      if (i2cBus.transfer(&probe) == 0) {
         Serial.print("I2C device found at address 0x");
         if (address<16) Serial.print("0");
           Serial.println(address,HEX);
@@ -361,6 +375,8 @@ void setup()
   //------------------------------------------------
   initAcceleromter();
 
+  initRecorder();             // flash recorder, while BLE is not connected
+
   if (initTemperature()) 
     Serial.println("Temperature sensor: OK.");
   else
@@ -386,31 +402,43 @@ void setup()
 ---------------------------------------------------------------------------------*/
 void loop()
 {
-  handleCLI();
+  PROFILE(PROF_CLI,      handleCLI());
 
-  doTimer();                  // process timer event
+  PROFILE(PROF_TIMER,    doTimer());              // process timer event
   
-  doButton();                 // process button event
+  PROFILE(PROF_BUTTON,   doButton());             // process button event
 
-  handleOTA();                // "On The Air" update function 
+  PROFILE(PROF_OTA,      handleOTA());            // "On The Air" update function 
 
-  handleBLE();                // handle bluetooth low energy
+  PROFILE(PROF_BLE,      handleBLE());            // handle bluetooth low energy
 
-  ads1292r.getData();         // handle ECG and RESP
+  PROFILE(PROF_ECG,      ads1292r.getData());     // handle ECG and RESP
 
   #if   (SPO2_TYPE==OXI_AFE4490)
-    afe4490.getData();          // handle SpO2 and PPG 
+    PROFILE(PROF_PPG,    afe4490.getData());      // handle SpO2 and PPG 
   #elif (SPO2_TYPE==OXI_MAX30102)
-    handleMax3010xSpo2();       // handel SpO2 and PPG
+    PROFILE(PROF_PPG,    handleMax3010xSpo2());   // handel SpO2 and PPG
   #endif   
 
-  measureTemperature();       // body temperature
+  PROFILE(PROF_TEMP,     measureTemperature());   // body temperature
+
+  PROFILE(PROF_ACCEL,    handelAcceleromter());   // motion detection with accelerometer
+
+  PROFILE(PROF_FALL,     handleFallDetection());  // freefall, impact and posture after it
 
-  handelAcceleromter();       // motion detection with accelerometer
+  PROFILE(PROF_FUSION,   handleHrFusion());       // one heart rate from the ECG and PPG beats
 
-  measureBattery();           // measure battery power percent
+  PROFILE(PROF_PAT,      handlePat());            // pulse arrival time, ECG R wave to PPG foot
+
+  PROFILE(PROF_RECORDER, handleRecorder());       // vitals to the flash recorder, BLE connect/disconnect
+
+  PROFILE(PROF_STREAM,   handleSerialStream());   // binary stream on the serial port, accelerometer and vitals
+
+  PROFILE(PROF_BATTERY,  measureBattery());       // measure battery power percent
 
   #if WEB_UPDATE
   handleWebClient();          // web server
   #endif 
+
+  handleProfile();            // time of the whole loop, diagnostics to BLE
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+/*---------------------------------------------------------------------------------
+  Flash partition - raw access to a data partition of partitions.csv
+
+  NOR flash: a write only clears bits (erase the sector first), an erase sets the
+  sector (FLASH_SECTOR_SIZE) to 0xFF. Offsets are from the start of the partition.
+
+  Both cores stall while the flash is written or erased (the code runs from the
+  same chip), only IRAM interrupt handlers run. Call it from a low priority task,
+  not from loop().
+
+  host/flash_file.cpp is the same class on a file, for the host build.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include <esp_partition.h>
+
+bool FlashPartition :: begin(void)
+{
+  const esp_partition_t *partition;
+
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (partition == NULL)
+  {
+    Serial.printf("!! flash partition \"%s\" missing, check partitions.csv\r\n", label);
+    return false;
+  }
+  handle = (void *)partition;
+  bytes  = partition->size;
+  return true;
+}
+
+bool FlashPartition :: read(uint32_t offset, void *data, uint32_t length)
+{
+  if ((handle == NULL) || (offset + length > bytes))
+    return false;
+  return esp_partition_read((const esp_partition_t *)handle, offset, data, length) == ESP_OK;
+}
+
+bool FlashPartition :: write(uint32_t offset, const void *data, uint32_t length)
+{
+  if ((handle == NULL) || (offset + length > bytes))
+    return false;
+  return esp_partition_write((const esp_partition_t *)handle, offset, data, length) == ESP_OK;
+}
+
+bool FlashPartition :: erase(uint32_t offset)
+{
+  offset &= ~(FLASH_SECTOR_SIZE - 1);
+  if ((handle == NULL) || (offset + FLASH_SECTOR_SIZE > bytes))
+    return false;
+  return esp_partition_erase_range((const esp_partition_t *)handle, offset, FLASH_SECTOR_SIZE) == ESP_OK;
+}
@@ -0,0 +1,117 @@
+/*---------------------------------------------------------------------------------
+  Arduino shim - the part of Arduino ESP32 which firmware.h and the DSP core use,
+  for the host build (CMakeLists.txt in this folder, HOST_BUILD defined)
+
+  The types, FreeRTOS handles and ISR macros are there so firmware.h compiles.
+  The functions are declared for the same reason, arduino_shim.cpp defines only
+  the ones the host build links:
+    millis(), micros()      steady clock since the program started, or the
+                            time set by hostSetTime()
+    delay()                 sleeps, or moves the time set by hostSetTime()
+    Serial                  printf/print/println to stdout, write() to stdout
+    ESP.getCycleCount()     the low 32 bits of hostCycles()
+  A module which needs more (Wire, SPI, tasks) stays out of the host build.
+---------------------------------------------------------------------------------*/
+#ifndef __ARDUINO_SHIM_H__
+#define __ARDUINO_SHIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+typedef uint8_t   byte;
+typedef bool      boolean;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define HIGH              1
+#define LOW               0
+#define INPUT             0x01
+#define OUTPUT            0x03
+#define INPUT_PULLUP      0x05
+#define RISING            0x01
+#define FALLING           0x02
+#define CHANGE            0x03
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+/*---------------------------------------------------------------------------------
+ FreeRTOS, single threaded: the critical sections are empty
+---------------------------------------------------------------------------------*/
+typedef int       portMUX_TYPE;
+typedef void     *SemaphoreHandle_t;
+typedef void     *QueueHandle_t;
+typedef void     *TaskHandle_t;
+typedef int       BaseType_t;
+typedef unsigned  UBaseType_t;
+typedef uint32_t  TickType_t;
+
+#define portMUX_INITIALIZER_UNLOCKED  0
+#define portENTER_CRITICAL(mux)       (void)(mux)
+#define portEXIT_CRITICAL(mux)        (void)(mux)
+#define portENTER_CRITICAL_ISR(mux)   (void)(mux)
+#define portEXIT_CRITICAL_ISR(mux)    (void)(mux)
+#define pdTRUE            1
+#define pdFALSE           0
+#define pdPASS            1
+#define portMAX_DELAY     0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+
+/*---------------------------------------------------------------------------------
+ time
+---------------------------------------------------------------------------------*/
+unsigned long millis(void);
+unsigned long micros(void);
+void      delay(uint32_t ms);
+void      delayMicroseconds(uint32_t us);
+uint64_t  hostCycles(void);             // TSC on x86, the nanoseconds elsewhere
+void      hostSetTime(uint64_t us);     // a test sets the time, the clock then stands still
+uint32_t  getCpuFrequencyMhz(void);
+
+/*---------------------------------------------------------------------------------
+ Serial
+---------------------------------------------------------------------------------*/
+class Print
+{
+public:
+  size_t    write  (uint8_t c);
+  size_t    write  (const uint8_t *buffer, size_t size);
+  size_t    print  (const char *s);
+  size_t    print  (char c);
+  size_t    print  (long n);
+  size_t    print  (double x, int digits = 2);
+  size_t    println(const char *s = "");
+  size_t    println(long n);
+  size_t    println(double x, int digits = 2);
+  size_t    printf (const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print
+{
+public:
+  void      begin(unsigned long baud) { (void)baud; }
+  void      flush(void)               { fflush(stdout); }
+  int       available(void)           { return 0; }
+  int       read(void)                { return -1; }
+  int       availableForWrite(void)   { return 1 << 20; }
+};
+
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+  uint32_t  getCycleCount(void)       { return (uint32_t)hostCycles(); }
+};
+
+extern EspClass ESP;
+
+#endif //__ARDUINO_SHIM_H__
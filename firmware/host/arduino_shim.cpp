@@ -0,0 +1,145 @@
+/*---------------------------------------------------------------------------------
+  Arduino shim - the functions of Arduino.h in this folder, for the host build
+---------------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdarg.h>
+#include <chrono>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+HardwareSerial  Serial;
+EspClass        ESP;
+
+static const auto start = std::chrono::steady_clock::now();
+static bool       manual_time = false;
+static uint64_t   manual_ns;
+
+static uint64_t elapsed_ns(void)
+{
+  if (manual_time)
+    return manual_ns;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - start).count();
+}
+
+/*---------------------------------------------------------------------------------
+ time
+---------------------------------------------------------------------------------*/
+unsigned long millis(void)
+{
+  return (unsigned long)(uint32_t)(elapsed_ns() / 1000000);
+}
+
+unsigned long micros(void)
+{
+  return (unsigned long)(uint32_t)(elapsed_ns() / 1000);
+}
+
+void delay(uint32_t ms)
+{
+  if (manual_time)
+    manual_ns += (uint64_t)ms * 1000000;
+  else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  if (manual_time)
+    manual_ns += (uint64_t)us * 1000;
+  else
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void hostSetTime(uint64_t us)
+{
+  manual_time = true;
+  manual_ns   = us * 1000;
+}
+
+uint64_t hostCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();                     // constant rate, not the core clock under turbo
+#else
+  return elapsed_ns();
+#endif
+}
+
+uint32_t getCpuFrequencyMhz(void)
+{
+  static uint32_t mhz = 0;
+
+  if (mhz == 0)                         // hostCycles() against the clock, 20ms
+  {
+    uint64_t  ns     = elapsed_ns();
+    uint64_t  cycles = hostCycles();
+
+    delay(20);
+    mhz = (uint32_t)((hostCycles() - cycles) * 1000 / (elapsed_ns() - ns));
+    if (mhz == 0)
+      mhz = 1;
+  }
+  return mhz;
+}
+
+/*---------------------------------------------------------------------------------
+ Serial, to stdout
+---------------------------------------------------------------------------------*/
+size_t Print :: write(uint8_t c)
+{
+  return fwrite(&c, 1, 1, stdout);
+}
+
+size_t Print :: write(const uint8_t *buffer, size_t size)
+{
+  return fwrite(buffer, 1, size, stdout);
+}
+
+size_t Print :: print(const char *s)
+{
+  return fputs(s, stdout) < 0 ? 0 : strlen(s);
+}
+
+size_t Print :: print(char c)
+{
+  return write((uint8_t)c);
+}
+
+size_t Print :: print(long n)
+{
+  return printf("%ld", n);
+}
+
+size_t Print :: print(double x, int digits)
+{
+  return printf("%.*f", digits, x);
+}
+
+size_t Print :: println(const char *s)
+{
+  return print(s) + print("\r\n");
+}
+
+size_t Print :: println(long n)
+{
+  return print(n) + print("\r\n");
+}
+
+size_t Print :: println(double x, int digits)
+{
+  return print(x, digits) + print("\r\n");
+}
+
+size_t Print :: printf(const char *format, ...)
+{
+  va_list   args;
+  int       n;
+
+  va_start(args, format);
+  n = vprintf(format, args);
+  va_end(args);
+  return n < 0 ? 0 : n;
+}
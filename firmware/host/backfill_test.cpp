@@ -0,0 +1,222 @@
+/*---------------------------------------------------------------------------------
+  backfill_test - a full recorder partition sent by backfill.cpp, the way loop()
+  does it, on the time set by the test (hostSetTime())
+
+  The loop is simulated: a DRDY of the ADS1292R every 8ms, which keeps one sample
+  (a DRDY count as ecg_ads1292r.cpp, overrun.cpp counts the lost ones), a PPG
+  sample every 40ms, and loop() passes LOOP_PASS_US apart plus the time a pass
+  spends in delay(). Each pass takes the samples, runs the recorder (handleRecorder()
+  and the recorder task) and, once connected, empties the stream queues and asks
+  backfillNext() once, as handleBLE(). notify() is not in the host build, it takes
+  no time here.
+
+  1. records RECORD_MINUTES offline into the 256KB of partitions.csv, the ring
+     keeps the newest part
+  2. connects, asks for all of it (BACKFILL_RESUME from 0) and runs the loop to
+     the status at the end, at MTU 247 and at MTU 23
+  3. checks that every block came complete and in order, equal to the flash, and
+     that no ECG sample was lost while sending. Prints the drain time.
+
+  Exit code 0 if all checks pass.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include "cppQueue.h"
+
+#define RECORD_MINUTES        30
+#define ECG_PERIOD_US         8000      // 125 SPS
+#define PPG_PERIOD_US         40000     // 25 SPS
+#define LOOP_PASS_US          1000      // the rest of loop()
+#define DRAIN_MAX_S           600
+
+// the app side of backfill.cpp
+#define BACKFILL_DATA         1
+#define BACKFILL_RESUME       3
+#define BACKFILL_STATUS       5
+#define BACKFILL_DATA_HEADER  7
+
+// the globals of the modules not in the host build
+volatile bool     bleDeviceConnected  = false;
+uint8_t           hr_fused            = 72;
+uint8_t           ecg_heart_rate      = 72;
+uint8_t           ppg_heart_rate      = 71;
+uint8_t           spo2_percent        = 98;
+volatile uint8_t  respirationRate     = 15;
+uint8_t           battery_percent     = 90;
+int16_t           body_temp_times10   = 367;
+uint8_t           log_level[LOG_TAGS];
+Queue             ppg_queue(PPG_QUEUE_LEN, PPG_QUEUE_SIZE, FIFO);
+Queue             ecg_queue(ECG_QUEUE_LEN, ECG_QUEUE_SIZE, FIFO);
+
+void logWrite(uint8_t, uint8_t, const char *, const LogArg *, uint8_t)
+{
+}
+
+static int        failures  = 0;
+static uint64_t   now_us    = 1000000;
+static uint64_t   ecg_us    = 1000000;  // the next DRDY
+static uint64_t   ppg_us    = 1000000;
+static uint32_t   drdy_count = 0, drdy_read = 0;
+static uint32_t   seed      = 1;
+
+#define CHECK(condition, ...) \
+  do { if (!(condition)) { failures++; printf("FAIL %s:%d ", __FILE__, __LINE__); \
+                           printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static int16_t noise(int amplitude)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int16_t)((int32_t)((seed >> 16) % (2 * amplitude + 1)) - amplitude);
+}
+
+static int16_t ecg(uint32_t n)          // 72 bpm, a QRS spike on a slow baseline
+{
+  uint32_t i = n % 104;
+
+  return (int16_t)(300 * sin(n * 0.002) + ((i < 4) ? 2500 - 800 * (int)i : 0) + noise(20));
+}
+
+static int16_t ppg(uint32_t n)
+{
+  return (int16_t)(4000 * sin(n * 2 * M_PI * 1.2 / 25) + noise(40));
+}
+
+/*---------------------------------------------------------------------------------
+ the app: the blocks put together from the parts, compared with the flash
+---------------------------------------------------------------------------------*/
+struct App
+{
+  uint32_t  from, end;                  // from the first status
+  uint32_t  next;                       // the next block expected
+  uint8_t   block[REC_BLOCK_SIZE];
+  int       got;                        // bytes of the block so far
+  uint32_t  bytes;
+  bool      started, done;
+};
+
+static void receive(App *app, const uint8_t *packet, int length, int max)
+{
+  uint32_t  seq;
+  RecBlock  flash_block;
+
+  app->bytes += length;
+  if (packet[0] == BACKFILL_STATUS)
+  {
+    memcpy(&seq, &packet[1], 4);
+    memcpy(&app->end, &packet[5], 4);
+    if (!app->started)                  // the range, the oldest may have been erased ahead
+    {
+      app->from    = app->next = seq;
+      app->started = true;
+    }
+    else if (seq == app->end)           // idle: the end of the range
+      app->done = true;
+    return;
+  }
+  CHECK(packet[0] == BACKFILL_DATA, "packet type %u", packet[0]);
+  memcpy(&seq, &packet[1], 4);
+  if ((seq != app->next) || (packet[5] * (max - BACKFILL_DATA_HEADER) != app->got))
+  {
+    CHECK(false, "block %u part %u, expected block %u at %d bytes", seq, packet[5], app->next, app->got);
+    return;
+  }
+  memcpy(&app->block[app->got], &packet[BACKFILL_DATA_HEADER], length - BACKFILL_DATA_HEADER);
+  app->got += length - BACKFILL_DATA_HEADER;
+  if (packet[5] + 1 < packet[6])
+    return;
+
+  CHECK(recorderRead(seq, &flash_block) &&
+        (memcmp(app->block, &flash_block, REC_HEADER_SIZE + flash_block.length) == 0),
+        "block %u not as in the flash", seq);
+  app->next++;
+  app->got = 0;
+}
+
+/*---------------------------------------------------------------------------------
+ one loop() pass
+---------------------------------------------------------------------------------*/
+static void pass(App *app, int max)
+{
+  uint8_t   packet[BACKFILL_PACKET_MAX];
+  int       length;
+
+  hostSetTime(now_us);
+  for (; ecg_us <= now_us; ecg_us += ECG_PERIOD_US)
+    drdy_count++;
+  if (drdy_count != drdy_read)          // as ecg_ads1292r.cpp
+  {
+    if ((drdy_read != 0) && (drdy_count - drdy_read > 1))
+      overrunMissed(OVR_ECG, drdy_count - drdy_read - 1);
+    drdy_read = drdy_count;
+    overrunSample(OVR_ECG, ecg(drdy_count));
+  }
+  for (; ppg_us <= now_us; ppg_us += PPG_PERIOD_US)
+    overrunSample(OVR_PPG, ppg((uint32_t)(ppg_us / PPG_PERIOD_US)));
+
+  handleRecorder();
+  while (recorderService())
+    ;
+
+  if (bleDeviceConnected)
+  {
+    ecg_queue.flush();                  // the live streams went out
+    ppg_queue.flush();
+    length = backfillNext(packet, max);
+    if (length > 0)
+      receive(app, packet, length, max);
+  }
+  now_us += (uint32_t)(micros() - (uint32_t)now_us) + LOOP_PASS_US;
+}
+
+static void drain(int mtu)
+{
+  App       app = {};
+  uint8_t   resume[9] = {BACKFILL_RESUME, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF};
+  uint64_t  start_us = now_us;
+  uint32_t  missed   = overrunCount(OVR_ECG);
+  int       max      = min(mtu - 3, BACKFILL_PACKET_MAX);
+
+  backfillRequest(resume, sizeof(resume));
+  while (!app.done && (now_us - start_us < (uint64_t)DRAIN_MAX_S * 1000000))
+    pass(&app, max);
+
+  printf("MTU %3d: %u blocks, %u KB in %.1f s, ECG missed %u\n", mtu, app.next - app.from,
+         app.bytes / 1024, (now_us - start_us) / 1e6, overrunCount(OVR_ECG) - missed);
+  CHECK(app.done, "MTU %d: not done after %d s", mtu, DRAIN_MAX_S);
+  CHECK(app.started && (app.from == recorderOldest()) && (app.next == recorderNewest()),
+        "MTU %d: blocks %u..%u of %u..%u", mtu, app.from, app.next, recorderOldest(), recorderNewest());
+  CHECK(overrunCount(OVR_ECG) == missed, "MTU %d: %u ECG samples lost while sending", mtu,
+        overrunCount(OVR_ECG) - missed);
+}
+
+int main(void)
+{
+  App       app = {};
+  uint64_t  end_us;
+
+  remove("recorder.bin");
+  hostSetTime(now_us);
+  initRecorder();
+
+  // 1. offline
+  end_us = now_us + (uint64_t)RECORD_MINUTES * 60 * 1000000;
+  while (now_us < end_us)
+    pass(&app, 0);
+  printf("%d minutes recorded, %u ECG missed, blocks %u..%u kept (%u KB)\n", RECORD_MINUTES,
+         overrunCount(OVR_ECG), recorderOldest(), recorderNewest(),
+         (recorderNewest() - recorderOldest()) * REC_BLOCK_SIZE / 1024);
+  CHECK(overrunCount(OVR_ECG) == 0, "ECG samples lost while recording");
+
+  // 2. connect, the partial blocks are sealed by the next handleRecorder()
+  bleDeviceConnected = true;
+  pass(&app, 0);
+  while (recorderService())
+    ;
+  drain(247);
+  drain(23);
+
+  if (failures)
+    printf("%d checks failed\n", failures);
+  else
+    printf("backfill ok\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,557 @@
+/*---------------------------------------------------------------------------------
+  bench - the DSP and algorithm core timed on the host, ns and cycles per sample
+
+    bench               all of them
+    bench qrs           the ones with "qrs" in their name
+
+  Each benchmark runs its function over a synthetic signal at the sensor rate
+  (ECG and respiration 125 SPS, PPG 25 SPS), BENCH_REPEATS times, and reports
+  the fastest pass, divided by the samples of the pass. The fastest is the one
+  least disturbed by the rest of the machine, compare it between two builds on
+  the same machine. The cycles are those of hostCycles(): the TSC on x86 counts
+  at a constant rate, not the core clock, so they track ns * TSC GHz.
+
+  The signals are the same on every run (fixed seed), so the code paths taken
+  are the same too. A benchmark prints its result checksum, an optimization must
+  keep it (ECG_FilterProcess, filters) or explain why it changed. The checksums,
+  the detector counts and the dc_blocker bounds below are stored in the tables
+  of this file: a result which is not the stored one prints FAIL, and bench exits
+  with 1 (ctest runs it). A change of the output on purpose updates the table in
+  the same commit.
+
+  After the timing, "detector" compares the two QRS detector inputs of
+  ECG_DETECTOR_FILTER on the synthetic ECG, whose R peaks are known: the FIR of
+  ECG_ProcessCurrSample() and ECG_IIRProcess(), each into QRS_Algorithm_Interface()
+  from ECG_Restart(). A detection is the first sample of npeakflag in a beat, it
+  hits an R peak when it is within DETECT_TOLERANCE_MS of the R peak plus the
+  delay the firmware assumes (ECG_DETECT_DELAY_US of ecg_ads1292r.cpp). The
+  delay column is from the R peak to the detection, the CPU cost is ecg_process
+  and ecg_iir above. "clean" is the signal of the timing, "noisy" has 5x the
+  noise and 3x the mains.
+
+  "dc_blocker" compares DCBlocker<int16_t, ...> with the double DC removal it
+  replaced ("short temp1 = 0.992 * y"), on the synthetic ECG and on random
+  samples, before and after the ">> 2" of the ECG and respiration paths, and
+  the product of the pole for every 16 bits y, the only step where they can
+  differ. dc_double times the double version: the host has a double FPU, the
+  ESP32 calls a software multiply, so the host understates the gain.
+
+  What the firmware calls and how often:
+    ecg_fir             ECG_FilterProcess(), the 161 taps FIR, alone
+    ecg_process         ECG_ProcessCurrSample(), DC removal + FIR, each ECG sample
+    ecg_iir             ECG_IIRProcess(), the detector filter (ecg_iir_filter.cpp)
+    qrs                 QRS_Algorithm_Interface(), each ECG sample
+    resp_process        Resp_ProcessCurrSample(), each respiration sample
+    resp                RESP_Algorithm_Interface(), each respiration sample
+    dc_blocker          DCBlocker<int16_t, ...>, one DC removal
+    dc_double           the double DC removal DCBlocker replaced
+    resampler           Resampler put() + get(), 125 SPS in and out
+    maxim_spo2          maxim_heart_rate_and_oxygen_saturation(), 100 samples
+                        every 25 (spo2_max3010x.cpp), per sample = per call / 25
+    check_for_beat      checkForBeat(), each PPG sample
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include "dc_blocker.h"
+#include <chrono>
+
+#define BENCH_REPEATS         15
+#define ECG_RATE              125       // SPS
+#define PPG_RATE              25        // SPS
+#define ECG_SAMPLES           (ECG_RATE * 60)
+#define PPG_SAMPLES           (PPG_RATE * 60)
+#define FIR_TAPS              161       // FILTERORDER of ADS1x9x_ECG_Processing.cpp
+#define SPO2_BUFFER_SIZE      100       // as spo2_max3010x.cpp
+#define SPO2_EACH_CALCULATION 25
+#define ECG_BPM               72
+#define R_PHASE               0.30      // of the beat
+#define DETECT_WARMUP_MS      3000      // threshold seeding after ECG_Restart(), not scored
+#define DETECT_TOLERANCE_MS   150       // as ANSI/AAMI EC57
+#define DETECT_REFRACTORY_MS  200       // npeakflag again within it is the same beat
+#define FIR_DELAY_MS          640       // ECG_DETECT_DELAY_US of ecg_ads1292r.cpp
+#define IIR_DELAY_MS          8
+
+// ecg_ads1292r.cpp is not in the host build, these are its globals the ECG
+// processing reads: lead on, and the R peak flag
+uint8_t             LeadStatus  = 0;
+volatile uint8_t    npeakflag   = 0;
+
+void ECG_ProcessCurrSample (short *CurrAqsSample, short *FilteredOut);
+void ECG_FilterProcess     (short *WorkingBuff, short *CoeffBuf, short *FilterOut);
+void QRS_Algorithm_Interface(short CurrSample);
+void Resp_ProcessCurrSample(short *CurrAqsSample, short *FilteredOut);
+void RESP_Algorithm_Interface(short CurrSample);
+void ECG_Restart           (void);
+extern short          CoeffBuf_40Hz_LowPass[FIR_TAPS];
+extern unsigned short QRS_Heart_Rate, Respiration_Rate;
+
+static int16_t  ecg_raw     [ECG_SAMPLES];  // as read from the ADS1292R
+static int16_t  ecg_filtered[ECG_SAMPLES];  // ECG_ProcessCurrSample() of ecg_raw
+static int16_t  resp_raw    [ECG_SAMPLES];
+static int16_t  resp_filtered[ECG_SAMPLES];
+static uint32_t ppg_ir      [PPG_SAMPLES];
+static uint32_t ppg_red     [PPG_SAMPLES];
+
+static volatile int32_t sink;               // the results go somewhere
+
+/*---------------------------------------------------------------------------------
+ synthetic signals: 72 bpm, 15 breaths/min, baseline wander and noise
+---------------------------------------------------------------------------------*/
+static uint32_t seed = 12345;
+
+static int32_t noise(int32_t amplitude)     // uniform, -amplitude..amplitude
+{
+  seed = seed * 1664525 + 1013904223;
+  return (int32_t)((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static double beatPhase(double t, double bpm)
+{
+  double    phase = t * bpm / 60.0;
+  return phase - floor(phase);              // 0..1 in a beat
+}
+
+// ECG with baseline wander (breathing), mains and noise, the R peaks at R_PHASE
+static void makeEcg(int16_t *ecg, int mains, int noise_amplitude)
+{
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    double  t      = (double)i / ECG_RATE;
+    double  beat   = beatPhase(t, ECG_BPM);
+    double  breath = sin(2 * M_PI * t * 15 / 60);
+    double  x      = 8000 * exp(-pow((beat - R_PHASE) / 0.012, 2))  // R
+                   - 1200 * exp(-pow((beat - 0.27) / 0.010, 2))     // Q
+                   - 1800 * exp(-pow((beat - 0.33) / 0.012, 2))     // S
+                   + 1500 * exp(-pow((beat - 0.55) / 0.050, 2))     // T
+                   +  600 * exp(-pow((beat - 0.15) / 0.030, 2));    // P
+
+    ecg[i] = (int16_t)(x + 2000 * breath + 3000 + mains * sin(2 * M_PI * 50 * t) + noise(noise_amplitude));
+  }
+}
+
+static void makeSignals(void)
+{
+  makeEcg(ecg_raw, 300, 80);
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    double  t      = (double)i / ECG_RATE;
+    double  breath = sin(2 * M_PI * t * 15 / 60);
+
+    resp_raw[i] = (int16_t)(1200 * breath + 1000 + noise(20));
+  }
+
+  for (int i = 0; i < PPG_SAMPLES; i++)
+  {
+    double  t     = (double)i / PPG_RATE;
+    double  beat  = beatPhase(t, 72);
+    double  pulse = exp(-pow((beat - 0.25) / 0.10, 2));
+
+    ppg_ir[i]  = (uint32_t)(100000 + 500 * pulse + 100 * sin(2 * M_PI * t * 15 / 60) + noise(30));
+    ppg_red[i] = (uint32_t)( 80000 + 350 * pulse +  70 * sin(2 * M_PI * t * 15 / 60) + noise(30));
+  }
+}
+
+/*---------------------------------------------------------------------------------
+ the benchmarks, one pass over their signal, return the samples and a checksum
+---------------------------------------------------------------------------------*/
+static int benchEcgFir(int32_t *sum)
+{
+  static short  working[2 * FIR_TAPS];      // the delay line, twice, as ECG_ProcessCurrSample()
+  int           start = 0, cur = FIR_TAPS - 1;
+  short         out;
+
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    working[cur] = ecg_raw[i] >> 2;
+    ECG_FilterProcess(&working[cur], CoeffBuf_40Hz_LowPass, &out);
+    working[start] = working[cur];
+    if (start == FIR_TAPS - 1)
+    {
+      start = 0;
+      cur   = FIR_TAPS - 1;
+    }
+    else
+    {
+      start++;
+      cur++;
+    }
+    *sum += out;
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchEcgProcess(int32_t *sum)
+{
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    ECG_ProcessCurrSample(&ecg_raw[i], &ecg_filtered[i]);
+    *sum += ecg_filtered[i];
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchEcgIir(int32_t *sum)
+{
+  ECG_IIRRestart(ecg_raw[0]);
+  for (int i = 0; i < ECG_SAMPLES; i++)
+    *sum += ECG_IIRProcess(ecg_raw[i]);
+  return ECG_SAMPLES;
+}
+
+static int benchQrs(int32_t *sum)
+{
+  ECG_Restart();
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    QRS_Algorithm_Interface(ecg_filtered[i]);
+    *sum += QRS_Heart_Rate + npeakflag;
+    npeakflag = 0;
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchRespProcess(int32_t *sum)
+{
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    Resp_ProcessCurrSample(&resp_raw[i], &resp_filtered[i]);
+    *sum += resp_filtered[i];
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchResp(int32_t *sum)
+{
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    RESP_Algorithm_Interface(resp_filtered[i]);
+    *sum += Respiration_Rate;
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchDcBlocker(int32_t *sum)
+{
+  DCBlocker<int16_t, int64_t, 31, Q31(0.992)> dc;
+
+  dc.restart(ecg_raw[0]);
+  for (int i = 0; i < ECG_SAMPLES; i++)
+    *sum += dc.process(ecg_raw[i]);
+  return ECG_SAMPLES;
+}
+
+static int benchDcDouble(int32_t *sum)
+{
+  short     x1 = ecg_raw[0], y1 = 0, temp1;
+
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    temp1 = 0.992 * y1;
+    y1    = (ecg_raw[i] - x1) + temp1;
+    x1    = ecg_raw[i];
+    *sum += y1;
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchResampler(int32_t *sum)
+{
+  Resampler resampler(1000000 / ECG_RATE, 100000);
+  int16_t   y;
+  uint32_t  t_us;
+
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    resampler.put(ecg_raw[i], i * 8000 + (i % 3) * 40);   // 125 SPS, with some jitter
+    while (resampler.get(&y, &t_us))
+      *sum += y;
+  }
+  return ECG_SAMPLES;
+}
+
+static int benchMaximSpo2(int32_t *sum)
+{
+  float     spo2;
+  int8_t    spo2_valid, hr_valid;
+  int32_t   heart_rate;
+  int       calls = 0;
+  uint32_t  ir[SPO2_BUFFER_SIZE], red[SPO2_BUFFER_SIZE];
+
+  for (int i = 0; i + SPO2_BUFFER_SIZE <= PPG_SAMPLES; i += SPO2_EACH_CALCULATION)
+  {
+    memcpy(ir,  &ppg_ir [i], sizeof(ir));   // the algorithm may write its buffers
+    memcpy(red, &ppg_red[i], sizeof(red));
+    maxim_heart_rate_and_oxygen_saturation(ir, SPO2_BUFFER_SIZE, red,
+                                           &spo2, &spo2_valid, &heart_rate, &hr_valid);
+    *sum += (int32_t)spo2 + spo2_valid + heart_rate + hr_valid;
+    calls++;
+  }
+  return calls * SPO2_EACH_CALCULATION;
+}
+
+static int benchCheckForBeat(int32_t *sum)
+{
+  for (int i = 0; i < PPG_SAMPLES; i++)
+    *sum += checkForBeat(ppg_ir[i]);
+  return PPG_SAMPLES;
+}
+
+/*---------------------------------------------------------------------------------
+ timing
+---------------------------------------------------------------------------------*/
+struct Benchmark
+{
+  const char *name;
+  int       (*run)(int32_t *sum);
+  int32_t     checksum;                 // expected
+};
+
+// in this order: ecg_process fills ecg_filtered for qrs, resp_process resp_filtered for resp
+static const Benchmark benchmarks[] = {
+  {"ecg_fir",         benchEcgFir,          6116726},
+  {"ecg_process",     benchEcgProcess,        -3153},
+  {"ecg_iir",         benchEcgIir,             5852},
+  {"qrs",             benchQrs,              516958},
+  {"resp_process",    benchRespProcess,       -7041},
+  {"resp",            benchResp,             450000},
+  {"dc_blocker",      benchDcBlocker,        -66157},
+  {"dc_double",       benchDcDouble,         -66157},
+  {"resampler",       benchResampler,      24551115},
+  {"maxim_spo2",      benchMaximSpo2,         10764},
+  {"check_for_beat",  benchCheckForBeat,         72},
+};
+
+/*---------------------------------------------------------------------------------
+ QRS detection with the FIR or the IIR in front
+---------------------------------------------------------------------------------*/
+struct DetectorResult
+{
+  int       hits, misses, false_detections;
+  double    delay_mean_ms, delay_max_ms;
+};
+
+// expected, [iir][noisy]: FIR clean, FIR noisy, IIR clean, IIR noisy
+static const DetectorResult detector_expected[2][2] = {
+  {{67, 0, 0, 648.6, 656.0}, {66, 1, 1, 648.7, 656.0}},
+  {{68, 0, 0,  13.1,  16.0}, {68, 0, 0,  13.3,  16.0}},
+};
+
+static DetectorResult runDetector(const int16_t *ecg, bool iir)
+{
+  static int      detections[ECG_SAMPLES];
+  static bool     used[ECG_SAMPLES];
+  DetectorResult  result = {};
+  int             count = 0, last = -ECG_SAMPLES;
+  int             delay = (iir ? IIR_DELAY_MS : FIR_DELAY_MS) * ECG_RATE / 1000;
+  int             tolerance = DETECT_TOLERANCE_MS * ECG_RATE / 1000;
+  int             warmup    = DETECT_WARMUP_MS * ECG_RATE / 1000;
+  bool            flag = false;
+  short           x;
+
+  ECG_Restart();
+  ECG_IIRRestart(ecg[0]);
+  npeakflag = 0;
+  for (int i = 0; i < ECG_SAMPLES; i++)
+  {
+    if (iir)
+      x = ECG_IIRProcess(ecg[i]);
+    else
+      ECG_ProcessCurrSample((short *)&ecg[i], &x);
+    QRS_Algorithm_Interface(x);
+    if (npeakflag && !flag && (i - last > DETECT_REFRACTORY_MS * ECG_RATE / 1000))
+    {
+      detections[count++] = i;
+      last = i;
+    }
+    flag      = npeakflag;
+    npeakflag = 0;
+  }
+
+  memset(used, 0, sizeof(used));
+  for (int beat = 0; ; beat++)
+  {
+    int   r = lround((beat + R_PHASE) * 60 * ECG_RATE / ECG_BPM);
+    int   j;
+
+    if (r + delay + tolerance >= ECG_SAMPLES)
+      break;
+    if (r < warmup)
+      continue;
+    for (j = 0; j < count; j++)
+      if (!used[j] && (abs(detections[j] - (r + delay)) <= tolerance))
+        break;
+    if (j == count)
+    {
+      result.misses++;
+      continue;
+    }
+    used[j] = true;
+    result.hits++;
+    result.delay_mean_ms += (detections[j] - r) * 1000.0 / ECG_RATE;
+    result.delay_max_ms   = max(result.delay_max_ms, (detections[j] - r) * 1000.0 / ECG_RATE);
+  }
+  for (int j = 0; j < count; j++)
+    if (!used[j] && (detections[j] >= warmup + delay) && (detections[j] + tolerance < ECG_SAMPLES))
+      result.false_detections++;
+  if (result.hits)
+    result.delay_mean_ms /= result.hits;
+  return result;
+}
+
+static int compareDetectors(void)
+{
+  int             failures = 0;
+  static int16_t  noisy[ECG_SAMPLES];
+
+  makeEcg(noisy, 900, 400);
+  printf("\n%-16s %-6s %6s %6s %6s %14s %13s\n", "detector", "ecg", "hits", "misses", "false",
+         "delay mean ms", "delay max ms");
+  for (int iir = 0; iir < 2; iir++)
+    for (int n = 0; n < 2; n++)
+    {
+      DetectorResult        r = runDetector(n ? noisy : ecg_raw, iir);
+      const DetectorResult &e = detector_expected[iir][n];
+      bool  fail = (r.hits != e.hits) || (r.misses != e.misses) ||
+                   (r.false_detections != e.false_detections) ||
+                   (fabs(r.delay_mean_ms - e.delay_mean_ms) > 0.1) ||
+                   (fabs(r.delay_max_ms - e.delay_max_ms) > 0.1);
+
+      printf("%-16s %-6s %6d %6d %6d %14.1f %13.1f%s\n", iir ? "iir + qrs" : "fir + qrs",
+             n ? "noisy" : "clean", r.hits, r.misses, r.false_detections,
+             r.delay_mean_ms, r.delay_max_ms, fail ? "  FAIL" : "");
+      failures += fail;
+    }
+  return failures;
+}
+
+/*---------------------------------------------------------------------------------
+ DCBlocker against the double version of ADS1x9x_ECG_Processing.cpp before it
+---------------------------------------------------------------------------------*/
+#define DC_RANDOM_SAMPLES     2000000
+#define DC_RANDOM_AMPLITUDE   16383     // uniform, half the range
+
+struct DcDifference
+{
+  int       max, max_shifted;           // LSB, before and after >> 2
+};
+
+// dc_blocker.h: the same as the double version
+static const DcDifference dc_ecg_bound    = {0, 0};
+static const DcDifference dc_random_bound = {0, 0};
+
+static DcDifference compareDcBlocker(const int16_t *x, int length)
+{
+  DCBlocker<int16_t, int64_t, 31, Q31(0.992)> dc;
+  short         x1 = 0, y1 = 0, temp1;
+  DcDifference  result = {0, 0};
+
+  dc.restart(0);
+  for (int i = 0; i < length; i++)
+  {
+    int16_t   y = dc.process(x[i]);
+
+    temp1 = 0.992 * y1;                 // the double version
+    y1    = (x[i] - x1) + temp1;
+    x1    = x[i];
+    result.max         = max(result.max, abs((int16_t)(y - y1)));    // both wrap at 16 bits
+    result.max_shifted = max(result.max_shifted, abs((int16_t)((y >> 2) - (y1 >> 2))));
+  }
+  return result;
+}
+
+static bool dcFail(const DcDifference &d, const DcDifference &bound)
+{
+  return (d.max > bound.max) || (d.max_shifted > bound.max_shifted);
+}
+
+// the y of the 16 bits range whose pole product is not the double one
+static int compareDcProducts(void)
+{
+  DCBlocker<int16_t, int64_t, 31, Q31(0.992)> dc;
+  int           differ = 0;
+
+  for (int y = INT16_MIN; y <= INT16_MAX; y++)
+  {
+    dc.restart(0);
+    dc.process(y);                      // y1 = y, x1 = y
+    differ += (dc.process(y) != (short)(0.992 * y));    // x - x1 = 0: the product alone
+  }
+  return differ;
+}
+
+static int compareDcBlockers(void)
+{
+  static int16_t  random_samples[DC_RANDOM_SAMPLES];
+  DcDifference    ecg, random;
+  int             products;
+
+  for (int i = 0; i < DC_RANDOM_SAMPLES; i++)
+    random_samples[i] = (int16_t)noise(DC_RANDOM_AMPLITUDE);
+  ecg      = compareDcBlocker(ecg_raw, ECG_SAMPLES);
+  random   = compareDcBlocker(random_samples, DC_RANDOM_SAMPLES);
+  products = compareDcProducts();
+
+  printf("\n%-16s %-6s %14s %14s\n", "dc_blocker", "input", "max diff LSB", "after >> 2");
+  printf("%-16s %-6s %14d %14d%s\n", "q31 vs double", "ecg", ecg.max, ecg.max_shifted,
+         dcFail(ecg, dc_ecg_bound) ? "  FAIL" : "");
+  printf("%-16s %-6s %14d %14d%s\n", "q31 vs double", "random", random.max, random.max_shifted,
+         dcFail(random, dc_random_bound) ? "  FAIL" : "");
+  printf("%-16s %-6s %14d %14s%s\n", "pole products", "all y", products, "differ",
+         products ? "  FAIL" : "");
+  return dcFail(ecg, dc_ecg_bound) + dcFail(random, dc_random_bound) + (products != 0);
+}
+
+static uint64_t nowNs(void)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char *argv[])
+{
+  const char *filter   = (argc > 1) ? argv[1] : "";
+  int32_t     sum      = 0;
+  int         failures = 0;
+
+  makeSignals();
+  // the filtered signals, also when ecg_process or resp_process is not selected
+  benchEcgProcess(&sum);
+  benchRespProcess(&sum);
+
+  printf("%-16s %10s %14s %12s\n", "benchmark", "ns/sample", "cycles/sample", "checksum");
+  for (const Benchmark &b : benchmarks)
+  {
+    uint64_t  best_ns = UINT64_MAX, best_cycles = UINT64_MAX;
+    int       samples = 1;
+
+    if (strstr(b.name, filter) == NULL)
+      continue;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+      uint64_t  ns     = nowNs();
+      uint64_t  cycles = hostCycles();
+
+      sum     = 0;
+      samples = b.run(&sum);
+      cycles  = hostCycles() - cycles;
+      ns      = nowNs() - ns;
+      best_ns     = min(best_ns, ns);
+      best_cycles = min(best_cycles, cycles);
+    }
+    sink = sum;
+    printf("%-16s %10.1f %14.1f %12d", b.name,
+           (double)best_ns / samples, (double)best_cycles / samples, sum);
+    if (sum != b.checksum)
+    {
+      printf("  FAIL, expected %d", b.checksum);
+      failures++;
+    }
+    printf("\n");
+  }
+  if (strstr("detector", filter))
+    failures += compareDetectors();
+  if (strstr("dc_blocker", filter))
+    failures += compareDcBlockers();
+  if (failures)
+    printf("\n%d results changed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+/*---------------------------------------------------------------------------------
+  Flash partition on a file - stand-in of flash_partition.cpp for the host build
+
+  "<label>.bin" in the working directory, created erased (0xFF) with
+  FLASH_FILE_SIZE bytes when it does not exist. Same rules as the NOR flash:
+  a write only clears bits (the new data is ANDed in), an erase sets a sector to
+  0xFF, so a write without an erase shows up as a CRC error, like on the chip.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#ifndef FLASH_FILE_SIZE
+#define FLASH_FILE_SIZE       (256 * 1024)
+#endif
+
+bool FlashPartition :: begin(void)
+{
+  char      name[64];
+  FILE     *file;
+  uint8_t   erased[FLASH_SECTOR_SIZE];
+
+  snprintf(name, sizeof(name), "%s.bin", label);
+  file = fopen(name, "r+b");
+  if (file == NULL)
+  {
+    file = fopen(name, "w+b");
+    if (file == NULL)
+      return false;
+    memset(erased, 0xFF, sizeof(erased));
+    for (uint32_t i = 0; i < FLASH_FILE_SIZE; i += FLASH_SECTOR_SIZE)
+      fwrite(erased, 1, sizeof(erased), file);
+  }
+  fseek(file, 0, SEEK_END);
+  bytes  = ftell(file) & ~(FLASH_SECTOR_SIZE - 1);
+  handle = file;
+  return true;
+}
+
+bool FlashPartition :: read(uint32_t offset, void *data, uint32_t length)
+{
+  FILE *file = (FILE *)handle;
+
+  if ((file == NULL) || (offset + length > bytes))
+    return false;
+  fseek(file, offset, SEEK_SET);
+  return fread(data, 1, length, file) == length;
+}
+
+bool FlashPartition :: write(uint32_t offset, const void *data, uint32_t length)
+{
+  FILE     *file = (FILE *)handle;
+  uint8_t   old[FLASH_SECTOR_SIZE];
+
+  if ((file == NULL) || (offset + length > bytes))
+    return false;
+  for (uint32_t done = 0; done < length; )
+  {
+    uint32_t n = min(length - done, (uint32_t)sizeof(old));
+
+    fseek(file, offset + done, SEEK_SET);
+    if (fread(old, 1, n, file) != n)
+      return false;
+    for (uint32_t i = 0; i < n; i++)
+      old[i] &= ((const uint8_t *)data)[done + i];
+    fseek(file, offset + done, SEEK_SET);
+    if (fwrite(old, 1, n, file) != n)
+      return false;
+    done += n;
+  }
+  fflush(file);
+  return true;
+}
+
+bool FlashPartition :: erase(uint32_t offset)
+{
+  FILE     *file = (FILE *)handle;
+  uint8_t   erased[FLASH_SECTOR_SIZE];
+
+  offset &= ~(FLASH_SECTOR_SIZE - 1);
+  if ((file == NULL) || (offset + FLASH_SECTOR_SIZE > bytes))
+    return false;
+  memset(erased, 0xFF, sizeof(erased));
+  fseek(file, offset, SEEK_SET);
+  fwrite(erased, 1, sizeof(erased), file);
+  fflush(file);
+  return true;
+}
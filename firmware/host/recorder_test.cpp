@@ -0,0 +1,199 @@
+/*---------------------------------------------------------------------------------
+  recorder_test - recorder.cpp on host/flash_file.cpp, "recorder.bin" in the
+  working directory, created blank by the test
+
+  1. records an ECG ramp past a full lap of the ring, the time set by the test
+     (8ms a sample), so every sample is known from the time of its block
+  2. reads every block from recorderOldest() to recorderNewest(), checks the
+     CRC (recorderRead) and the samples (recorderDecode)
+  3. recorderFind() of times before, inside and after the log
+  4. initRecorder() again on the same file, as after a reset: same oldest and
+     newest, the time goes on after the end of every block, recording goes on
+     from the newest block
+  5. connected (not recording) the sectors are erased ahead, a quarter of the
+     ring, and found again by a remount; recording less than that erases nothing
+
+  Exit code 0 if all checks pass.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define SAMPLE_MS             8         // 125 SPS
+#define REC_PAGES             (FLASH_FILE_SIZE / REC_BLOCK_SIZE)
+#define REC_PAGES_PER_SECTOR  (FLASH_SECTOR_SIZE / REC_BLOCK_SIZE)
+
+// the globals recorder.cpp reads, from modules not in the host build
+volatile bool     bleDeviceConnected  = false;
+uint8_t           hr_fused            = 72;
+uint8_t           ecg_heart_rate      = 72;
+uint8_t           ppg_heart_rate      = 71;
+uint8_t           spo2_percent        = 98;
+volatile uint8_t  respirationRate     = 15;
+uint8_t           battery_percent     = 90;
+int16_t           body_temp_times10   = 367;
+
+static int        failures  = 0;
+static uint32_t   now_ms    = 1000;
+static uint32_t   samples   = 0;        // recorded so far
+static uint32_t   start_ms;             // recorderNow() of sample 0
+
+#define CHECK(condition, ...) \
+  do { if (!(condition)) { failures++; printf("FAIL %s:%d ", __FILE__, __LINE__); \
+                           printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static int16_t ramp(uint32_t i)         // every step size the varint takes
+{
+  return (int16_t)((i * 37) % 4001 - 2000 + ((i % 170 == 0) ? 20000 : 0));
+}
+
+static void record(uint32_t count)
+{
+  for (uint32_t n = 0; n < count; n++)
+  {
+    hostSetTime((uint64_t)now_ms * 1000);
+    if (samples == 0)
+      start_ms = recorderNow();
+    recorderSample(REC_ECG, ramp(samples++));
+    handleRecorder();
+    while (recorderService())
+      ;
+    now_ms += SAMPLE_MS;
+  }
+}
+
+// no samples, the recorder task only
+static void idle(uint32_t ms)
+{
+  for (uint32_t end = now_ms + ms; (int32_t)(now_ms - end) < 0; now_ms += SAMPLE_MS)
+  {
+    hostSetTime((uint64_t)now_ms * 1000);
+    handleRecorder();
+    while (recorderService())
+      ;
+  }
+}
+
+// every block readable, the ECG samples as recorded
+static void checkBlocks(void)
+{
+  RecBlock  block;
+  int16_t   x[REC_DATA_SIZE];
+  uint32_t  ecg_blocks = 0;
+
+  for (uint32_t seq = recorderOldest(); seq < recorderNewest(); seq++)
+  {
+    if (!recorderRead(seq, &block))
+    {
+      CHECK(false, "block %u not readable", seq);
+      continue;
+    }
+    if (block.stream != REC_ECG)
+      continue;
+
+    uint32_t  first = (block.time_ms - start_ms) / SAMPLE_MS;
+    int       n     = recorderDecode(&block, x, REC_DATA_SIZE);
+
+    CHECK(n == block.samples, "block %u decodes %d of %u samples", seq, n, block.samples);
+    CHECK(block.span_ms == (uint32_t)(n - 1) * SAMPLE_MS, "block %u span %u ms", seq, block.span_ms);
+    for (int i = 0; i < n; i++)
+      if (x[i] != ramp(first + i))
+      {
+        CHECK(false, "block %u sample %d is %d, recorded %d", seq, i, x[i], ramp(first + i));
+        break;
+      }
+    ecg_blocks++;
+  }
+  CHECK(ecg_blocks > 0, "no ECG block");
+}
+
+// the first block which ends at time_ms or later
+static void checkFind(uint32_t time_ms)
+{
+  RecBlock  block;
+  uint32_t  seq = recorderFind(time_ms);
+
+  CHECK((seq >= recorderOldest()) && (seq <= recorderNewest()), "find %u: %u out of the log", time_ms, seq);
+  if (seq < recorderNewest())
+  {
+    CHECK(recorderRead(seq, &block) && ((int32_t)(block.time_ms + block.span_ms - time_ms) >= 0),
+          "find %u: block %u ends before", time_ms, seq);
+  }
+  if (seq > recorderOldest())
+  {
+    CHECK(recorderRead(seq - 1, &block) && ((int32_t)(block.time_ms + block.span_ms - time_ms) < 0),
+          "find %u: block %u before it ends at or after", time_ms, seq - 1);
+  }
+}
+
+int main(void)
+{
+  RecBlock  block;
+  uint32_t  oldest, newest, end_ms;
+
+  remove("recorder.bin");
+  hostSetTime((uint64_t)now_ms * 1000);
+  initRecorder();
+  CHECK(recorderNewest() == 0, "blank partition, newest %u", recorderNewest());
+
+  // 1. past a full lap
+  while (recorderNewest() < REC_PAGES + 3 * REC_PAGES_PER_SECTOR)
+    record(1000);
+  oldest = recorderOldest();
+  newest = recorderNewest();
+  printf("%u samples, blocks %u..%u of %u pages\n", samples, oldest, newest, REC_PAGES);
+  CHECK(oldest > 0, "the ring did not wrap");
+  CHECK(newest - oldest <= REC_PAGES, "%u blocks in %u pages", newest - oldest, REC_PAGES);
+  CHECK(newest - oldest >= REC_PAGES - 2 * REC_PAGES_PER_SECTOR, "only %u blocks kept", newest - oldest);
+  CHECK(!recorderRead(oldest - 1, &block), "block %u is overwritten, but readable", oldest - 1);
+
+  // 2. read back
+  checkBlocks();
+
+  // 3. find
+  CHECK(recorderRead(oldest, &block), "oldest block %u", oldest);
+  CHECK(recorderFind(block.time_ms - 10000) == oldest, "find before the log");
+  CHECK(recorderFind(recorderNow() + 10000) == newest, "find after the log");
+  for (uint32_t t = block.time_ms; (int32_t)(recorderNow() - t) > 0; t += 997)
+    checkFind(t);
+
+  // 4. reset: mount the same file again, the blocks still in RAM are lost
+  end_ms = 0;
+  for (uint32_t seq = oldest; seq < newest; seq++)
+    if (recorderRead(seq, &block) && ((int32_t)(block.time_ms + block.span_ms - end_ms) > 0))
+      end_ms = block.time_ms + block.span_ms;
+  now_ms = 1000;                        // millis() starts again
+  hostSetTime((uint64_t)now_ms * 1000);
+  initRecorder();
+  CHECK(recorderOldest() == oldest, "remount oldest %u, was %u", recorderOldest(), oldest);
+  CHECK(recorderNewest() == newest, "remount newest %u, was %u", recorderNewest(), newest);
+  CHECK((int32_t)(recorderNow() - end_ms) > 0, "time went back %u ms after remount", end_ms - recorderNow());
+  checkBlocks();
+
+  newest = recorderNewest();
+  record(2000);
+  CHECK(recorderNewest() > newest, "no block after remount");
+  CHECK(recorderRead(newest, &block) && (block.seq == newest), "first block after remount");
+
+  // 5. erase ahead
+  bleDeviceConnected = true;
+  idle(10000);
+  oldest = recorderOldest();
+  newest = recorderNewest();
+  printf("connected: blocks %u..%u, %u erased ahead\n", oldest, newest, REC_PAGES - (newest - oldest));
+  CHECK(newest - oldest <= REC_PAGES - REC_PAGES / 4, "only %u pages erased ahead", REC_PAGES - (newest - oldest));
+  now_ms = 1000;
+  hostSetTime((uint64_t)now_ms * 1000);
+  initRecorder();
+  CHECK(recorderOldest() == oldest, "remount oldest %u, was %u erased ahead", recorderOldest(), oldest);
+  bleDeviceConnected = false;
+  while (recorderNewest() < newest + REC_PAGES / 8)     // half of them
+    record(100);
+  CHECK(recorderOldest() == oldest, "erased while recording, oldest %u, was %u", recorderOldest(), oldest);
+  for (uint32_t seq = oldest; seq < recorderNewest(); seq++)   // the ramp times do not go on after a remount
+    CHECK(recorderRead(seq, &block), "block %u not readable", seq);
+
+  if (failures)
+    printf("%d checks failed\n", failures);
+  else
+    printf("recorder ok\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*---------------------------------------------------------------------------------
+  trace_json - "trace dump" (trace.cpp) to Chrome trace JSON, on the host
+
+    trace_json < serial.log > trace.json
+    trace_json serial.log trace.json
+
+  Reads the lines which start with "trace " and skips the rest of the log, so the
+  whole serial capture can be given. Each core is a thread, time in us from the
+  first event. The CCOUNT (32 bits) wraps every 17s at 240MHz, the events are
+  unwrapped by the signed difference to the event before, a gap of more than
+  half the range (9s at 240MHz) between two events can not be told from a wrap.
+  Open the output in chrome://tracing or ui.perfetto.dev.
+---------------------------------------------------------------------------------*/
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+int main(int argc, char *argv[])
+{
+  FILE     *in  = (argc > 1) ? fopen(argv[1], "r") : stdin;
+  FILE     *out = (argc > 2) ? fopen(argv[2], "w") : stdout;
+  char      line[256], name[64];
+  unsigned  mhz = 240, cycles, event, phase, core, arg, index;
+  std::map<unsigned, std::string> names;
+  int64_t   time = 0;
+  uint32_t  last = 0;
+  bool      first = true;
+  int       events = 0;
+
+  if ((in == NULL) || (out == NULL))
+  {
+    fprintf(stderr, "usage: trace_json [serial.log [trace.json]]\n");
+    return 1;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"core 0 (BLE)\"}},\n");
+  fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 1, \"args\": {\"name\": \"core 1 (loop)\"}}");
+
+  while (fgets(line, sizeof(line), in))
+  {
+    const char *p = strstr(line, "trace ");    // a log line may end without a new line
+
+    if (p == NULL)
+      continue;
+    if (sscanf(p, "trace %u MHz", &mhz) == 1)
+    {
+      first = true;                             // a new dump, from its first event
+      continue;
+    }
+    if (sscanf(p, "trace name %u %63s", &index, name) == 2)
+    {
+      names[index] = name;
+      continue;
+    }
+    if (sscanf(p, "trace ev %u %u %u %u %u", &cycles, &event, &phase, &core, &arg) != 5)
+      continue;
+
+    if (first)
+      time = 0;
+    else
+      time += (int32_t)(cycles - last);
+    last  = cycles;
+    first = false;
+
+    std::string event_name = names.count(event) ? names[event] : "event " + std::to_string(event);
+    double      us         = (double)time / (mhz ? mhz : 1);
+
+    fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": 0, \"tid\": %u",
+            event_name.c_str(), (phase == 0) ? "B" : (phase == 1) ? "E" : "i", us, core);
+    if (phase == 2)
+      fprintf(out, ", \"s\": \"t\", \"args\": {\"arg\": %u}", arg);
+    fprintf(out, "}");
+    events++;
+  }
+  fprintf(out, "\n]}\n");
+  fprintf(stderr, "%d events\n", events);
+  return 0;
+}
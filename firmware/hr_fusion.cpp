@@ -0,0 +1,210 @@
+/*---------------------------------------------------------------------------------
+  Heart rate fusion - one heart rate from the ECG and PPG beats, with a confidence
+
+  A scalar Kalman filter on the heart rate (bpm), updated at each beat:
+    predict     the heart rate walks, the variance grows HR_FUSION_Q bpm^2 per second
+    measure     60000 / interval of the beat, ECG R-R or PPG beat to beat, the
+                variance is larger for PPG and for a low signal quality
+    gate        a beat 3 sigma away is skipped, 3 in a row restart the filter
+                at the new rate (a real step, not an artifact)
+  The confidence (0..100) comes from the standard deviation of the estimate, it
+  drops when no beat comes and the heart rate is 0 after HR_FUSION_TIMEOUT_MS.
+
+  The ECG and PPG rates are also followed separately, when both are recent and
+  differ by more than 10 bpm or 15%, hr_disagree is set (a missed QRS, a PPG
+  harmonic, a loose finger), the confidence is halved and only ECG is used.
+
+  The ECG beats come from getData(), the PPG beats are read from the ppg_beat.cpp
+  ring by handleHrFusion() in loop().
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define HR_FUSION_Q           4.0f      // bpm^2 per second
+#define HR_FUSION_R_ECG       4.0f      // bpm^2 at SQI 100
+#define HR_FUSION_R_PPG       16.0f     // bpm^2 at SQI 100
+#define HR_FUSION_SQI_MIN     10
+#define HR_FUSION_GATE        9.0f      // 3 sigma, squared
+#define HR_FUSION_OUTLIERS    3         // in a row, restart at the new rate
+#define HR_FUSION_SIGMA_GOOD  1.0f      // bpm, confidence 100
+#define HR_FUSION_SIGMA_BAD   10.0f     // bpm, confidence 0
+#define HR_FUSION_TIMEOUT_MS  4000
+#define HR_IBI_MIN_MS         240       // 250 bpm
+#define HR_IBI_MAX_MS         2000      // 30 bpm
+#define HR_SOURCE_RECENT_MS   3000
+#define HR_SOURCE_A           0.3f      // EMA of each source
+#define HR_DISAGREE_BPM       10.0f
+#define HR_DISAGREE_RATIO     0.15f
+
+uint8_t   hr_fused        = 0;
+uint8_t   hr_confidence   = 0;
+bool      hr_disagree     = false;
+bool      hrFusionReady   = false;
+
+enum HrSource {HR_ECG, HR_PPG, HR_SOURCES};
+
+static float    hr_x        = 0;        // estimate, bpm, 0 = none
+static float    hr_p        = 0;        // variance, bpm^2
+static uint32_t hr_last_us  = 0;        // last update
+static uint8_t  hr_outliers[HR_SOURCES]; // in a row, of each source
+
+static float    source_rate[HR_SOURCES];
+static uint32_t source_us  [HR_SOURCES];
+static uint32_t ecg_last_r_us = 0;
+static bool     ecg_last_r_valid = false;
+
+/*---------------------------------------------------------------------------------
+ ECG and PPG rates, each on its own
+---------------------------------------------------------------------------------*/
+static void checkDisagree(HrSource source, float rate, uint32_t now_us)
+{
+  float diff, limit;
+
+  if ((source_rate[source] == 0) || ((int32_t)(now_us - source_us[source]) > HR_SOURCE_RECENT_MS * 1000L))
+    source_rate[source] = rate;
+  else
+    source_rate[source] += HR_SOURCE_A * (rate - source_rate[source]);
+  source_us[source] = now_us;
+
+  for (int i = 0; i < HR_SOURCES; i++)
+    if ((source_rate[i] == 0) || ((int32_t)(now_us - source_us[i]) > HR_SOURCE_RECENT_MS * 1000L))
+    {
+      hr_disagree = false;
+      return;
+    }
+
+  diff  = fabsf(source_rate[HR_ECG] - source_rate[HR_PPG]);
+  limit = max(HR_DISAGREE_BPM, HR_DISAGREE_RATIO * max(source_rate[HR_ECG], source_rate[HR_PPG]));
+  if (diff > limit)
+    hr_disagree = true;
+  else if (diff < limit / 2)
+    hr_disagree = false;                // hysteresis
+}
+
+static void updateConfidence(float p)
+{
+  float sigma = sqrtf(p);
+  float c     = (HR_FUSION_SIGMA_BAD - sigma) / (HR_FUSION_SIGMA_BAD - HR_FUSION_SIGMA_GOOD);
+
+  c = constrain(c, 0.0f, 1.0f) * 100;
+  if (hr_disagree)
+    c /= 2;
+  hr_confidence = (uint8_t)c;
+}
+
+/*---------------------------------------------------------------------------------
+ one beat of one source, interval in ms, time of the beat in micros()
+---------------------------------------------------------------------------------*/
+static void addInterval(HrSource source, uint32_t ibi_ms, uint8_t sqi, uint32_t beat_us)
+{
+  float   z, r, s, y;
+  int32_t dt_us;
+
+  if ((ibi_ms < HR_IBI_MIN_MS) || (ibi_ms > HR_IBI_MAX_MS))
+    return;
+
+  z = 60000.0f / ibi_ms;
+  r = (source == HR_ECG) ? HR_FUSION_R_ECG : HR_FUSION_R_PPG;
+  sqi = max(sqi, (uint8_t)HR_FUSION_SQI_MIN);
+  r *= (100.0f / sqi) * (100.0f / sqi);
+
+  // when they disagree, ECG is the reference, PPG is only followed
+  checkDisagree(source, z, beat_us);
+  if (hr_disagree && (source == HR_PPG))
+    return;
+
+  if (hr_x == 0)
+  {
+    hr_x = z;
+    hr_p = r;
+  }
+  else
+  {
+    // the PPG beat may be older than the last ECG beat, no negative time
+    dt_us = (int32_t)(beat_us - hr_last_us);
+    if (dt_us > 0)
+      hr_p += HR_FUSION_Q * dt_us / 1e6f;
+
+    y = z - hr_x;
+    s = hr_p + r;
+    if (y * y > HR_FUSION_GATE * s)
+    {
+      if (++hr_outliers[source] < HR_FUSION_OUTLIERS)
+        return;
+      hr_x = z;                         // the rate has really changed
+      hr_p = r;
+    }
+    else
+    {
+      hr_x += hr_p / s * y;
+      hr_p  = hr_p * r / s;
+    }
+  }
+  hr_outliers[source] = 0;
+  if ((int32_t)(beat_us - hr_last_us) > 0)
+    hr_last_us = beat_us;
+
+  hr_fused = (uint8_t)(hr_x + 0.5f);
+  updateConfidence(hr_p);
+  hrFusionReady = true;
+}
+
+/*---------------------------------------------------------------------------------
+ called at each QRS, r_us is micros() of the R wave, restart at lead-on
+---------------------------------------------------------------------------------*/
+void hrFusionEcgBeat(uint32_t r_us)
+{
+  if (ecg_last_r_valid)
+    addInterval(HR_ECG, (r_us - ecg_last_r_us) / 1000, ecg_sqi, r_us);
+  ecg_last_r_us    = r_us;
+  ecg_last_r_valid = true;
+}
+
+void hrFusionEcgRestart(void)
+{
+  ecg_last_r_valid = false;
+}
+
+/*---------------------------------------------------------------------------------
+ called from loop(), PPG beats and timeout
+---------------------------------------------------------------------------------*/
+void handleHrFusion(void)
+{
+  static uint32_t next = 0;
+  uint32_t  since_us;
+  PpgBeat   beat;
+
+  if (ppgBeatCount() - next > PPG_BEAT_RING_SIZE)
+    next = ppgBeatCount() - PPG_BEAT_RING_SIZE;     // lost, too slow
+  while (next < ppgBeatCount())
+    if (ppgGetBeat(next++, &beat) && beat.ibi_ms)
+      addInterval(HR_PPG, beat.ibi_ms, ppg_sqi, beat.foot_us);
+
+  if (hr_x == 0)
+    return;
+
+  since_us = micros() - hr_last_us;
+  if (since_us > HR_FUSION_TIMEOUT_MS * 1000UL)
+  {
+    hr_x          = 0;
+    hr_fused      = 0;
+    hr_confidence = 0;
+    hr_disagree   = false;
+    hrFusionReady = true;
+  }
+  else
+  {
+    uint8_t old = hr_confidence;
+
+    // no beat, the confidence decays, sent at each 10% step
+    updateConfidence(hr_p + HR_FUSION_Q * since_us / 1e6f);
+    if (hr_confidence / 10 != old / 10)
+      hrFusionReady = true;
+  }
+}
+
+void printFusion(void)
+{
+  Serial.printf("heart rate %u, confidence %u%s, ecg %.1f, ppg %.1f bpm\r\n",
+                hr_fused, hr_confidence, hr_disagree ? ", ECG/PPG disagree" : "",
+                source_rate[HR_ECG], source_rate[HR_PPG]);
+}
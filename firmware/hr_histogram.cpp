@@ -0,0 +1,200 @@
+/*---------------------------------------------------------------------------------
+  Heart rate histogram and quantiles
+
+  Bins of HISTGRM_BIN_WIDTH bpm from HISTGRM_BIN_FIRST, the rates below the first
+  bin are counted in it, the rates above the last bin in the last one.
+
+  The counts decay, a beat HISTGRM_DECAY_BEATS beats ago weights 1/e, so the
+  histogram follows the current state instead of everything since power up.
+  The decay is done by growing the weight of the new beat instead of shrinking
+  all the counts, the counts and their sum are rescaled only when the weight is
+  too large, a beat is O(1), a publish (percent for BLE) is O(bins).
+
+  Median, 5th and 95th percentile of all the beats since power up come from the
+  P2 algorithm, 5 markers for each, no samples stored.
+
+  Reference:
+  R. Jain and I. Chlamtac, "The P2 algorithm for dynamic calculation of quantiles
+  and histograms without storing observations", Comm. ACM 28(10), 1985
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define HISTGRM_CALC_TH       10        // beats between publishes
+#define HISTGRM_DECAY_BEATS   600       // ~10 minutes at 60 bpm, 0 never decays
+#define HISTGRM_RESCALE       1.0e6f    // rescale when the weight of a beat reaches it
+
+uint8_t   histogram_percent[HISTGRM_PERCENT_SIZE];
+bool      histogramReady    = false;
+
+static float    hist_count[HISTGRM_BINS];
+static float    hist_sum    = 0;
+static float    hist_weight = 1;        // weight of the next beat
+static uint8_t  hist_beats  = 0;        // since the last publish
+
+/*---------------------------------------------------------------------------------
+ P2 streaming quantile
+---------------------------------------------------------------------------------*/
+class P2Quantile
+{
+  public:
+    P2Quantile(float p) : p(p) {}
+    void  add     (float x);
+    float quantile(void);
+
+  private:
+    float     parabolic(int i, int d);
+    float     linear   (int i, int d);
+
+    float     p;
+    uint32_t  count = 0;
+    float     q[5];                     // marker heights
+    int32_t   n[5];                     // marker positions
+    float     np[5];                    // desired positions
+};
+
+void P2Quantile::add(float x)
+{
+  int k;
+
+  if (count < 5){
+    // the first 5 samples are the markers, sorted
+    for (k = count; (k > 0) && (q[k-1] > x); k--)
+      q[k] = q[k-1];
+    q[k] = x;
+    if (++count == 5){
+      for (int i = 0; i < 5; i++)
+        n[i] = i;
+      np[0] = 0;
+      np[1] = 2*p;
+      np[2] = 4*p;
+      np[3] = 2 + 2*p;
+      np[4] = 4;
+    }
+    return;
+  }
+  count++;
+
+  // cell of x, the extreme markers follow the min and max
+  if (x < q[0]){
+    q[0] = x;
+    k = 0;
+  }
+  else if (x >= q[4]){
+    q[4] = x;
+    k = 3;
+  }
+  else{
+    for (k = 0; x >= q[k+1]; k++);
+  }
+
+  for (int i = k+1; i < 5; i++)
+    n[i]++;
+  np[1] += p/2;
+  np[2] += p;
+  np[3] += (1+p)/2;
+  np[4] += 1;
+
+  // move the middle markers 1 position toward their desired position
+  for (int i = 1; i <= 3; i++){
+    float d = np[i] - n[i];
+
+    if (((d >= 1) && (n[i+1] - n[i] > 1)) || ((d <= -1) && (n[i-1] - n[i] < -1))){
+      int   s  = (d > 0) ? 1 : -1;
+      float qp = parabolic(i, s);
+
+      if ((q[i-1] < qp) && (qp < q[i+1]))
+        q[i] = qp;
+      else
+        q[i] = linear(i, s);
+      n[i] += s;
+    }
+  }
+}
+
+float P2Quantile::parabolic(int i, int d)
+{
+  return q[i] + (float)d / (n[i+1] - n[i-1]) *
+         ((n[i] - n[i-1] + d) * (q[i+1] - q[i]) / (n[i+1] - n[i]) +
+          (n[i+1] - n[i] - d) * (q[i] - q[i-1]) / (n[i] - n[i-1]));
+}
+
+float P2Quantile::linear(int i, int d)
+{
+  return q[i] + d * (q[i+d] - q[i]) / (n[i+d] - n[i]);
+}
+
+float P2Quantile::quantile(void)
+{
+  if (count == 0)
+    return 0;
+  if (count < 5)
+    return q[(int)(p * (count - 1) + 0.5f)];
+  return q[2];
+}
+
+static P2Quantile hr_quantile[HR_QUANTILES] = {P2Quantile(0.05), P2Quantile(0.5), P2Quantile(0.95)};
+
+/*---------------------------------------------------------------------------------
+ percent of each bin, for BLE
+---------------------------------------------------------------------------------*/
+static void publishHistogram(void)
+{
+  if (hist_sum <= 0)
+    return;
+
+  for (int i = 0; i < HISTGRM_BINS; i++)
+    histogram_percent[i] = (uint8_t)(hist_count[i] * 100 / hist_sum + 0.5f);
+  histogramReady = true;
+}
+
+/*---------------------------------------------------------------------------------
+ called at each beat, hr 0 is no heart rate (lead off, bad signal)
+---------------------------------------------------------------------------------*/
+void hrHistogramAdd(uint8_t hr)
+{
+  int bin;
+
+  if (hr == 0)
+    return;
+
+  bin = ((int)hr - HISTGRM_BIN_FIRST) / HISTGRM_BIN_WIDTH;
+  if (hr < HISTGRM_BIN_FIRST)
+    bin = 0;
+  else if (bin >= HISTGRM_BINS)
+    bin = HISTGRM_BINS - 1;
+
+  hist_count[bin] += hist_weight;
+  hist_sum        += hist_weight;
+
+#if HISTGRM_DECAY_BEATS
+  hist_weight *= 1.0f + 1.0f / HISTGRM_DECAY_BEATS;
+  if (hist_weight >= HISTGRM_RESCALE){
+    for (int i = 0; i < HISTGRM_BINS; i++)
+      hist_count[i] /= hist_weight;
+    hist_sum   /= hist_weight;
+    hist_weight = 1;
+  }
+#endif
+
+  for (int i = 0; i < HR_QUANTILES; i++)
+    hr_quantile[i].add(hr);
+
+  if (++hist_beats >= HISTGRM_CALC_TH){
+    hist_beats = 0;
+    publishHistogram();
+  }
+}
+
+uint8_t hrQuantile(HrQuantile which)
+{
+  return (uint8_t)(hr_quantile[which].quantile() + 0.5f);
+}
+
+void printHistogram(void)
+{
+  for (int i = 0; i < HISTGRM_BINS; i++)
+    Serial.printf("%3u-%3u bpm %3u%%\r\n", HISTGRM_BIN_FIRST + i * HISTGRM_BIN_WIDTH,
+                  HISTGRM_BIN_FIRST + (i+1) * HISTGRM_BIN_WIDTH - 1, histogram_percent[i]);
+  Serial.printf("heart rate 5%% %u, median %u, 95%% %u bpm\r\n",
+                hrQuantile(HR_P5), hrQuantile(HR_MEDIAN), hrQuantile(HR_P95));
+}
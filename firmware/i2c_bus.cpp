@@ -0,0 +1,198 @@
+/*---------------------------------------------------------------------------------
+  I2C transaction scheduler - owns the shared sensor I2C bus (Wire)
+
+  MAX3010X, MMA8452Q and MAX30205/TMP117 are on the same bus. A blocking Wire call
+  from loop() to a slow or NACKing device stalls the ECG path, so the sensor drivers
+  submit transactions here and return immediately:
+
+    static I2CTransaction t = {address, reg, buffer, length, I2C_READ,
+                               I2C_PRIORITY_LOW, 0, callback, context};
+    i2cBus.submit(&t);
+
+  The "i2c" task runs the transactions one by one, the high priority queue first.
+  When a transaction is done, "t.done" is set (poll it like a future) and the
+  callback, if any, is called in the i2c task. "t.error" is the Wire error code
+  (0 = OK), or I2C_EXPIRED / I2C_SHORT_READ. A transaction still in the queue
+  after its deadline (millis) is dropped without touching the bus. On a full
+  queue submit() returns false and the transaction is done at once with
+  I2C_QUEUE_FULL (no callback), so a driver which polls "done" submits it again.
+
+  The transaction must stay valid until it is done, use static variables.
+  A callback may submit the next transaction, but must not wait for it.
+
+  transfer() is the blocking version, it runs in the caller's task. Drivers which
+  still call Wire directly after setup() must hold lock()/unlock().
+
+  Latency (submit -> done) and error counters are kept per device address,
+  type "i2c" in CLI to show them.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include <Wire.h>
+
+#define I2C_QUEUE_SIZE        16
+#define I2C_TASK_STACK        2048
+#define I2C_TASK_PRIORITY     2     // above loop() (1), the task sleeps while Wire waits
+#define I2C_TASK_CORE         1     // same core as loop(), BLE stack is on core 0
+#define I2C_MAX_DEVICES       8
+
+struct I2CDeviceStats
+{
+  uint8_t   address;
+  uint32_t  count;
+  uint32_t  errors;
+  uint32_t  expired;
+  uint32_t  latency_sum_us;
+  uint32_t  latency_max_us;
+};
+
+I2CDeviceStats  i2c_stats[I2C_MAX_DEVICES];
+uint32_t        i2c_queue_full = 0;
+
+I2CBus i2cBus;
+
+static I2CDeviceStats *find_stats(uint8_t address)
+{
+  for (int i = 0; i < I2C_MAX_DEVICES; i++)
+  {
+    if (i2c_stats[i].address == address)
+      return &i2c_stats[i];
+    if (i2c_stats[i].address == 0)   // first free slot
+    {
+      i2c_stats[i].address = address;
+      return &i2c_stats[i];
+    }
+  }
+  return NULL;                      // table full, not counted
+}
+
+void I2CBus :: begin(void)
+{
+  mutex     = xSemaphoreCreateMutex();
+  pending   = xSemaphoreCreateCounting(2 * I2C_QUEUE_SIZE, 0);
+  highQueue = xQueueCreate(I2C_QUEUE_SIZE, sizeof(I2CTransaction *));
+  lowQueue  = xQueueCreate(I2C_QUEUE_SIZE, sizeof(I2CTransaction *));
+
+  xTaskCreatePinnedToCore(task, "i2c", I2C_TASK_STACK, this,
+                          I2C_TASK_PRIORITY, &taskHandle, I2C_TASK_CORE);
+}
+
+void I2CBus :: lock(void)
+{
+  xSemaphoreTake(mutex, portMAX_DELAY);
+}
+
+void I2CBus :: unlock(void)
+{
+  xSemaphoreGive(mutex);
+}
+
+bool I2CBus :: submit(I2CTransaction *t)
+{
+  t->done      = false;
+  t->submit_us = micros();
+
+  QueueHandle_t queue = (t->priority == I2C_PRIORITY_HIGH) ? highQueue : lowQueue;
+  if (xQueueSend(queue, &t, 0) != pdTRUE)
+  {
+    i2c_queue_full++;
+    t->error = I2C_QUEUE_FULL;
+    t->done  = true;
+    return false;
+  }
+  xSemaphoreGive(pending);
+  return true;
+}
+
+uint8_t I2CBus :: transfer(I2CTransaction *t)
+{
+  t->done      = false;
+  t->submit_us = micros();
+  run(t);
+  return t->error;
+}
+
+// Wire access, called with the bus locked
+uint8_t I2CBus :: execute(I2CTransaction *t)
+{
+  Wire.beginTransmission(t->address);
+  if (t->op == I2C_PROBE)
+    return Wire.endTransmission();
+
+  Wire.write(t->reg);
+  if (t->op == I2C_WRITE)
+  {
+    Wire.write(t->data, t->length);
+    return Wire.endTransmission();
+  }
+
+  Wire.endTransmission(false);      // repeated start, keep the bus
+  if (Wire.requestFrom(t->address, t->length) != t->length)
+    return I2C_SHORT_READ;
+  for (int i = 0; i < t->length; i++)
+    t->data[i] = Wire.read();
+  return 0;
+}
+
+void I2CBus :: run(I2CTransaction *t)
+{
+  uint32_t        latency;
+  I2CDeviceStats *stats;
+
+  if ((t->deadline != 0) && ((int32_t)(millis() - t->deadline) > 0))
+    t->error = I2C_EXPIRED;
+  else
+  {
+    lock();
+    TRACE_BEGIN(TR_I2C);
+    t->error = execute(t);
+    TRACE_END(TR_I2C);
+    unlock();
+  }
+
+  latency = micros() - t->submit_us;
+  stats   = (t->op == I2C_PROBE) ? NULL : find_stats(t->address);
+  if (stats)
+  {
+    stats->count++;
+    if (t->error == I2C_EXPIRED)
+      stats->expired++;
+    else if (t->error)
+      stats->errors++;
+    stats->latency_sum_us += latency;
+    if (latency > stats->latency_max_us)
+      stats->latency_max_us = latency;
+  }
+
+  t->done = true;
+  if (t->callback)
+    t->callback(t);
+}
+
+void I2CBus :: task(void *parameter)
+{
+  I2CBus         *bus = (I2CBus *)parameter;
+  I2CTransaction *t;
+
+  for (;;)
+  {
+    xSemaphoreTake(bus->pending, portMAX_DELAY);
+    if (xQueueReceive(bus->highQueue, &t, 0) != pdTRUE)
+      if (xQueueReceive(bus->lowQueue, &t, 0) != pdTRUE)
+        continue;
+    bus->run(t);
+  }
+}
+
+void I2CBus :: printStats(void)
+{
+  Serial.println("addr  count  errors expired avg(us) max(us)");
+  for (int i = 0; i < I2C_MAX_DEVICES; i++)
+  {
+    I2CDeviceStats *s = &i2c_stats[i];
+    if (s->address == 0)
+      break;
+    Serial.printf("0x%02X %6u %7u %7u %7u %7u\r\n", s->address, s->count, s->errors,
+                  s->expired, s->count ? s->latency_sum_us / s->count : 0, s->latency_max_us);
+  }
+  Serial.printf("queue full: %u\r\n", i2c_queue_full);
+}
@@ -0,0 +1,225 @@
+/*---------------------------------------------------------------------------------
+  Deferred log - printf lines from loop() and the tasks, printed by a low priority task
+
+  A Serial.printf() in loop() waits for the UART (~90us a character at 115200), a
+  40 character line is 3.5ms of ECG and PPG not read. LOG_E/W/I/D() instead store
+  an event, the format pointer and the arguments as words, no formatting:
+
+    LOG_I(LOG_BLE, "ble:send spo2 %u", spo2_percent);
+
+  The "log" task formats the events and writes them to Serial, a new line added.
+    format      a string literal, it is kept as a pointer
+    arguments   up to LOG_ARGS, integers, float/double, and %s of string literals
+                or static strings only (the string is read later)
+    levels      LOG_LEVEL strips the lower levels at compile time (the arguments
+                are not evaluated), log_level[tag] filters at run time ("log" CLI)
+    rate        LOG_RATE_PER_S events per tag each second, the others are dropped
+                and counted, like the events which find the ring full
+
+  The ring is lock-free for several writers (loop(), BLE callbacks, other tasks):
+  a writer reserves a slot with compare and swap on the head, fills it and
+  publishes it with its sequence number, the log task takes the slots in order.
+  Nothing is printed while the binary serial stream is on, the events are dropped.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define LOG_RING_SIZE         64        // events, power of 2
+#define LOG_RATE_PER_S        20        // events per tag
+#define LOG_LINE_SIZE         160
+#define LOG_TASK_STACK        3072
+#define LOG_TASK_PRIORITY     1
+#define LOG_TASK_CORE         0
+#define LOG_TASK_IDLE_MS      10
+
+struct LogEvent
+{
+  volatile uint32_t seq;                // index + 1 when published
+  const char *format;
+  uint8_t     level;
+  uint8_t     tag;
+  uint8_t     count;
+  LogArg      args[LOG_ARGS];
+};
+
+static const char *tag_names[LOG_TAGS] = {"sys", "ble", "ecg", "ppg", "motion", "rec"};
+
+uint8_t   log_level[LOG_TAGS] = {LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL};
+
+static LogEvent   ring[LOG_RING_SIZE];
+static uint32_t   ring_head   = 0;      // reserved by the writers
+static uint32_t   ring_tail   = 0;      // the next one printed
+
+static uint32_t   rate_second[LOG_TAGS];
+static uint16_t   rate_count [LOG_TAGS];
+
+static uint32_t   log_written = 0, log_full = 0, log_limited = 0, log_streaming = 0;
+
+/*---------------------------------------------------------------------------------
+ writers, any task
+---------------------------------------------------------------------------------*/
+void logWrite(uint8_t level, uint8_t tag, const char *format, const LogArg *args, uint8_t count)
+{
+  uint32_t  head, now = millis();
+  LogEvent *event;
+
+  if (level > log_level[tag])
+    return;
+
+  // a few more than the rate when 2 writers race on the same tag, it is a limit
+  if (now / 1000 != rate_second[tag])
+  {
+    rate_second[tag] = now / 1000;
+    rate_count [tag] = 0;
+  }
+  if (++rate_count[tag] > LOG_RATE_PER_S)
+  {
+    log_limited++;
+    return;
+  }
+
+  head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+  do
+  {
+    if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+    {
+      log_full++;
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&ring_head, &head, head + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  event          = &ring[head & (LOG_RING_SIZE - 1)];
+  event->format  = format;
+  event->level   = level;
+  event->tag     = tag;
+  event->count   = min(count, (uint8_t)LOG_ARGS);
+  memcpy(event->args, args, event->count * sizeof(LogArg));
+  __atomic_store_n(&event->seq, head + 1, __ATOMIC_RELEASE);
+}
+
+/*---------------------------------------------------------------------------------
+ the log task, printf of one event, one conversion at a time
+---------------------------------------------------------------------------------*/
+static int formatEvent(const LogEvent *event, char *line, int size)
+{
+  const char *f = event->format;
+  char      spec[16];
+  int       n = 0, arg = 0;
+
+  while (*f && (n < size - 1))
+  {
+    if ((*f != '%') || (f[1] == '%'))
+    {
+      line[n++] = *f;
+      f += (*f == '%') ? 2 : 1;
+      continue;
+    }
+
+    // one conversion, %[flags][width][.precision][length]type
+    int k = 0, longs = 0;
+    spec[k++] = *f++;
+    while (*f && strchr("-+ #0123456789.lhz", *f))
+    {
+      if (*f == 'l')
+        longs++;
+      if (k < (int)sizeof(spec) - 2)
+        spec[k++] = *f;
+      f++;
+    }
+    if (*f == 0)
+      break;
+    spec[k++] = *f++;
+    spec[k]   = 0;
+
+    LogArg a = (arg < event->count) ? event->args[arg++] : 0;
+    char   type = spec[k-1];
+    int    room = size - n;
+
+    if (strchr("feEgG", type))
+    {
+      uint32_t bits = a;
+      float    x;
+      memcpy(&x, &bits, sizeof(x));
+      n += snprintf(&line[n], room, spec, (double)x);
+    }
+    else if (type == 's')
+      n += snprintf(&line[n], room, spec, a ? (const char *)a : "(null)");
+    else if (type == 'p')
+      n += snprintf(&line[n], room, spec, (void *)a);
+    else if (longs >= 2)
+      n += snprintf(&line[n], room, spec, (long long)(intptr_t)a);
+    else if (longs == 1)
+      n += snprintf(&line[n], room, spec, (long)(intptr_t)a);
+    else
+      n += snprintf(&line[n], room, spec, (int)a);
+    n = min(n, size - 1);
+  }
+  line[n] = 0;
+  return n;
+}
+
+bool logService(void)
+{
+  LogEvent *event = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+  char      line[LOG_LINE_SIZE];
+
+  if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+    return false;                       // empty, or the writer is not done
+
+  if (serial_streaming)
+    log_streaming++;
+  else
+  {
+    formatEvent(event, line, sizeof(line));
+    Serial.println(line);
+    log_written++;
+  }
+  __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+#ifndef HOST_BUILD
+static void logTask(void *parameter)
+{
+  for (;;)
+    if (!logService())
+      vTaskDelay(pdMS_TO_TICKS(LOG_TASK_IDLE_MS));
+}
+#endif
+
+/*---------------------------------------------------------------------------------
+ CLI "log [tag|all] [0..4]"
+---------------------------------------------------------------------------------*/
+void logSetLevel(const char *tag, int level)
+{
+  level = constrain(level, LOG_LEVEL_NONE, LOG_LEVEL_DEBUG);
+  for (int i = 0; i < LOG_TAGS; i++)
+    if ((strcmp(tag, "all") == 0) || (strcmp(tag, tag_names[i]) == 0))
+      log_level[i] = level;
+}
+
+void printLog(void)
+{
+  for (int i = 0; i < LOG_TAGS; i++)
+    Serial.printf("%s %u, ", tag_names[i], log_level[i]);
+  Serial.printf("built with %u\r\n", LOG_LEVEL);
+  Serial.printf("printed %u, dropped: ring full %u, rate %u, binary stream %u\r\n",
+                log_written, log_full, log_limited, log_streaming);
+}
+
+static int cmdLog(void)
+{
+  if (cliArg(1)[0] && cliArg(2)[0])
+    logSetLevel(cliArg(1), atoi(cliArg(2)));
+  printLog();
+  return 0;
+}
+
+void initLog(void)
+{
+  cliAddCommand("log", cmdLog, "log [tag|all] [0..4], levels and the lines dropped");
+#ifndef HOST_BUILD
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK, NULL,
+                          LOG_TASK_PRIORITY, NULL, LOG_TASK_CORE);
+#endif
+}
@@ -0,0 +1,150 @@
+/*---------------------------------------------------------------------------------
+  PPG motion artifact cancellation - accelerometer as the noise reference
+
+  Movement changes the blood volume and the sensor contact under the LEDs, the
+  artifact is in the same band as the pulse, so a fixed filter can not remove it.
+  But it is correlated with the acceleration, so an adaptive filter (NLMS) learns
+  the path from the MMA8452Q x/y/z to each PPG channel and subtracts its estimate:
+
+    u     x/y/z without gravity, last MOTION_FILTER_ORDER samples per axis
+    d     PPG sample without DC
+    e     d - w.u                  cleaned sample, returned with the DC added back
+    w     w + mu * e * u / |u|^2   normalized step, independent of motion level
+
+  The taps also cover the delay between the two sensors. The accelerometer runs
+  at its own rate, motionReference() averages its samples up to the time of each
+  PPG sample (25Hz), then motionCancel() is called for IR and red.
+
+  At rest u is only the accelerometer noise, an NLMS step then fits that noise
+  and adds it to a clean pulse. eps is set well above the energy of the noise
+  floor in the taps, and below MOTION_ADAPT_MG (the rms of the taps, or the
+  motion index if higher) the sample passes as it is and the weights are kept
+  for the next movement.
+
+  The motion index is the rms acceleration (mg) over a SpO2 window. Above
+  MOTION_SKIP_MG even the cleaned window is not used, the last SpO2 and heart
+  rate are kept instead of computing garbage.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define MOTION_NLMS_MU      0.1     // step size, 0 < mu < 2
+#define MOTION_NOISE_G      0.010   // accelerometer noise floor, rms per axis
+#define MOTION_NLMS_EPS     (4 * 3 * MOTION_FILTER_ORDER * MOTION_NOISE_G * MOTION_NOISE_G) // g^2
+#define MOTION_ADAPT_MG     30      // rms, below it no cancellation and no adaptation
+#define MOTION_GRAVITY_A    (1.0 / 32)  // EMA of gravity, ~1.3s at 25Hz
+#define MOTION_DC_A         (1.0 / 64)  // EMA of PPG DC
+#define MOTION_SKIP_MG      150
+
+bool      motion_cancel_on  = MOTION_CANCEL;
+uint16_t  motion_index      = 0;
+
+static float    gravity[3];                         // g
+static float    reference[3][MOTION_FILTER_ORDER];  // g, [axis][0] is the newest
+static float    weight[MOTION_CHANNELS][3][MOTION_FILTER_ORDER];
+static float    ppg_dc[MOTION_CHANNELS];
+static float    window_power  = 0;                  // g^2
+static uint16_t window_count  = 0;
+static uint8_t  hold_windows  = 0;
+
+// average the accelerometer samples up to timestamp_us, remove gravity and
+// shift it into the reference
+void motionReference(uint32_t timestamp_us)
+{
+  static bool     started = false;
+  static uint32_t next;
+  static float    last[3];        // g, kept if no new sample
+  AccelSample     s;
+  int32_t         sum[3] = {0, 0, 0};
+  int             n = 0;
+
+  if (!started)
+  {
+    next    = accelSampleCount();
+    started = true;
+  }
+
+  while (next != accelSampleCount())
+  {
+    if (!accelGetSample(next, &s))
+    {
+      next = accelSampleCount() - ACCEL_RING_SIZE + 1;   // overwritten, skip ahead
+      continue;
+    }
+    if ((int32_t)(s.timestamp_us - timestamp_us) > 0)
+      break;                      // after this PPG sample
+    sum[0] += s.x;
+    sum[1] += s.y;
+    sum[2] += s.z;
+    n++;
+    next++;
+  }
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (n)
+    {
+      last[axis] = (float)sum[axis] / n / ACCEL_1G;
+      if (gravity[axis] == 0)
+        gravity[axis] = last[axis];
+    }
+    gravity[axis] += MOTION_GRAVITY_A * (last[axis] - gravity[axis]);
+
+    for (int k = MOTION_FILTER_ORDER - 1; k > 0; k--)
+      reference[axis][k] = reference[axis][k - 1];
+    reference[axis][0] = last[axis] - gravity[axis];
+    window_power += reference[axis][0] * reference[axis][0];
+  }
+  window_count++;
+}
+
+// return the sample without the motion artifact, or as it is when switched off
+uint32_t motionCancel(MotionChannel channel, uint32_t sample)
+{
+  float d, y, e, power, step;
+
+  if (ppg_dc[channel] == 0)
+    ppg_dc[channel] = sample;
+  ppg_dc[channel] += MOTION_DC_A * ((float)sample - ppg_dc[channel]);
+  if (!motion_cancel_on)
+    return sample;
+
+  d     = (float)sample - ppg_dc[channel];
+  y     = 0;
+  power = 0;
+  for (int axis = 0; axis < 3; axis++)
+    for (int k = 0; k < MOTION_FILTER_ORDER; k++)
+    {
+      y     += weight[channel][axis][k] * reference[axis][k];
+      power += reference[axis][k] * reference[axis][k];
+    }
+  if ((motion_index < MOTION_ADAPT_MG) &&
+      (power < (3 * MOTION_FILTER_ORDER) * (MOTION_ADAPT_MG / 1000.0) * (MOTION_ADAPT_MG / 1000.0)))
+    return sample;                // at rest, the reference is noise
+  e = d - y;
+
+  step = MOTION_NLMS_MU * e / (power + MOTION_NLMS_EPS);
+  for (int axis = 0; axis < 3; axis++)
+    for (int k = 0; k < MOTION_FILTER_ORDER; k++)
+      weight[channel][axis][k] += step * reference[axis][k];
+
+  e += ppg_dc[channel];
+  return (e > 0) ? (uint32_t)e : 0;
+}
+
+// Called when a SpO2 window is complete, update motion_index. "hold" is the
+// windows in the SpO2 buffer, a window with motion spoils them all.
+// Return false if the buffer is not usable.
+bool motionUsable(uint8_t hold)
+{
+  if (window_count)
+    motion_index = sqrt(window_power / window_count) * 1000;
+  window_power = 0;
+  window_count = 0;
+
+  if (motion_index > MOTION_SKIP_MG)
+    hold_windows = hold;
+  if (hold_windows == 0)
+    return true;
+  hold_windows--;
+  return false;
+}
@@ -0,0 +1,118 @@
+/*---------------------------------------------------------------------------------
+  Overrun - the samples lost between the sensors and the app, counted and marked
+
+  Where a sample can be lost without a trace:
+    ECG     DRDY comes again before loop() read the last sample, one flag for both.
+            The ISR counts the DRDYs, getData() compares with the samples it read.
+    PPG     AFE4490: the same with its data ready ISR. MAX3010x: the FIFO is full
+            and the sensor drops samples, its OVF_COUNTER (read with the FIFO
+            pointers) tells how many.
+    accel   ZYXOW in the MMA8452Q status (read with x, y, z), a sample was
+            overwritten before it was read.
+    queue   ecg_queue/ppg_queue full (the BLE stack is slow), push() fails.
+
+  A lost ECG or PPG sample is replaced by GAP_MARKER in the stream to the app
+  (or in the recorder while disconnected), one marker for each sample, up to
+  OVR_MAX_MARKERS, so the samples after a gap keep their place in time. A real
+  sample never has that value. The markers of a full queue go in before the
+  next sample which fits.
+
+  The counters are in "stats" and at the end of the diagnostics characteristic
+  (profile.cpp), u16 missed and u16 queue full of each OverrunPath. One writer
+  for each counter: loop(), or the I2C task for the accelerometer.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include "cppQueue.h"
+
+#define OVR_MAX_MARKERS       32        // in a row, the rest of a long gap is counted only
+
+extern Queue ecg_queue;
+extern Queue ppg_queue;
+
+struct OverrunCounters
+{
+  uint32_t  missed;                     // by the sensor or the ISR flag
+  uint32_t  queue_full;
+  uint32_t  markers;                    // sent to the app or recorded
+  uint16_t  pending;                    // markers not in the stream yet
+};
+
+static const char *path_names[OVR_PATHS] = {"ecg", "ppg", "accel"};
+
+static OverrunCounters counters[OVR_PATHS];
+
+/*---------------------------------------------------------------------------------
+ a sensor or its ISR lost samples
+---------------------------------------------------------------------------------*/
+void overrunMissed(OverrunPath path, uint32_t samples)
+{
+  TRACE_MARK((TraceEvent)(TR_MISSED_ECG + path), min(samples, (uint32_t)UINT16_MAX));
+  counters[path].missed += samples;
+  counters[path].pending = min(counters[path].pending + samples, (uint32_t)OVR_MAX_MARKERS);
+}
+
+/*---------------------------------------------------------------------------------
+ an ECG or PPG sample to the app, or to the recorder, after the markers of a gap
+---------------------------------------------------------------------------------*/
+void overrunSample(OverrunPath path, int16_t sample)
+{
+  OverrunCounters &c = counters[path];
+  Queue    *queue  = (path == OVR_ECG) ? &ecg_queue : &ppg_queue;
+  int16_t   marker = GAP_MARKER;
+
+  if (sample == GAP_MARKER)
+    sample++;                           // keep the value for the markers
+
+  if (!bleDeviceConnected)
+  {
+    RecStream stream = (path == OVR_ECG) ? REC_ECG : REC_PPG;
+
+    for (; c.pending > 0; c.pending--, c.markers++)
+      recorderSample(stream, GAP_MARKER);
+    recorderSample(stream, sample);
+    return;
+  }
+
+  while ((c.pending > 0) && queue->push(&marker))
+  {
+    c.pending--;
+    c.markers++;
+  }
+  if ((c.pending > 0) || !queue->push(&sample))
+  {
+    TRACE_MARK(TR_QUEUE_FULL, path);
+    c.queue_full++;
+    c.pending = min(c.pending + 1, OVR_MAX_MARKERS);
+  }
+}
+
+// the samples missed so far, for a module which counts them over its own work
+uint32_t overrunCount(OverrunPath path)
+{
+  return counters[path].missed;
+}
+
+/*---------------------------------------------------------------------------------
+ diagnostics, OVERRUN_PACK_SIZE bytes
+---------------------------------------------------------------------------------*/
+void packOverrun(uint8_t *p)
+{
+  for (int i = 0; i < OVR_PATHS; i++)
+  {
+    uint16_t missed = counters[i].missed;         // the app takes the difference
+    uint16_t full   = counters[i].queue_full;
+
+    *p++ = missed;
+    *p++ = missed >> 8;
+    *p++ = full;
+    *p++ = full >> 8;
+  }
+}
+
+void printOverrun(void)
+{
+  Serial.println("path        missed  queue full  gap markers");
+  for (int i = 0; i < OVR_PATHS; i++)
+    Serial.printf("%-8s %9u  %10u  %11u\r\n", path_names[i],
+                  counters[i].missed, counters[i].queue_full, counters[i].markers);
+}
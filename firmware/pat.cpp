@@ -0,0 +1,227 @@
+/*---------------------------------------------------------------------------------
+  Pulse arrival time (PAT) - from the ECG R wave to the PPG foot of the same beat
+
+  PAT follows the blood pressure (a higher pressure, a stiffer artery, a faster
+  pulse wave), its trend is used for cuffless blood pressure trending.
+
+  R wave        the QRS detector input around each detection, the maximum and the
+                parabola through the 3 samples around it, timed by the ADS1292R
+                data ready interrupt (ESP32 clock)
+  PPG foot      from ppg_beat.cpp, the tangent at the upstroke down to the minimum
+  pairing       each foot with the last R wave PAT_MIN_US..PAT_MAX_US before it
+  outliers      a PAT more than PAT_OUTLIER_US from the median of the last ones
+                is skipped, PAT_RESTART rejected in a row restart the median
+  trend         EMA of the accepted PATs
+
+  Clock drift: the MAX3010x samples with its own oscillator, its FIFO is read in
+  batches, so the time of a sample is not known, only that it is before the read.
+  SampleClock fits the sample period from the reads over SAMPLE_CLOCK_WINDOW_US
+  and keeps the sample times on the lower envelope of the read times.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define PAT_R_RING_SIZE       8         // R waves, power of 2
+#define PAT_ECG_HISTORY       16        // detector samples, power of 2
+#define PAT_R_SEARCH_AFTER    8         // samples after the detection
+#define PAT_R_SEARCH          14        // samples, from before the detection
+#define PAT_MIN_US            80000
+#define PAT_MAX_US            500000
+#define PAT_MEDIAN_SIZE       5         // beats
+#define PAT_OUTLIER_US        30000
+#define PAT_RESTART           5         // rejected in a row
+#define PAT_TREND_A           0.1f
+
+#define SAMPLE_CLOCK_WINDOW_US  10000000  // period measured over 10s
+#define SAMPLE_CLOCK_LEAK       16        // a late read moves the sample times 1/16
+
+uint8_t   pat_pack[PAT_PACK_SIZE];
+bool      patReady    = false;
+
+static uint32_t r_ring[PAT_R_RING_SIZE];
+static uint32_t r_head        = 0;
+
+static int16_t  ecg_x [PAT_ECG_HISTORY];
+static uint32_t ecg_t [PAT_ECG_HISTORY];
+static uint32_t ecg_head      = 0;
+static uint8_t  r_countdown   = 0;
+
+static uint32_t pat_recent[PAT_MEDIAN_SIZE];
+static uint8_t  pat_count     = 0;      // in pat_recent
+static uint8_t  pat_rejected  = 0;      // in a row
+static uint16_t pat_accepted  = 0;      // bit mask of the last 16 beats
+static float    pat_trend_us  = 0;
+static uint32_t pat_last_us   = 0;
+
+/*---------------------------------------------------------------------------------
+ sample times of a sensor with its own clock, read in batches
+---------------------------------------------------------------------------------*/
+void SampleClock::received(uint32_t now_us, uint32_t count)
+{
+  uint32_t  newest, predicted;
+  int32_t   late;
+
+  if ((count == 0) || (count == last_count))
+    return;
+  last_count = count;
+  newest     = count - 1;
+
+  if (!started)
+  {
+    anchor_index = window_index = newest;
+    anchor_us    = window_us    = now_us;
+    started      = true;
+    return;
+  }
+
+  // the newest sample is before the read, a sample after it is a late read
+  predicted = time(newest);
+  late      = (int32_t)(now_us - predicted);
+  anchor_index = newest;
+  anchor_us    = predicted + ((late < 0) ? late : late / SAMPLE_CLOCK_LEAK);
+
+  if (now_us - window_us >= SAMPLE_CLOCK_WINDOW_US)
+  {
+    float measured = (float)(now_us - window_us) / (newest - window_index);
+
+    // the first window replaces the nominal period, the next ones average
+    period_us   += (measured - period_us) / (period_measured ? 4 : 1);
+    period_measured = true;
+    window_index = newest;
+    window_us    = now_us;
+  }
+}
+
+uint32_t SampleClock::time(uint32_t index)
+{
+  return anchor_us + (int32_t)((int32_t)(index - anchor_index) * period_us);
+}
+
+/*---------------------------------------------------------------------------------
+ called with each QRS detector input sample, t_us corrected by the detector delay
+---------------------------------------------------------------------------------*/
+void patEcgSample(int16_t x, uint32_t t_us, bool qrs)
+{
+  ecg_x[ecg_head & (PAT_ECG_HISTORY - 1)] = x;
+  ecg_t[ecg_head & (PAT_ECG_HISTORY - 1)] = t_us;
+  ecg_head++;
+
+  if (qrs)
+    r_countdown = PAT_R_SEARCH_AFTER;
+  if ((r_countdown == 0) || (--r_countdown != 0))
+    return;
+
+  // the maximum, not at the edges of the search
+  uint32_t  peak = ecg_head - 1;
+  for (uint32_t i = ecg_head - PAT_R_SEARCH; i != ecg_head; i++)
+    if (ecg_x[i & (PAT_ECG_HISTORY - 1)] > ecg_x[peak & (PAT_ECG_HISTORY - 1)])
+      peak = i;
+  if ((peak == ecg_head - 1) || (peak == ecg_head - PAT_R_SEARCH))
+    return;
+
+  int32_t y0 = ecg_x[(peak - 1) & (PAT_ECG_HISTORY - 1)];
+  int32_t y1 = ecg_x[ peak      & (PAT_ECG_HISTORY - 1)];
+  int32_t y2 = ecg_x[(peak + 1) & (PAT_ECG_HISTORY - 1)];
+  int32_t d  = y0 - 2 * y1 + y2;
+  float   offset = (d != 0) ? 0.5f * (y0 - y2) / d : 0;
+  int32_t period = ecg_t[(peak + 1) & (PAT_ECG_HISTORY - 1)] - ecg_t[peak & (PAT_ECG_HISTORY - 1)];
+
+  r_ring[r_head++ & (PAT_R_RING_SIZE - 1)] = ecg_t[peak & (PAT_ECG_HISTORY - 1)] + (int32_t)(offset * period);
+}
+
+void patEcgRestart(void)
+{
+  r_head      = 0;
+  r_countdown = 0;
+}
+
+/*---------------------------------------------------------------------------------
+ one PPG foot, paired with its R wave
+---------------------------------------------------------------------------------*/
+static uint32_t median(void)
+{
+  uint32_t sorted[PAT_MEDIAN_SIZE];
+
+  for (int i = 0; i < pat_count; i++)
+  {
+    int k;
+    for (k = i; (k > 0) && (sorted[k-1] > pat_recent[i]); k--)
+      sorted[k] = sorted[k-1];
+    sorted[k] = pat_recent[i];
+  }
+  return sorted[pat_count / 2];
+}
+
+static void addFoot(uint32_t foot_us)
+{
+  uint32_t  pat_us = 0;
+  bool      accept;
+
+  // the last R wave in the window before the foot
+  for (uint32_t i = r_head; (i != 0) && (r_head - i < PAT_R_RING_SIZE); i--)
+  {
+    int32_t dt = (int32_t)(foot_us - r_ring[(i - 1) & (PAT_R_RING_SIZE - 1)]);
+
+    if ((dt >= PAT_MIN_US) && (dt <= PAT_MAX_US))
+    {
+      pat_us = dt;
+      break;
+    }
+    if (dt > PAT_MAX_US)
+      break;                            // older ones are further
+  }
+  if (pat_us == 0)
+    return;                             // no ECG for this beat
+
+  accept = (pat_count < 3) || (abs((int32_t)(pat_us - median())) <= PAT_OUTLIER_US);
+  pat_accepted = (pat_accepted << 1) | accept;
+  if (!accept)
+  {
+    if (++pat_rejected < PAT_RESTART)
+      return;
+    pat_count    = 0;                   // the PAT has moved, follow it
+    pat_trend_us = 0;
+  }
+  pat_rejected = 0;
+
+  if (pat_count == PAT_MEDIAN_SIZE)
+    memmove(pat_recent, pat_recent + 1, sizeof(pat_recent) - sizeof(pat_recent[0]));
+  else
+    pat_count++;
+  pat_recent[pat_count - 1] = pat_us;
+
+  if (pat_trend_us == 0)
+    pat_trend_us = pat_us;
+  else
+    pat_trend_us += PAT_TREND_A * (pat_us - pat_trend_us);
+  pat_last_us = pat_us;
+
+  uint16_t pat_ms   = (pat_us + 500) / 1000;
+  uint16_t trend    = (uint16_t)(pat_trend_us / 100 + 0.5f);      // 0.1ms
+  pat_pack[0] = pat_ms;
+  pat_pack[1] = pat_ms >> 8;
+  pat_pack[2] = trend;
+  pat_pack[3] = trend >> 8;
+  pat_pack[4] = __builtin_popcount(pat_accepted) * 100 / 16;      // % of the last 16 beats
+  patReady = true;
+}
+
+/*---------------------------------------------------------------------------------
+ called from loop(), PPG feet
+---------------------------------------------------------------------------------*/
+void handlePat(void)
+{
+  static uint32_t next = 0;
+  PpgBeat   beat;
+
+  if (ppgBeatCount() - next > PPG_BEAT_RING_SIZE)
+    next = ppgBeatCount() - PPG_BEAT_RING_SIZE;
+  while (next < ppgBeatCount())
+    if (ppgGetBeat(next++, &beat))
+      addFoot(beat.foot_us);
+}
+
+void printPat(void)
+{
+  Serial.printf("PAT %.1f ms, trend %.1f ms, %u%% of the beats accepted\r\n",
+                pat_last_us / 1000.0, pat_trend_us / 1000.0, pat_pack[4]);
+}
@@ -0,0 +1,160 @@
+/*---------------------------------------------------------------------------------
+  PPG beat by beat - pulse rate at the beat, not once per SpO2 window
+
+  Each IR sample goes through checkForBeat() (Maxim PBA, spo2_max3010x_heartRate.cpp),
+  turned over first so the pulse goes up (blood volume), the same as the BLE stream.
+    foot        the pulse onset, the tangent at the rising crossing down to the
+                minimum of the negative cycle (the minimum itself is early, the DC
+                estimator pulls it forward)
+    beat        the rising zero crossing, the inter-beat interval is taken here
+    peak        the maximum of the positive cycle, found at the falling crossing
+  The times are corrected by the FIR delay and interpolated between the samples
+  (the peak with the parabola through the 3 samples around it), so they can be
+  compared with the ECG R peaks (pulse arrival time).
+
+  The last PPG_BEAT_RING_SIZE beats are kept, read them by index like the
+  accelerometer samples:
+
+    static uint32_t next = 0;
+    PpgBeat b;
+    while (next < ppgBeatCount())
+      if (ppgGetBeat(next++, &b)) ...
+
+  A beat updates ppg_heart_rate (average of the last 4 beats) while the PPG signal
+  quality passes, calculate_spo2() only sets it when no beat is tracked.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define PPG_SAMPLE_US         (1000000 / PBA_SAMPLE_RATE)
+#define PPG_ADC_MAX           0x3FFFF   // 18 bits
+#define PPG_IBI_MIN_MS        300       // 200 bpm
+#define PPG_IBI_MAX_MS        2000      // 30 bpm
+#define PPG_BEAT_TIMEOUT_US   (PPG_IBI_MAX_MS * 1000UL)
+#define PPG_RATE_AVERAGE      4         // beats
+#define PPG_HISTORY_SIZE      32        // filtered samples, power of 2
+
+uint8_t           ppg_beat_rate = 0;
+
+static PpgBeat    beat_ring[PPG_BEAT_RING_SIZE];
+static uint32_t   beat_head     = 0;
+static uint32_t   crossing_us   = 0;    // rising zero crossing of the last beat
+static bool       crossing_valid = false;
+static uint8_t    rates[PPG_RATE_AVERAGE];
+static uint8_t    rate_index    = 0;
+static uint8_t    rate_count    = 0;
+static int16_t    history[PPG_HISTORY_SIZE];    // PBA filter output
+static uint32_t   history_head  = 0;
+
+/*---------------------------------------------------------------------------------
+ time of the extreme "age" samples ago, in samples, with the parabola vertex
+---------------------------------------------------------------------------------*/
+static float extremeAge(uint16_t age)
+{
+  int32_t y0, y1, y2, d;
+
+  if ((age == 0) || (age + 2 > PPG_HISTORY_SIZE))
+    return age;
+  y0 = history[(history_head - 2 - age) & (PPG_HISTORY_SIZE - 1)];  // before
+  y1 = history[(history_head - 1 - age) & (PPG_HISTORY_SIZE - 1)];
+  y2 = history[(history_head     - age) & (PPG_HISTORY_SIZE - 1)];  // after
+  d  = y0 - 2 * y1 + y2;
+  if (d == 0)
+    return age;
+  return age - 0.5f * (y0 - y2) / d;
+}
+
+/*---------------------------------------------------------------------------------
+ called with each IR sample, at PBA_SAMPLE_RATE
+---------------------------------------------------------------------------------*/
+void ppgBeatAdd(uint32_t ir, uint32_t timestamp_us)
+{
+  uint32_t  delayed_us;
+  uint32_t  ibi_ms;
+
+  if (ir > PPG_ADC_MAX)
+    ir = PPG_ADC_MAX;
+
+  // PBA works on 16 bits
+  bool beat = checkForBeat((PPG_ADC_MAX - ir) >> 2);
+
+  history[history_head++ & (PPG_HISTORY_SIZE - 1)] = IR_AC_Signal_Current;
+
+  if (beat)
+  {
+    // the crossing interpolated between the 2 samples, 40ms steps are 7 bpm at 110 bpm
+    delayed_us = timestamp_us - PBA_FIR_DELAY * PPG_SAMPLE_US -
+                 (int32_t)IR_AC_Signal_Current * PPG_SAMPLE_US / (IR_AC_Signal_Current - IR_AC_Signal_Previous);
+    ibi_ms     = (delayed_us - crossing_us) / 1000;
+
+    if (crossing_valid && (ibi_ms < PPG_IBI_MIN_MS))
+      return;                                   // a notch, not a beat
+
+    PpgBeat &b = beat_ring[beat_head & (PPG_BEAT_RING_SIZE - 1)];
+
+    // foot: the tangent at the crossing down to the level of the minimum
+    b.foot_us     = delayed_us - (int32_t)(-IR_AC_Signal_min) * PPG_SAMPLE_US / (IR_AC_Signal_Current - IR_AC_Signal_Previous);
+    b.peak_us     = 0;
+    if (crossing_valid && (ibi_ms <= PPG_IBI_MAX_MS))
+    {
+      b.ibi_ms      = ibi_ms;
+      b.heart_rate  = 60000 / ibi_ms;
+    }
+    else
+    {
+      b.ibi_ms      = 0;                        // first beat, or one was lost
+      b.heart_rate  = 0;
+    }
+    beat_head++;
+    crossing_us     = delayed_us;
+    crossing_valid  = true;
+
+    if (b.heart_rate != 0)
+    {
+      uint16_t sum = 0;
+
+      ppg_beat_rate = b.heart_rate;
+      rates[rate_index] = b.heart_rate;
+      rate_index = (rate_index + 1) % PPG_RATE_AVERAGE;
+      if (rate_count < PPG_RATE_AVERAGE)
+        rate_count++;
+      if (rate_count == PPG_RATE_AVERAGE)
+      {
+        for (int i = 0; i < PPG_RATE_AVERAGE; i++)
+          sum += rates[i];
+        if (ppg_sqi >= SQI_PASS)
+          ppg_heart_rate = sum / PPG_RATE_AVERAGE;
+      }
+    }
+    else
+    {
+      ppg_beat_rate = 0;
+      rate_count    = 0;
+    }
+  }
+  else if ((IR_AC_Signal_Previous > 0) && (IR_AC_Signal_Current <= 0) && (beat_head != 0))
+  {
+    // falling crossing, the peak of the last beat is known
+    PpgBeat &b = beat_ring[(beat_head - 1) & (PPG_BEAT_RING_SIZE - 1)];
+
+    if (b.peak_us == 0)
+      b.peak_us = timestamp_us - (uint32_t)((PBA_FIR_DELAY + extremeAge(IR_AC_Signal_max_age)) * PPG_SAMPLE_US);
+  }
+}
+
+bool ppgBeatTracking(void)
+{
+  return crossing_valid && ((micros() - crossing_us) < PPG_BEAT_TIMEOUT_US);
+}
+
+uint32_t ppgBeatCount(void)
+{
+  return beat_head;
+}
+
+bool ppgGetBeat(uint32_t index, PpgBeat *beat)
+{
+  if ((index >= beat_head) || (beat_head - index > PPG_BEAT_RING_SIZE))
+    return false;
+  *beat = beat_ring[index & (PPG_BEAT_RING_SIZE - 1)];
+  return true;
+}
@@ -0,0 +1,182 @@
+/*---------------------------------------------------------------------------------
+  Profile - time of each loop() stage, CPU and stack of the tasks
+
+  Each handler in loop() is wrapped by PROFILE(stage, call), which reads the CPU
+  cycle counter before and after it (a few cycles, no call to micros()). For each
+  stage it keeps
+    count, min, mean, max     since boot or "stats reset"
+    histogram                 log2 of the time in us, <2us, 2us, 4us .. >=32ms
+  handleProfile() at the end of loop() times the whole loop.
+
+  "stats" in CLI prints them, with the FreeRTOS tasks: CPU % since boot (when the
+  core is built with the run time stats) and the least stack left.
+
+  Every PROFILE_NOTIFY_MS the diagnostics characteristic gets, for each stage in
+  ProfileStage order, u16 mean us, u16 max us (little endian, 65535 at most) of
+  that period, then the overrun counters (overrun.cpp). 76 bytes, the app asks
+  for an MTU of 79 or more, like backfill.
+  A stage with a max over 8ms (an ADS1292R sample at 125 SPS) is the one which
+  makes the ECG miss its samples.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define PROFILE_BINS          16        // <2us .. >=32768us
+#define PROFILE_TASKS         24        // FreeRTOS tasks shown
+#define PROFILE_NOTIFY_MS     5000
+
+struct StageStats
+{
+  uint32_t  count;
+  uint32_t  min, max;                   // cycles
+  uint64_t  sum;
+  uint32_t  bins[PROFILE_BINS];
+  uint32_t  period_count, period_max;   // since the last notification
+  uint64_t  period_sum;
+};
+
+static const char *stage_names[PROF_STAGES] = {
+  "cli", "timer", "button", "ota", "ble", "ecg", "ppg", "temp",
+  "accel", "fall", "fusion", "pat", "recorder", "stream", "battery", "loop"};
+
+uint8_t   profile_pack[PROFILE_PACK_SIZE];
+bool      profileReady = false;
+
+static StageStats stats[PROF_STAGES];
+static uint32_t   cycles_per_us = 240;
+static uint32_t   loop_start    = 0;
+static uint32_t   notify_ms     = 0;
+
+static void resetStats(void)
+{
+  memset(stats, 0, sizeof(stats));
+  for (int i = 0; i < PROF_STAGES; i++)
+    stats[i].min = UINT32_MAX;
+}
+
+/*---------------------------------------------------------------------------------
+ PROFILE(), one call of a stage
+---------------------------------------------------------------------------------*/
+void profileAdd(ProfileStage stage, uint32_t cycles)
+{
+  StageStats &s = stats[stage];
+  uint32_t    us = cycles / cycles_per_us;
+  int         bin = (us < 2) ? 0 : 31 - __builtin_clz(us);
+
+  s.count++;
+  s.sum += cycles;
+  if (cycles < s.min) s.min = cycles;
+  if (cycles > s.max) s.max = cycles;
+  s.bins[min(bin, PROFILE_BINS - 1)]++;
+
+  s.period_count++;
+  s.period_sum += cycles;
+  if (cycles > s.period_max) s.period_max = cycles;
+}
+
+static void packPeriod(void)
+{
+  for (int i = 0; i < PROF_STAGES; i++)
+  {
+    StageStats &s = stats[i];
+    uint32_t mean = s.period_count ? s.period_sum / s.period_count / cycles_per_us : 0;
+    uint32_t max  = s.period_max / cycles_per_us;
+
+    mean = min(mean, (uint32_t)UINT16_MAX);
+    max  = min(max,  (uint32_t)UINT16_MAX);
+    profile_pack[i * 4 + 0] = mean;
+    profile_pack[i * 4 + 1] = mean >> 8;
+    profile_pack[i * 4 + 2] = max;
+    profile_pack[i * 4 + 3] = max >> 8;
+    s.period_count = 0;
+    s.period_sum   = 0;
+    s.period_max   = 0;
+  }
+  packOverrun(&profile_pack[PROF_STAGES * 4]);
+  profileReady = true;
+}
+
+/*---------------------------------------------------------------------------------
+ called at the end of loop()
+---------------------------------------------------------------------------------*/
+void handleProfile(void)
+{
+  uint32_t now = profileCycles();
+
+  if (loop_start != 0)
+    profileAdd(PROF_LOOP, now - loop_start);
+  loop_start = profileCycles();
+
+  if (millis() - notify_ms >= PROFILE_NOTIFY_MS)
+  {
+    notify_ms = millis();
+    packPeriod();
+  }
+}
+
+/*---------------------------------------------------------------------------------
+ CLI "stats [reset]"
+---------------------------------------------------------------------------------*/
+static void printTasks(void)
+{
+#if configUSE_TRACE_FACILITY
+  static TaskStatus_t tasks[PROFILE_TASKS];
+  uint32_t  total = 0;
+  int       n = uxTaskGetSystemState(tasks, PROFILE_TASKS, &total);
+
+  Serial.println("task             prio  stack left  cpu");
+  for (int i = 0; i < n; i++)
+  {
+    Serial.printf("%-16s %4u  %10u", tasks[i].pcTaskName, tasks[i].uxCurrentPriority,
+                  tasks[i].usStackHighWaterMark);
+#if configGENERATE_RUN_TIME_STATS
+    if (total / 100 > 0)
+      Serial.printf("  %3u%%", tasks[i].ulRunTimeCounter / (total / 100));
+#endif
+    Serial.println("");
+  }
+#else
+  Serial.println("tasks: not built with configUSE_TRACE_FACILITY");
+#endif
+}
+
+void printProfile(void)
+{
+  Serial.println("stage       count   min us  mean us   max us  histogram us:count");
+  for (int i = 0; i < PROF_STAGES; i++)
+  {
+    StageStats &s = stats[i];
+
+    if (s.count == 0)
+      continue;
+    Serial.printf("%-8s %8u %8u %8u %8u ", stage_names[i], s.count, s.min / cycles_per_us,
+                  (uint32_t)(s.sum / s.count / cycles_per_us), s.max / cycles_per_us);
+    for (int b = 0; b < PROFILE_BINS; b++)
+      if (s.bins[b])
+        Serial.printf(" %u:%u", b ? 1 << b : 0, s.bins[b]);
+    Serial.println("");
+  }
+  printTasks();
+}
+
+static int cmdStats(void)
+{
+  if (strcmp(cliArg(1), "reset") == 0)
+    resetStats();
+  else
+  {
+    printProfile();
+    printOverrun();                     // samples lost, overrun.cpp
+  }
+  return 0;
+}
+
+void initProfile(void)
+{
+#ifdef HOST_BUILD
+  cycles_per_us = 1;                    // profileCycles() is micros()
+#else
+  cycles_per_us = getCpuFrequencyMhz();
+#endif
+  resetStats();
+  cliAddCommand("stats", cmdStats, "stats [reset], time of the loop() stages, tasks CPU and stack");
+}
@@ -0,0 +1,534 @@
+/*---------------------------------------------------------------------------------
+  Flash recorder - ECG, PPG and vitals while BLE is not connected
+
+  Without a BLE connection the samples are not queued for BLE, they are recorded
+  in the "recorder" partition (partitions.csv) instead, so a dropout can be sent
+  later (backfill).
+
+  The partition is a log of blocks, one block per flash page:
+    header      stream, samples, bytes, seq, time of the first sample, span, the
+                erase count of the sector (wear), CRC-16
+    ECG, PPG    the difference to the previous sample, zigzag, 7 bits per byte
+                (a QRS takes 2 bytes, the rest mostly 1), ~170 samples a block
+    vitals      VITALS_PACK_SIZE bytes each REC_VITALS_MS, see packVitals()
+  seq counts the blocks since the partition was blank, the block "seq" is always
+  in page seq % pages, so a block is found without a table. The log is a ring,
+  the oldest sector is erased when it is needed, every sector is erased once a
+  lap (wear leveling), and after a reset the log goes on from the newest block,
+  not from the first sector.
+
+  loop() side: recorderSample() packs the samples in RAM, a full block is put in
+  the queue (REC_QUEUE_SIZE pages), nothing waits for the flash.
+  "recorder" task: writes the queued pages in a batch. Both cores stall for tens
+  of ms in a sector erase (flash_partition.cpp), several ECG samples, so the
+  sectors are erased ahead while not recording (BLE connected), one each
+  REC_ERASE_AHEAD_MS, up to a quarter of the ring (REC_ERASED_AHEAD): a dropout
+  of ~5 minutes is recorded with page writes only. A backfill holds the erase
+  ahead (recorderHold()), it reads the oldest blocks. Only a longer dropout
+  erases while recording, one sector at a time when it is needed; those erases
+  are counted ("erase stalls"), the ECG samples they cost in the overrun counters.
+  A block lost in a power cut fails its CRC and is skipped.
+
+  Time: recorder time in ms, millis() + the end of the log at power up, so it
+  does not go back after a reset. The time of the first block of each sector is
+  kept in RAM, recorderFind() is a binary search on them, then a scan of the
+  block headers. A block is placed when it is sealed, not when it starts, so a
+  long one (vitals) ends after blocks of the next sectors start: the search is
+  for REC_SPAN_MAX_MS before the time, a block which ends later can not be in a
+  sector before that.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define REC_PARTITION         "recorder"
+#define REC_MAGIC             0xA5
+#define REC_PAGES_PER_SECTOR  (FLASH_SECTOR_SIZE / REC_BLOCK_SIZE)
+#define REC_MAX_SECTORS       256       // 1MB, a larger partition is not all used
+#define REC_QUEUE_SIZE        8         // blocks, power of 2
+#define REC_VARINT_MAX        3         // bytes, a 16 bits difference
+#define REC_VITALS_MS         1000
+#define REC_WHILE_CONNECTED   false     // true: record also with BLE connected
+#define REC_TASK_STACK        3072
+#define REC_TASK_PRIORITY     1
+#define REC_TASK_CORE         0
+#define REC_TASK_IDLE_MS      20
+#define REC_NO_TIME           0xFFFFFFFF
+#define REC_SPAN_MAX_MS       0xFFFF    // span_ms is 16 bits
+#define REC_ERASED_AHEAD      16        // sectors kept erased, at most a quarter of the ring
+#define REC_ERASE_AHEAD_MS    1000      // between two erases ahead
+
+extern uint8_t          battery_percent;
+extern int16_t          body_temp_times10;
+extern volatile uint8_t respirationRate;
+
+static FlashPartition flash(REC_PARTITION);
+static bool       mounted       = false;
+static volatile bool recording  = false;
+static volatile bool held       = false;   // no erase ahead, recorderHold()
+static uint32_t   sectors       = 0;
+static uint32_t   pages         = 0;
+static uint32_t   time_base     = 0;    // recorder time - millis()
+
+// written by the recorder task
+static volatile uint32_t next_seq      = 0;   // the next block written
+static volatile uint32_t erased_seq    = 0;   // the pages before it are written or erased
+static uint16_t   wear       [REC_MAX_SECTORS];
+static uint32_t   sector_time[REC_MAX_SECTORS];  // first block, REC_NO_TIME = none
+
+// queue, loop() puts, the recorder task gets
+static RecBlock   queue[REC_QUEUE_SIZE];
+static volatile uint32_t queue_head    = 0;
+static volatile uint32_t queue_tail    = 0;
+
+static RecBlock   open_block[REC_STREAMS];
+static int16_t    open_last [REC_STREAMS];     // previous sample
+static uint32_t   open_end  [REC_STREAMS];     // time of the last sample
+
+static uint32_t   rec_written = 0, rec_dropped = 0, rec_errors = 0, rec_erases = 0;
+static uint32_t   rec_stalls  = 0, rec_stall_max_us = 0;    // erases while recording
+
+/*---------------------------------------------------------------------------------
+ block header and position
+---------------------------------------------------------------------------------*/
+uint16_t crc16(const uint8_t *data, uint32_t length)
+{
+  uint16_t crc = 0xFFFF;                // CRC-16/CCITT-FALSE
+
+  while (length--)
+  {
+    crc ^= (uint16_t)*data++ << 8;
+    for (int i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static uint16_t blockCrc(RecBlock *block)
+{
+  uint16_t saved = block->crc, crc;
+
+  block->crc = 0;
+  crc = crc16((const uint8_t *)block, REC_HEADER_SIZE + block->length);
+  block->crc = saved;
+  return crc;
+}
+
+static uint32_t pageOffset(uint32_t seq)
+{
+  return (seq % pages) * REC_BLOCK_SIZE;
+}
+
+static uint32_t sectorOf(uint32_t seq)
+{
+  return (seq / REC_PAGES_PER_SECTOR) % sectors;
+}
+
+static bool erasedHeader(const RecBlock *block)
+{
+  const uint8_t *p = (const uint8_t *)block;
+
+  for (int i = 0; i < REC_HEADER_SIZE; i++)
+    if (p[i] != 0xFF)
+      return false;
+  return true;
+}
+
+// the header only, seq is not checked
+static bool readHeader(uint32_t page, RecBlock *block)
+{
+  if (!flash.read(page * REC_BLOCK_SIZE, block, REC_HEADER_SIZE))
+    return false;
+  return (block->magic == REC_MAGIC) && (block->length <= REC_DATA_SIZE) &&
+         (block->stream < REC_STREAMS);
+}
+
+/*---------------------------------------------------------------------------------
+ find the end of the log after a reset
+---------------------------------------------------------------------------------*/
+static void mount(void)
+{
+  RecBlock  block;
+  uint32_t  start, head_start = 0;
+  bool      found = false;
+  int       last  = -1;
+
+  for (uint32_t s = 0; s < sectors; s++)
+  {
+    sector_time[s] = REC_NO_TIME;
+    wear[s]        = 0;
+
+    // the first readable block of the sector gives its lap and wear
+    for (uint32_t p = 0; p < REC_PAGES_PER_SECTOR; p++)
+      if (readHeader(s * REC_PAGES_PER_SECTOR + p, &block) &&
+          (block.seq % pages == s * REC_PAGES_PER_SECTOR + p))
+      {
+        start          = block.seq - p;
+        wear[s]        = block.wear;
+        sector_time[s] = block.time_ms;
+        if (!found || ((int32_t)(start - head_start) > 0))
+          head_start = start;
+        found = true;
+        break;
+      }
+  }
+
+  if (!found)
+  {
+    next_seq   = 0;                     // blank
+    erased_seq = 0;
+    time_base  = 0;
+    return;
+  }
+
+  // the last page written in the newest sector, a torn one included, and the
+  // latest end of its blocks (the streams are sealed out of time order)
+  time_base = sector_time[sectorOf(head_start)];
+  for (int p = 0; p < REC_PAGES_PER_SECTOR; p++)
+  {
+    if (!flash.read(pageOffset(head_start + p), &block, REC_HEADER_SIZE))
+      break;
+    if (!erasedHeader(&block))
+      last = p;
+    if ((block.magic == REC_MAGIC) && (block.seq == head_start + p) &&
+        ((int32_t)(block.time_ms + block.span_ms + 1 - time_base) > 0))
+      time_base = block.time_ms + block.span_ms + 1;
+  }
+  next_seq   = head_start + last + 1;
+  erased_seq = head_start + REC_PAGES_PER_SECTOR;
+  time_base -= millis();
+
+  // the sectors erased ahead, after the newest one
+  for (uint32_t k = 1; k < sectors; k++, erased_seq += REC_PAGES_PER_SECTOR)
+  {
+    uint32_t  first = sectorOf(head_start + k * REC_PAGES_PER_SECTOR) * REC_PAGES_PER_SECTOR;
+    uint32_t  p     = 0;
+
+    for (; p < REC_PAGES_PER_SECTOR; p++)
+      if (!flash.read((first + p) * REC_BLOCK_SIZE, &block, REC_HEADER_SIZE) || !erasedHeader(&block))
+        break;
+    if (p < REC_PAGES_PER_SECTOR)
+      break;
+  }
+
+  // an erased sector has lost its count, about the same as the newest one
+  for (uint32_t s = 0; s < sectors; s++)
+    if (sector_time[s] == REC_NO_TIME)
+      wear[s] = wear[sectorOf(head_start)];
+}
+
+/*---------------------------------------------------------------------------------
+ recorder task: an erase ahead, or the queued blocks in a batch
+---------------------------------------------------------------------------------*/
+bool recorderService(void)
+{
+  static uint32_t erase_ms = 0;
+  uint32_t  ahead = min((uint32_t)REC_ERASED_AHEAD, sectors / 4) * REC_PAGES_PER_SECTOR;
+  bool      busy  = false;
+
+  if (!mounted)
+    return false;
+
+  // the next page to write must be erased, while recording only that one
+  if ((erased_seq <= next_seq) ||
+      (!recording && !held && (erased_seq < next_seq + ahead) && (millis() - erase_ms >= REC_ERASE_AHEAD_MS)))
+  {
+    uint32_t  s     = sectorOf(erased_seq);
+    bool      stall = recording;
+    uint32_t  us    = micros();
+
+    erased_seq    += REC_PAGES_PER_SECTOR;     // not readable from now on
+    sector_time[s] = REC_NO_TIME;
+    if (flash.erase(s * FLASH_SECTOR_SIZE))
+      rec_erases++;
+    else
+      rec_errors++;
+    wear[s]++;
+    erase_ms = millis();
+    if (stall)
+    {
+      rec_stalls++;
+      rec_stall_max_us = max(rec_stall_max_us, (uint32_t)(micros() - us));
+    }
+    return true;
+  }
+
+  while ((queue_tail != queue_head) && (next_seq < erased_seq))
+  {
+    RecBlock *block = &queue[queue_tail & (REC_QUEUE_SIZE - 1)];
+    uint32_t  s     = sectorOf(next_seq);
+
+    block->seq  = next_seq;
+    block->wear = wear[s];
+    block->crc  = blockCrc(block);
+    if (flash.write(pageOffset(next_seq), block, REC_BLOCK_SIZE))
+    {
+      if (next_seq % REC_PAGES_PER_SECTOR == 0)
+        sector_time[s] = block->time_ms;
+      rec_written++;
+    }
+    else
+      rec_errors++;                     // the page is skipped
+    next_seq++;
+    queue_tail++;
+    busy = true;
+  }
+  return busy;
+}
+
+#ifndef HOST_BUILD
+static void recorderTask(void *parameter)
+{
+  for (;;)
+    if (!recorderService())
+      vTaskDelay(pdMS_TO_TICKS(REC_TASK_IDLE_MS));
+}
+#endif
+
+/*---------------------------------------------------------------------------------
+ loop() side, the blocks in RAM
+---------------------------------------------------------------------------------*/
+uint32_t recorderNow(void)
+{
+  return millis() + time_base;
+}
+
+static void seal(RecStream stream)
+{
+  RecBlock *block = &open_block[stream];
+
+  if (block->samples == 0)
+    return;
+  block->span_ms = open_end[stream] - block->time_ms;
+
+  if (queue_head - queue_tail >= REC_QUEUE_SIZE)
+    rec_dropped++;                      // the flash is too slow, or failed
+  else
+  {
+    memcpy(&queue[queue_head & (REC_QUEUE_SIZE - 1)], block, REC_HEADER_SIZE + block->length);
+    queue_head++;
+  }
+  block->samples = 0;
+  block->length  = 0;
+}
+
+static RecBlock *openBlock(RecStream stream, uint8_t need)
+{
+  RecBlock *block = &open_block[stream];
+
+  if ((block->length + need > REC_DATA_SIZE) || (block->samples == 255))
+    seal(stream);
+  if (block->samples == 0)
+  {
+    block->magic    = REC_MAGIC;
+    block->stream   = stream;
+    block->time_ms  = recorderNow();
+    block->reserved = 0xFFFF;
+    open_last[stream] = 0;
+  }
+  open_end[stream] = recorderNow();
+  return block;
+}
+
+void recorderSample(RecStream stream, int16_t x)
+{
+  RecBlock *block;
+  uint32_t  zigzag;
+  int32_t   diff;
+
+  if (!recording)
+    return;
+
+  block  = openBlock(stream, REC_VARINT_MAX);
+  diff   = (int32_t)x - open_last[stream];
+  zigzag = (diff < 0) ? ((uint32_t)(-diff) << 1) - 1 : (uint32_t)diff << 1;
+  open_last[stream] = x;
+
+  while (zigzag >= 0x80)
+  {
+    block->data[block->length++] = (zigzag & 0x7F) | 0x80;
+    zigzag >>= 7;
+  }
+  block->data[block->length++] = zigzag;
+  block->samples++;
+}
+
+// hr fused, ecg, ppg, spo2, respiration, battery, temperature x10 (16 bits)
+void packVitals(uint8_t *p)
+{
+  p[0] = hr_fused;
+  p[1] = ecg_heart_rate;
+  p[2] = ppg_heart_rate;
+  p[3] = spo2_percent;
+  p[4] = respirationRate;
+  p[5] = battery_percent;
+  p[6] = body_temp_times10;
+  p[7] = body_temp_times10 >> 8;
+}
+
+static void addVitals(void)
+{
+  RecBlock *block = openBlock(REC_VITALS, VITALS_PACK_SIZE);
+
+  packVitals(&block->data[block->length]);
+  block->length += VITALS_PACK_SIZE;
+  block->samples++;
+}
+
+/*---------------------------------------------------------------------------------
+ samples of an ECG or PPG block, return the count
+---------------------------------------------------------------------------------*/
+int recorderDecode(const RecBlock *block, int16_t *x, int max)
+{
+  uint32_t  zigzag = 0;
+  int       shift = 0, n = 0;
+  int16_t   last = 0;
+
+  if (block->stream == REC_VITALS)
+    return 0;
+  for (int i = 0; (i < block->length) && (n < max); i++)
+  {
+    zigzag |= (uint32_t)(block->data[i] & 0x7F) << shift;
+    shift  += 7;
+    if (block->data[i] & 0x80)
+      continue;
+    last  += (zigzag & 1) ? -(int32_t)((zigzag + 1) >> 1) : (int32_t)(zigzag >> 1);
+    x[n++] = last;
+    zigzag = 0;
+    shift  = 0;
+  }
+  return n;
+}
+
+/*---------------------------------------------------------------------------------
+ reading, seq from recorderOldest() to recorderNewest()
+---------------------------------------------------------------------------------*/
+uint32_t recorderOldest(void)
+{
+  uint32_t erased_end = erased_seq;     // the pages from next_seq to it are erased
+
+  if (!mounted || (erased_end <= pages))
+    return 0;
+  return erased_end - pages;
+}
+
+uint32_t recorderNewest(void)
+{
+  return next_seq;                      // exclusive
+}
+
+// false if the block was lost or is overwritten
+bool recorderRead(uint32_t seq, RecBlock *block)
+{
+  if (!mounted || (seq < recorderOldest()) || (seq >= next_seq))
+    return false;
+  if (!flash.read(pageOffset(seq), block, REC_BLOCK_SIZE))
+    return false;
+  return (block->magic == REC_MAGIC) && (block->seq == seq) &&
+         (block->length <= REC_DATA_SIZE) && (block->crc == blockCrc(block));
+}
+
+// the first block which ends at time_ms or later, recorderNewest() if none
+uint32_t recorderFind(uint32_t time_ms)
+{
+  RecBlock  block;
+  uint32_t  lo, hi, seq;
+
+  if (!mounted || (next_seq == 0))
+    return next_seq;
+
+  // sectors in log order, the last one starting REC_SPAN_MAX_MS before time_ms
+  // or earlier: the blocks of the sectors before it are sealed, so they end,
+  // before the first block of it ends
+  lo = recorderOldest() / REC_PAGES_PER_SECTOR;
+  hi = (next_seq - 1) / REC_PAGES_PER_SECTOR;
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi + 1) / 2;
+    uint32_t t   = sector_time[mid % sectors];
+
+    if ((t == REC_NO_TIME) || ((int32_t)(t - (time_ms - REC_SPAN_MAX_MS)) <= 0))
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  seq = max(lo * REC_PAGES_PER_SECTOR, recorderOldest());
+  for (; seq < next_seq; seq++)
+    if (readHeader(seq % pages, &block) && (block.seq == seq) &&
+        ((int32_t)(block.time_ms + block.span_ms - time_ms) >= 0))
+      break;
+  return seq;
+}
+
+/*---------------------------------------------------------------------------------
+ called from setup() and loop()
+---------------------------------------------------------------------------------*/
+void initRecorder(void)
+{
+  if (!RECORDER_FEATURE || !flash.begin())
+    return;
+
+  sectors = min(flash.size() / FLASH_SECTOR_SIZE, (uint32_t)REC_MAX_SECTORS);
+  pages   = sectors * REC_PAGES_PER_SECTOR;
+  if (sectors < 3)
+  {
+    Serial.println("!! recorder partition too small");
+    return;
+  }
+  mount();
+  mounted = true;
+  Serial.printf("Recorder: %u KB, blocks %u..%u\r\n", sectors * FLASH_SECTOR_SIZE / 1024,
+                recorderOldest(), recorderNewest());
+
+#ifndef HOST_BUILD
+  xTaskCreatePinnedToCore(recorderTask, "recorder", REC_TASK_STACK, NULL,
+                          REC_TASK_PRIORITY, NULL, REC_TASK_CORE);
+#endif
+}
+
+// a backfill reads the oldest blocks, they are not erased ahead meanwhile
+void recorderHold(bool hold)
+{
+  held = hold;
+}
+
+void handleRecorder(void)
+{
+  static uint32_t vitals_ms = 0;
+  bool      record = mounted && (REC_WHILE_CONNECTED || !bleDeviceConnected);
+
+  if (record != recording)
+  {
+    // the partial blocks go to flash, a backfill after a connect gets them
+    for (int i = 0; i < REC_STREAMS; i++)
+      seal((RecStream)i);
+    recording = record;
+  }
+
+  if (recording && (millis() - vitals_ms >= REC_VITALS_MS))
+  {
+    vitals_ms = millis();
+    addVitals();
+  }
+}
+
+void printRecorder(void)
+{
+  uint16_t  wear_min = 0xFFFF, wear_max = 0;
+
+  if (!mounted)
+  {
+    Serial.println("recorder off");
+    return;
+  }
+  for (uint32_t s = 0; s < sectors; s++)
+  {
+    wear_min = min(wear_min, wear[s]);
+    wear_max = max(wear_max, wear[s]);
+  }
+  Serial.printf("recorder %s, blocks %u..%u of %u, time %u ms\r\n",
+                recording ? "recording" : "idle", recorderOldest(), recorderNewest(), pages, recorderNow());
+  Serial.printf("written %u, dropped %u, errors %u, erases %u, wear %u..%u\r\n",
+                rec_written, rec_dropped, rec_errors, rec_erases, wear_min, wear_max);
+  Serial.printf("erased ahead %u blocks, erase stalls %u (max %u us)\r\n",
+                erased_seq - next_seq, rec_stalls, rec_stall_max_us);
+}
@@ -0,0 +1,99 @@
+/*---------------------------------------------------------------------------------
+  Resampler - a sensor stream onto a common timebase, from the sample timestamps
+
+  ECG is 125 SPS, MAX3010x 25 SPS, AFE4490 25 SPS after its decimator, each with
+  its own clock. A Resampler takes the samples with their micros() and gives
+  samples at every multiple of the output period, so 2 streams resampled to the
+  same period have the same timestamps and can be put side by side (BLE framer,
+  fusion).
+
+  Farrow structure, cubic Lagrange through the 4 samples around the output time:
+    y(mu) = ((c3 * mu + c2) * mu + c1) * mu + x1       0 <= mu < 1, from x1 to x2
+    6 c1 = -2 x0 - 3 x1 + 6 x2 - x3
+    6 c2 =  3 x0 - 6 x1 + 3 x2
+    6 c3 =   -x0 + 3 x1 - 3 x2 + x3
+  The coefficients change once per input sample, each output costs 3 multiplies,
+  mu is Q15 from the input interval (its reciprocal is taken once per input, no
+  division per output), so the input spacing may drift and jitter.
+
+  The output is 2 input samples behind (x3 is needed). There is no anti-alias
+  filter, downsample only a stream that is already band limited (the FIR outputs,
+  not the 500 SPS AFE4490 samples). A gap longer than max_gap_us restarts it.
+
+    Resampler ppgAligned(8000, 100000);   // 125 SPS out, restart after 100ms
+
+    ppgAligned.put(sample, timestamp);
+    while (ppgAligned.get(&y, &t)) ...
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+Resampler::Resampler(uint32_t out_period_us, uint32_t max_gap_us)
+  : period_us(out_period_us), max_gap_us(max_gap_us)
+{
+  restart();
+}
+
+void Resampler::restart(void)
+{
+  count = 0;
+  first = true;
+}
+
+void Resampler::put(int16_t x, uint32_t t_us)
+{
+  if ((count != 0) && ((uint32_t)(t_us - t[3]) > max_gap_us))
+    count = 0;                                // a gap, start again
+
+  for (int i = 0; i < 3; i++)
+  {
+    this->x[i] = this->x[i+1];
+    t[i] = t[i+1];
+  }
+  this->x[3] = x;
+  t[3] = t_us;
+  if (count < 4)
+    count++;
+  if (count < 4)
+    return;
+
+  // the segment x1..x2, its coefficients x6 and its reciprocal length
+  int32_t x0 = this->x[0], x1 = this->x[1], x2 = this->x[2], x3 = this->x[3];
+  uint32_t interval = t[2] - t[1];
+
+  c1 = -2 * x0 - 3 * x1 + 6 * x2 - x3;
+  c2 =  3 * x0 - 6 * x1 + 3 * x2;
+  c3 =     -x0 + 3 * x1 - 3 * x2 + x3;
+  inverse = (interval != 0) ? (1UL << 31) / interval : 0;
+
+  if (first)
+  {
+    // the first output at the first multiple of the period in the segment
+    next_us = (t[1] / period_us + 1) * period_us;
+    first   = false;
+  }
+  else if ((int32_t)(next_us - t[1]) < 0)
+    next_us = (t[1] / period_us + 1) * period_us;  // after a gap
+}
+
+bool Resampler::get(int16_t *y, uint32_t *t_us)
+{
+  int64_t acc;
+  int32_t mu;
+
+  if ((count < 4) || (inverse == 0))
+    return false;
+  if ((int32_t)(next_us - t[2]) >= 0)
+    return false;                             // not in the segment yet
+
+  mu  = ((next_us - t[1]) * inverse) >> 16;   // Q15
+  acc = ((int64_t)c3 * mu) >> 15;
+  acc = ((acc + c2) * mu) >> 15;
+  acc = ((acc + c1) * mu) >> 15;
+  acc = acc + 6 * x[1];
+
+  acc = (acc >= 0) ? (acc + 3) / 6 : (acc - 3) / 6;
+  *y    = (int16_t)constrain(acc, (int64_t)INT16_MIN, (int64_t)INT16_MAX);
+  *t_us = next_us;
+  next_us += period_us;
+  return true;
+}
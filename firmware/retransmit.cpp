@@ -0,0 +1,161 @@
+/*---------------------------------------------------------------------------------
+  Retransmit window - the last ECG and PPG stream packets, resent on a NACK
+
+  Each stream packet ends with its serial number. handleBLE() keeps a copy of the
+  last RETX_PACKETS packets of each stream (about 5s of ECG, 12s of PPG), the app
+  writes the missing ones to the NACK characteristic, 4 bytes per range:
+    u8 stream (0 ECG, 1 PPG), u16 first serial, u8 count
+  and they are sent again on their stream characteristic, the same bytes with the
+  same serial, so the app puts them in their place. A packet already out of the
+  window is counted as expired, the app should not wait for it.
+
+  Notifications are not acknowledged, the NACKs give an almost lossless stream
+  without an indication (a round trip) for every packet.
+
+  The packets go out after the live data of each handleBLE(), one a pass and
+  RETX_PACE_US apart: loop() never waits for a resend, a NACK of a long range
+  must not cost ECG samples (the ADS1292R keeps only one).
+
+  Counters (u32 each, little endian) in retransmit_pack, notified on the NACK
+  characteristic after each NACK is done and shown by "ble" in CLI:
+    NACK ranges, packets asked, packets resent, packets expired
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define RETX_NACK_QUEUE       16        // ranges, power of 2
+#define RETX_NACK_SIZE        4         // bytes of a range in the NACK write
+#define RETX_PACE_US          3000      // between two resends, as the delay(3) of handleBLE()
+
+struct NackRange
+{
+  uint8_t   stream;
+  uint16_t  first;
+  uint8_t   count;
+};
+
+uint8_t   retransmit_pack[RETX_PACK_SIZE];
+bool      retransmitReady = false;
+
+static PacketRing sent[BLE_STREAMS];
+
+// written by the BLE task, read by loop()
+static NackRange  nack_queue[RETX_NACK_QUEUE];
+static volatile uint32_t nack_head = 0;
+static volatile uint32_t nack_tail = 0;
+
+static NackRange  current;              // the range being resent
+static bool       current_valid = false;
+static uint32_t   sent_us       = 0;    // the last resend
+
+static uint32_t   retx_ranges = 0, retx_asked = 0, retx_resent = 0, retx_expired = 0;
+static uint32_t   retx_overflow = 0;
+
+/*---------------------------------------------------------------------------------
+ the last packets of a stream, by serial number
+---------------------------------------------------------------------------------*/
+void PacketRing :: put(uint16_t serial, const uint8_t *packet, uint8_t size)
+{
+  uint16_t i = serial & (RETX_PACKETS - 1);
+
+  size = min(size, (uint8_t)RETX_PACKET_MAX);
+  memcpy(data[i], packet, size);
+  length [i] = size;
+  serials[i] = serial;
+}
+
+bool PacketRing :: get(uint16_t serial, uint8_t *packet, uint8_t *size)
+{
+  uint16_t i = serial & (RETX_PACKETS - 1);
+
+  if ((length[i] == 0) || (serials[i] != serial))
+    return false;                       // not sent yet, or overwritten
+  memcpy(packet, data[i], length[i]);
+  *size = length[i];
+  return true;
+}
+
+/*---------------------------------------------------------------------------------
+ handleBLE(), a packet was notified
+---------------------------------------------------------------------------------*/
+void retransmitSent(BleStream stream, uint16_t serial, const uint8_t *packet, uint8_t size)
+{
+  sent[stream].put(serial, packet, size);
+}
+
+/*---------------------------------------------------------------------------------
+ called by the NACK characteristic callback (BLE task)
+---------------------------------------------------------------------------------*/
+void retransmitNack(const uint8_t *data, int length)
+{
+  for (; length >= RETX_NACK_SIZE; data += RETX_NACK_SIZE, length -= RETX_NACK_SIZE)
+  {
+    if ((data[0] >= BLE_STREAMS) || (data[3] == 0))
+      continue;
+    if (nack_head - nack_tail >= RETX_NACK_QUEUE)
+    {
+      retx_overflow++;                  // the app asks again later
+      continue;
+    }
+    NackRange &range = nack_queue[nack_head & (RETX_NACK_QUEUE - 1)];
+    range.stream = data[0];
+    range.first  = data[1] | (data[2] << 8);
+    range.count  = data[3];
+    nack_head++;
+  }
+}
+
+static void updatePack(void)
+{
+  uint32_t counters[4] = {retx_ranges, retx_asked, retx_resent, retx_expired};
+
+  for (int i = 0; i < 4; i++)
+    for (int k = 0; k < 4; k++)
+      retransmit_pack[i * 4 + k] = counters[i] >> (8 * k);
+  retransmitReady = true;
+}
+
+/*---------------------------------------------------------------------------------
+ the next packet to send again, called by handleBLE() once a pass, false: none
+ this pass
+---------------------------------------------------------------------------------*/
+bool retransmitNext(BleStream *stream, uint8_t *packet, uint8_t *size)
+{
+  if (micros() - sent_us < RETX_PACE_US)
+    return false;
+  for (;;)
+  {
+    if (!current_valid)
+    {
+      if (nack_tail == nack_head)
+        return false;
+      current = nack_queue[nack_tail & (RETX_NACK_QUEUE - 1)];
+      nack_tail++;
+      current_valid = true;
+      retx_ranges++;
+      retx_asked += current.count;
+    }
+
+    while (current.count != 0)
+    {
+      uint16_t serial = current.first++;
+
+      current.count--;
+      if (sent[current.stream].get(serial, packet, size))
+      {
+        retx_resent++;
+        *stream = (BleStream)current.stream;
+        sent_us = micros();
+        return true;
+      }
+      retx_expired++;
+    }
+    current_valid = false;
+    updatePack();
+  }
+}
+
+void printRetransmit(void)
+{
+  Serial.printf("NACK ranges %u, packets asked %u, resent %u, expired %u, NACK queue full %u\r\n",
+                retx_ranges, retx_asked, retx_resent, retx_expired, retx_overflow);
+}
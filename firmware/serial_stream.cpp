@@ -0,0 +1,201 @@
+/*---------------------------------------------------------------------------------
+  Binary serial stream - all the channels at full rate on UART0, for the bench
+
+  "stream on [baud]" in CLI switches the serial port to binary frames at
+  SERIAL_STREAM_BAUD (up to 2000000), "stream off" back to 115200 and text.
+
+  Frame: COBS encoded, ended by a 0x00 byte, so the host finds the next frame after
+  any lost byte. Before COBS:
+    u8  stream        SerialStream
+    u16 serial        counts the frames of the stream, a gap is a lost frame
+    u32 time_us       micros() of the first sample
+    u8  samples
+    u8  channels
+    u8  bytes         of each value, little endian, signed
+    values            sample by sample, the channels of a sample together
+    u16 crc           CRC-16/CCITT-FALSE of the bytes before it
+  Like the BLE stream packets, the samples are grouped and numbered per stream,
+  with the time of the recorder blocks added.
+
+    SER_ECG     ECG raw, ECG filtered, RESP raw, RESP filtered, 125 SPS
+    SER_PPG     IR, RED raw ADC (18 bits MAX3010x, 22 bits AFE4490)
+    SER_ACCEL   x, y, z, ACCEL_ODR_HZ
+    SER_VITALS  the recorder vitals (packVitals()), each second
+
+  A frame is written only if the UART driver has the room for it in its TX ring
+  buffer (SERIAL_TX_BUFFER, set in setup()), so loop() never waits for the UART,
+  a frame which does not fit is dropped and counted. Text printed while streaming
+  goes between the frames, the host drops the frame it lands in (bad CRC).
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define SER_FRAME_HEADER      10
+#define SER_FRAME_MAX         (SER_FRAME_HEADER + 96 + 2)
+#define SER_COBS_MAX          (SER_FRAME_MAX + SER_FRAME_MAX / 254 + 2)
+#define SER_TEXT_BAUD         115200
+#define SER_VITALS_MS         1000
+
+struct StreamFormat
+{
+  uint8_t   channels;
+  uint8_t   bytes;                      // of a value
+  uint8_t   samples;                    // in a frame
+};
+
+static const StreamFormat formats[SER_STREAMS] =
+{
+  {4, 2, 10},                           // ECG 80ms
+  {2, 4, 10},                           // PPG 400ms at 25 SPS, 20ms at 500 SPS
+  {3, 2, 10},                           // accelerometer 200ms
+  {VITALS_PACK_SIZE, 1, 1},             // vitals
+};
+
+bool      serial_streaming = false;
+
+static uint8_t    frame  [SER_STREAMS][SER_FRAME_MAX];
+static uint8_t    samples[SER_STREAMS];
+static uint16_t   serials[SER_STREAMS];
+static uint32_t   accel_next = 0;
+
+static uint32_t   ser_frames = 0, ser_dropped = 0, ser_bytes = 0;
+
+/*---------------------------------------------------------------------------------
+ consistent overhead byte stuffing, no 0x00 in the output, return its length
+---------------------------------------------------------------------------------*/
+static int cobsEncode(const uint8_t *in, int length, uint8_t *out)
+{
+  int code_at = 0, n = 1;
+  uint8_t code = 1;
+
+  for (int i = 0; i < length; i++)
+  {
+    if (in[i] != 0)
+    {
+      out[n++] = in[i];
+      code++;
+    }
+    if ((in[i] == 0) || (code == 0xFF))
+    {
+      out[code_at] = code;
+      code_at = n++;
+      code    = 1;
+    }
+  }
+  out[code_at] = code;
+  return n;
+}
+
+static void sendFrame(SerialStream stream)
+{
+  uint8_t  *f = frame[stream];
+  uint8_t   out[SER_COBS_MAX + 1];
+  int       length, n;
+  uint16_t  crc;
+
+  length = SER_FRAME_HEADER + samples[stream] * formats[stream].channels * formats[stream].bytes;
+  f[1] = serials[stream];
+  f[2] = serials[stream] >> 8;
+  f[7] = samples[stream];
+  crc  = crc16(f, length);
+  f[length++] = crc;
+  f[length++] = crc >> 8;
+
+  n = cobsEncode(f, length, out);
+  out[n++] = 0x00;
+  if (Serial.availableForWrite() >= n)
+  {
+    Serial.write(out, n);
+    ser_frames++;
+    ser_bytes += n;
+  }
+  else
+    ser_dropped++;                      // the UART is behind, the serial shows the gap
+
+  serials[stream]++;
+  samples[stream] = 0;
+}
+
+/*---------------------------------------------------------------------------------
+ one sample, formats[stream].channels values
+---------------------------------------------------------------------------------*/
+void serialStreamSample(SerialStream stream, uint32_t time_us, const int32_t *values)
+{
+  const StreamFormat &format = formats[stream];
+  uint8_t  *p;
+
+  if (!serial_streaming)
+    return;
+
+  if (samples[stream] == 0)
+  {
+    frame[stream][0] = stream;
+    frame[stream][3] = time_us;
+    frame[stream][4] = time_us >> 8;
+    frame[stream][5] = time_us >> 16;
+    frame[stream][6] = time_us >> 24;
+    frame[stream][8] = format.channels;
+    frame[stream][9] = format.bytes;
+  }
+  p = &frame[stream][SER_FRAME_HEADER + samples[stream] * format.channels * format.bytes];
+  for (int c = 0; c < format.channels; c++)
+    for (int b = 0; b < format.bytes; b++)
+      *p++ = values[c] >> (8 * b);
+
+  if (++samples[stream] >= format.samples)
+    sendFrame(stream);
+}
+
+/*---------------------------------------------------------------------------------
+ called from loop(), accelerometer ring and vitals
+---------------------------------------------------------------------------------*/
+void handleSerialStream(void)
+{
+  static uint32_t vitals_ms = 0;
+  AccelSample s;
+
+  if (!serial_streaming)
+    return;
+
+  if (accelSampleCount() - accel_next > ACCEL_RING_SIZE)
+    accel_next = accelSampleCount() - ACCEL_RING_SIZE;
+  while (accel_next < accelSampleCount())
+    if (accelGetSample(accel_next++, &s))
+    {
+      int32_t values[3] = {s.x, s.y, s.z};
+      serialStreamSample(SER_ACCEL, s.timestamp_us, values);
+    }
+
+  if (millis() - vitals_ms >= SER_VITALS_MS)
+  {
+    uint8_t vitals[VITALS_PACK_SIZE];
+    int32_t values[VITALS_PACK_SIZE];
+
+    vitals_ms = millis();
+    packVitals(vitals);
+    for (int i = 0; i < VITALS_PACK_SIZE; i++)
+      values[i] = vitals[i];
+    serialStreamSample(SER_VITALS, micros(), values);
+  }
+}
+
+/*---------------------------------------------------------------------------------
+ CLI "stream", baud 0 = off
+---------------------------------------------------------------------------------*/
+void serialStreamSet(uint32_t baud)
+{
+  if (baud == 0)
+  {
+    serial_streaming = false;
+    Serial.flush();
+    Serial.updateBaudRate(SER_TEXT_BAUD);
+    Serial.printf("binary stream off, frames %u, dropped %u, bytes %u\r\n", ser_frames, ser_dropped, ser_bytes);
+    return;
+  }
+
+  Serial.printf("binary stream at %u baud, \"stream off\" to stop\r\n", baud);
+  Serial.flush();
+  memset(samples, 0, sizeof(samples));
+  accel_next = accelSampleCount();
+  Serial.updateBaudRate(baud);
+  serial_streaming = true;
+}
@@ -0,0 +1,201 @@
+/*---------------------------------------------------------------------------------
+  Signal quality index (SQI) - is a window worth computing?
+
+  Each window gets a score 0..100, the worst of its metrics, below SQI_PASS the
+  expensive analysis is skipped and the vital is sent as 0 (unknown).
+
+  ECG, 2 seconds of filtered samples (the QRS detector threshold period):
+    kurtosis    a clean ECG is peaky (> 5), noise and baseline are close to 3
+    baseline    power below 1Hz / power above 5Hz (the QRS band), high when the
+                baseline wanders or the electrodes move
+    saturation  samples at the ADC rail, the front end was overdriven
+  The score of the last window gates the heart rate and the beats of
+  QRS_Algorithm_Interface() for the next one. The detector itself gets every
+  sample, so its averages and sample counts do not stop in a bad window and the
+  first RR interval after it is not short. After lead-on there is no score yet,
+  the heart rate is given (provisional) until the first window is scored.
+
+  PPG, the SpO2 buffer (4 seconds at 25Hz), before the Maxim algorithm:
+    perfusion   AC/DC in %, below 0.2% there is no pulse (or no finger), above
+                20% it is motion, not blood volume
+    template    correlation of each beat with the beat before it, the best
+                normalized autocorrelation at 40~187 bpm lags
+
+  The thresholds are starting values, "sqi" in CLI prints the raw metrics.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#define ECG_SQI_WINDOW      250     // 2s at 125 SPS
+#define ECG_LP1_A           0.05    // EMA, ~1Hz at 125 SPS
+#define ECG_LP5_A           0.25    // EMA, ~5Hz at 125 SPS
+#define ECG_KURTOSIS_GOOD   5.0
+#define ECG_KURTOSIS_BAD    3.0     // gaussian noise
+#define ECG_BASELINE_GOOD   1.0
+#define ECG_BASELINE_BAD    4.0
+#define ECG_SATURATED_BAD   3       // samples per window
+
+#define PPG_PI_MIN          0.1     // %, 0 below
+#define PPG_PI_GOOD         0.2     // %, 1 above
+#define PPG_PI_MAX          20.0    // %
+#define PPG_MAX_LENGTH      100     // SpO2 buffer
+#define PPG_LAG_MIN         8       // 187 bpm at 25 SPS
+#define PPG_LAG_MAX         37      // 40 bpm at 25 SPS
+#define PPG_CORR_GOOD       0.9
+#define PPG_CORR_BAD        0.5
+
+uint8_t   ecg_sqi = 0;
+uint8_t   ppg_sqi = 0;
+static bool ecg_scored = false;    // a full window since lead-on
+
+static int16_t  ecg_window[ECG_SQI_WINDOW];
+static uint16_t ecg_count     = 0;
+static uint16_t ecg_saturated = 0;
+static float    ecg_lp1       = 0;
+static float    ecg_lp5       = 0;
+static float    ecg_base_power = 0;
+static float    ecg_qrs_power  = 0;
+
+// last metrics, for the CLI
+static float    ecg_kurtosis, ecg_baseline;
+static uint16_t ecg_last_saturated;
+static float    ppg_perfusion, ppg_correlation;
+
+// 0 at "bad", 1 at "good", linear between, either direction
+static float score(float value, float bad, float good)
+{
+  float s = (value - bad) / (good - bad);
+
+  if (s < 0)
+    return 0;
+  if (s > 1)
+    return 1;
+  return s;
+}
+
+static uint8_t percent(float s1, float s2, float s3 = 1)
+{
+  return 100 * min(s1, min(s2, s3));
+}
+
+static void ecgQualityWindow(void)
+{
+  float mean = 0, m2 = 0, m4 = 0, d;
+  int   i;
+
+  for (i = 0; i < ECG_SQI_WINDOW; i++)
+    mean += ecg_window[i];
+  mean /= ECG_SQI_WINDOW;
+  for (i = 0; i < ECG_SQI_WINDOW; i++)
+  {
+    d   = (ecg_window[i] - mean);
+    d  *= d;
+    m2 += d;
+    m4 += d * d;
+  }
+  m2 /= ECG_SQI_WINDOW;
+  m4 /= ECG_SQI_WINDOW;
+
+  ecg_kurtosis        = (m2 > 0) ? m4 / (m2 * m2) : 0;
+  ecg_baseline        = (ecg_qrs_power > 0) ? ecg_base_power / ecg_qrs_power : ECG_BASELINE_BAD;
+  ecg_last_saturated  = ecg_saturated;
+  ecg_scored          = true;
+  ecg_sqi = percent(score(ecg_kurtosis, ECG_KURTOSIS_BAD,  ECG_KURTOSIS_GOOD),
+                    score(ecg_baseline, ECG_BASELINE_BAD,  ECG_BASELINE_GOOD),
+                    score(ecg_saturated, ECG_SATURATED_BAD, 0));
+}
+
+// every filtered ECG sample, "saturated" if the raw ADC code was at the rail
+void ecgQualityAdd(int16_t sample, bool saturated)
+{
+  float high;
+
+  ecg_lp1 += ECG_LP1_A * (sample - ecg_lp1);
+  ecg_lp5 += ECG_LP5_A * (sample - ecg_lp5);
+  high     = sample - ecg_lp5;
+  ecg_base_power += ecg_lp1 * ecg_lp1;
+  ecg_qrs_power  += high * high;
+  if (saturated)
+    ecg_saturated++;
+
+  ecg_window[ecg_count++] = sample;
+  if (ecg_count < ECG_SQI_WINDOW)
+    return;
+
+  ecgQualityWindow();
+  ecg_count       = 0;
+  ecg_saturated   = 0;
+  ecg_base_power  = 0;
+  ecg_qrs_power   = 0;
+}
+
+// lead off, start again with an unknown quality
+void ecgQualityReset(void)
+{
+  ecg_count       = 0;
+  ecg_saturated   = 0;
+  ecg_base_power  = 0;
+  ecg_qrs_power   = 0;
+  ecg_lp1         = 0;
+  ecg_lp5         = 0;
+  ecg_sqi         = 0;
+  ecg_scored      = false;
+}
+
+bool ecgQualityGood(void)
+{
+  return !ecg_scored || (ecg_sqi >= SQI_PASS);
+}
+
+// score the SpO2 buffer, update ppg_sqi and return it
+uint8_t ppgQuality(const uint32_t *buffer, int length)
+{
+  static float x[PPG_MAX_LENGTH];
+  float     dc = 0;
+  float     sum, power0, power1, r;
+  uint32_t  low = UINT32_MAX, high = 0;
+  int       i, lag;
+
+  length = min(length, PPG_MAX_LENGTH);
+  for (i = 0; i < length; i++)
+  {
+    dc  += buffer[i];
+    low  = min(low,  buffer[i]);
+    high = max(high, buffer[i]);
+  }
+  dc /= length;
+  ppg_perfusion = (dc > 0) ? 100.0 * (high - low) / dc : 0;
+
+  for (i = 0; i < length; i++)
+    x[i] = buffer[i] - dc;
+
+  ppg_correlation = 0;
+  for (lag = PPG_LAG_MIN; (lag <= PPG_LAG_MAX) && (lag < length); lag++)
+  {
+    sum = power0 = power1 = 0;
+    for (i = 0; i < length - lag; i++)
+    {
+      sum    += x[i] * x[i + lag];
+      power0 += x[i] * x[i];
+      power1 += x[i + lag] * x[i + lag];
+    }
+    if ((power0 > 0) && (power1 > 0))
+    {
+      r = sum / sqrt(power0 * power1);
+      if (r > ppg_correlation)
+        ppg_correlation = r;
+    }
+  }
+
+  ppg_sqi = percent(score(ppg_perfusion,   PPG_PI_MIN,   PPG_PI_GOOD),
+                    (ppg_perfusion <= PPG_PI_MAX) ? 1 : 0,
+                    score(ppg_correlation, PPG_CORR_BAD, PPG_CORR_GOOD));
+  return ppg_sqi;
+}
+
+void printQuality(void)
+{
+  Serial.printf("ECG sqi %u: kurtosis %.1f, baseline/qrs %.2f, saturated %u\r\n",
+                ecg_sqi, ecg_kurtosis, ecg_baseline, ecg_last_saturated);
+  Serial.printf("PPG sqi %u: perfusion %.2f%%, correlation %.2f\r\n",
+                ppg_sqi, ppg_perfusion, ppg_correlation);
+}
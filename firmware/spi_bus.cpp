@@ -0,0 +1,70 @@
+/*---------------------------------------------------------------------------------
+  SPI bus manager - shared by ADS1292R (ECG) and AFE4490 (SpO2)
+
+  Every device on a bus has its own SPIDevice: chip select pin, clock, SPI mode
+  and the chip select timing from its datasheet. select() locks the bus with a
+  mutex, applies the device settings with SPI.beginTransaction(), and drives CS;
+  deselect() releases them in the reverse order.  So the drivers no longer change
+  SPI.setDataMode() or the global clock divider around every transfer, and a
+  transfer can not be interleaved with another device, even from another task.
+
+  Usage:
+    bus.select(device);
+    bus.transferBytes(tx, rx, size);
+    bus.deselect(device);
+
+  Each device may also have more than one SPIDevice with different clocks, e.g.
+  ADS1292R uses a slow one for opcodes/registers and a fast one for data.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+#include <SPI.h>
+
+SPIBus  vspiBus(&SPI);        // default Arduino SPI is VSPI
+
+#if AFE4490_ON_HSPI
+SPIClass hspi(HSPI);
+SPIBus  hspiBus(&hspi);
+#endif
+
+SPIBus :: SPIBus(SPIClass *port)
+{
+  spi = port;
+}
+
+void SPIBus :: begin(int8_t sck, int8_t miso, int8_t mosi)
+{
+  spi->begin(sck, miso, mosi, -1);  // CS pins are driven by select()/deselect()
+  mutex = xSemaphoreCreateMutex();
+}
+
+void SPIBus :: select(const SPIDevice &device)
+{
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  spi->beginTransaction(SPISettings(device.clock, MSBFIRST, device.mode));
+
+  digitalWrite(device.cs_pin, LOW);
+  if (device.cs_setup_us)
+    delayMicroseconds(device.cs_setup_us);
+}
+
+void SPIBus :: deselect(const SPIDevice &device)
+{
+  if (device.cs_hold_us)
+    delayMicroseconds(device.cs_hold_us);
+  digitalWrite(device.cs_pin, HIGH);
+  if (device.cs_high_us)
+    delayMicroseconds(device.cs_high_us);
+
+  spi->endTransaction();
+  xSemaphoreGive(mutex);
+}
+
+uint8_t SPIBus :: transfer(uint8_t data)
+{
+  return spi->transfer(data);
+}
+
+void SPIBus :: transferBytes(const uint8_t *tx, uint8_t *rx, uint32_t size)
+{
+  spi->transferBytes(tx, rx, size);
+}
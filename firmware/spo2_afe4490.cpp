@@ -76,10 +76,21 @@
 #define LED1ABSVAL    0x2f
 #define DIAG          0x30
 
-volatile int8_t   n_buffer_count; //data length
+#define SPI_READ      0x000001  // CONTROL0: register reads enabled
+
+// SCLK up to 16MHz by datasheet, no CS timing request beyond one SCLK
+const SPIDevice afe4490Spi = {AFE4490_CS_PIN, 4000000, SPI_MODE0, 0, 0, 0};
 
-int dec=0;
+#if AFE4490_ON_HSPI
+  #define afe4490Bus  hspiBus
+#else
+  #define afe4490Bus  vspiBus
+#endif
 
+// LED2VAL, ALED2VAL, LED1VAL, ALED1VAL, LED2ABSVAL, LED1ABSVAL
+#define VALUE_REG_NUM (LED1ABSVAL - LED2VAL + 1)
+
+volatile int8_t   n_buffer_count; //data length
 
 extern uint32_t irBuffer [];     //infrared LED sensor data
 extern uint32_t redBuffer[];     //red LED sensor data
@@ -87,62 +98,153 @@ void calculate_spo2(uint32_t *ir_buffer);
 
 class AFE4490  afe4490;
 extern Queue	ppg_queue;
+/*---------------------------------------------------------------------------------
+ anti-alias decimation filter 
+
+ PRPCOUNT gives 500 SPS, the SpO2 algorithm expects 25 SPS (FreqS), so the samples
+ are decimated by 20. Low pass FIR (Hamming windowed sinc, fc = 6Hz @ 500 SPS, Q15, 
+ DC gain = 1, -80dB @ 12.5Hz) removes the noise above the new Nyquist frequency 
+ before it is aliased into the SpO2 window.
+
+ Polyphase form: every input sample is multiplied only by the taps of its own phase
+ and added to the DECIMATE_PHASES pending outputs, so each 500Hz interrupt costs
+ DECIMATE_PHASES MACs, and no output is computed for the dropped samples.
+---------------------------------------------------------------------------------*/
+#define DECIMATE_FACTOR   20
+#define DECIMATE_TAPS     240
+#define DECIMATE_PHASES   (DECIMATE_TAPS/DECIMATE_FACTOR)
+#define DECIMATE_DELAY_US 239000    // group delay, (DECIMATE_TAPS-1)/2 samples at 500 SPS
+
+const int16_t decimateCoeffs[DECIMATE_TAPS] = {
+       3,     3,     4,     4,     5,     5,     6,     7,     7,     8,
+       8,     9,    10,    10,    11,    11,    12,    13,    13,    14,
+      14,    14,    14,    15,    15,    14,    14,    14,    13,    12,
+      11,    10,     9,     7,     5,     3,     0,    -2,    -5,    -8,
+     -12,   -15,   -19,   -23,   -27,   -32,   -36,   -41,   -45,   -50,
+     -55,   -59,   -64,   -69,   -73,   -77,   -81,   -84,   -88,   -90,
+     -93,   -94,   -95,   -96,   -96,   -95,   -93,   -91,   -87,   -83,
+     -78,   -71,   -64,   -56,   -46,   -36,   -24,   -11,     2,    17,
+      33,    50,    68,    87,   107,   128,   149,   172,   195,   219,
+     243,   268,   294,   319,   345,   371,   397,   423,   449,   475,
+     500,   525,   549,   572,   595,   617,   637,   657,   676,   693,
+     709,   724,   737,   749,   759,   768,   774,   780,   783,   786,
+     786,   783,   780,   774,   768,   759,   749,   737,   724,   709,
+     693,   676,   657,   637,   617,   595,   572,   549,   525,   500,
+     475,   449,   423,   397,   371,   345,   319,   294,   268,   243,
+     219,   195,   172,   149,   128,   107,    87,    68,    50,    33,
+      17,     2,   -11,   -24,   -36,   -46,   -56,   -64,   -71,   -78,
+     -83,   -87,   -91,   -93,   -95,   -96,   -96,   -95,   -94,   -93,
+     -90,   -88,   -84,   -81,   -77,   -73,   -69,   -64,   -59,   -55,
+     -50,   -45,   -41,   -36,   -32,   -27,   -23,   -19,   -15,   -12,
+      -8,    -5,    -2,     0,     3,     5,     7,     9,    10,    11,
+      12,    13,    14,    14,    14,    15,    15,    14,    14,    14,
+      14,    13,    13,    12,    11,    11,    10,    10,     9,     8,
+       8,     7,     7,     6,     5,     5,     4,     4,     3,     3
+};
+
+class Decimator
+{
+  public:
+    bool put(int32_t sample, int32_t *output);
+
+  private:
+    int64_t acc[DECIMATE_PHASES] = {0};   // pending outputs, acc[head] is the oldest
+    uint8_t head  = 0;
+    uint8_t phase = 0;                    // input position inside the output period
+};
+
+// return true when a decimated output is ready
+bool Decimator :: put(int32_t sample, int32_t *output)
+{
+  uint8_t tap   = DECIMATE_FACTOR - 1 - phase;
+  uint8_t index = head;
+
+  for (int i = 0; i < DECIMATE_PHASES; i++)
+  {
+    acc[index] += (int64_t)decimateCoeffs[tap] * sample;
+    tap += DECIMATE_FACTOR;
+    if (++index == DECIMATE_PHASES)
+      index = 0;
+  }
+
+  if (++phase < DECIMATE_FACTOR)
+    return false;
+
+  phase = 0;
+  *output   = (int32_t)(acc[head] >> 15); // Q15 -> sample
+  acc[head] = 0;                          // restart as the newest pending output
+  if (++head == DECIMATE_PHASES)
+    head = 0;
+  return true;
+}
+
+Decimator irDecimator, redDecimator;
 
 void AFE4490 :: getData(void)
 {
-  signed   long afe4490_IR_data, afe4490_RED_data;
-  unsigned long IRtemp,REDtemp;
+  int32_t   value[VALUE_REG_NUM];
+  int32_t   afe4490_IR_data, afe4490_RED_data;
+  int32_t   ir_decimated,    red_decimated;
   uint16_t  sample16;
 
+  static uint32_t drdy_read = 0;  // data ready count of the last sample read
+  uint32_t  drdy_count;
+
   if (spo2_interrupt_flag == false) 
     return;   // continue wait for data ready pin interrupt
   else 
-    clear_interrupt();
-  
-  // interrupt captured, process the data
+    drdy_count = clear_interrupt();
+  TRACE_BEGIN(TR_PPG_DATA);
 
-  SPI.setDataMode(SPI_MODE0); 
+  // data ready came again before the last sample was read, that one is lost
+  if ((drdy_read != 0) && (drdy_count - drdy_read > 1))
+    overrunMissed(OVR_PPG, drdy_count - drdy_read - 1);
+  drdy_read = drdy_count;
   
+  // interrupt captured, process the data
 
-  writeData(CONTROL0, 0x000001);
-  IRtemp = readData(LED1VAL);
-
-  writeData(CONTROL0, 0x000001);
-  REDtemp = readData(LED2VAL);
-  
-  IRtemp = (unsigned long) (IRtemp << 10);
-  afe4490_IR_data = (signed long) (IRtemp);
-  afe4490_IR_data = (signed long) ((afe4490_IR_data) >> 10);
+  readValues(value);
 
-  REDtemp = (unsigned long) (REDtemp << 10);
-  afe4490_RED_data = (signed long) (REDtemp);
-  afe4490_RED_data = (signed long) ((afe4490_RED_data) >> 10);
+  // ambient-subtracted values: LEDxABSVAL = LEDxVAL - ALEDxVAL
+  afe4490_IR_data  = value[LED1ABSVAL - LED2VAL];
+  afe4490_RED_data = value[LED2ABSVAL - LED2VAL];
+  {
+    int32_t raw[2] = {(int32_t)afe4490_IR_data, (int32_t)afe4490_RED_data};
+    serialStreamSample(SER_PPG, micros(), raw);
+  }
 
-  if (dec == 20)
+  irDecimator.put (afe4490_IR_data,  &ir_decimated);
+  if (redDecimator.put(afe4490_RED_data, &red_decimated))
   {
-    irBuffer [n_buffer_count] = (uint32_t) ((afe4490_IR_data ) >> 4);
-    redBuffer[n_buffer_count] = (uint32_t) ((afe4490_RED_data) >> 4);
+    // accelerometer reference at the time of the filter output
+    uint32_t timestamp = micros() - DECIMATE_DELAY_US;
+    motionReference(timestamp);
+    irBuffer [n_buffer_count] = motionCancel(MOTION_IR,  (uint32_t) (ir_decimated  >> 4));
+    redBuffer[n_buffer_count] = motionCancel(MOTION_RED, (uint32_t) (red_decimated >> 4));
+    ppgBeatAdd(irBuffer[n_buffer_count], timestamp);    // beat by beat, foot for PAT
     n_buffer_count++;
-    dec = 0;
   }
-  dec++;
 
   // save PPG in BLE buffer
   sample16 = (uint16_t)(afe4490_IR_data>>8);  
-  if (bleDeviceConnected)
-    ppg_queue.push(&sample16);
+  overrunSample(OVR_PPG, sample16);
 
   // save SPO2 to BLE buffer
   if (n_buffer_count > 99)
   {
-    calculate_spo2(irBuffer);
+    if (motionUsable(1))      // skip the buffer if the wearer was moving
+    {
+      TRACE_BEGIN(TR_SPO2);
+      calculate_spo2(irBuffer);
+      TRACE_END(TR_SPO2);
+    }
     n_buffer_count = 0;
   }
+  TRACE_END(TR_PPG_DATA);
 }
 
 void AFE4490 :: init(void)
 {
-  SPI.setDataMode(SPI_MODE0); 
   writeData(CONTROL0,     0x000000);
   writeData(CONTROL0,     0x000008);
   writeData(TIAGAIN,      0x000000); // CF = 5pF, RF = 500kR
@@ -179,29 +281,49 @@ void AFE4490 :: init(void)
   writeData(ADCRSTENDCT2, 0X000FA0);
   writeData(ADCRSTCNT3,   0X001770);
   writeData(ADCRSTENDCT3, 0X001770);
+  writeData(CONTROL0,     SPI_READ); // only read from now on, see readValues()
   delay(1000);
 }
 
 void AFE4490 :: writeData (uint8_t address, uint32_t data)
 {
-  digitalWrite (AFE4490_CS_PIN, LOW);     // enable device
-  SPI.transfer (address);                 // send address to device
-  SPI.transfer ((data >> 16) & 0xFF);     // write top 8 bits
-  SPI.transfer ((data >> 8)  & 0xFF);     // write middle 8 bits
-  SPI.transfer (data & 0xFF);             // write bottom 8 bits
-  digitalWrite (AFE4490_CS_PIN, HIGH);    // disable device
+  uint8_t tx[4], rx[4];
+
+  tx[0] = address;                        // send address to device
+  tx[1] = (data >> 16) & 0xFF;            // write top 8 bits
+  tx[2] = (data >> 8)  & 0xFF;            // write middle 8 bits
+  tx[3] = data & 0xFF;                    // write bottom 8 bits
+
+  afe4490Bus.select(afe4490Spi);          // enable device
+  afe4490Bus.transferBytes(tx, rx, sizeof(tx));
+  afe4490Bus.deselect(afe4490Spi);        // disable device
 }
  
-unsigned long AFE4490 :: readData (uint8_t address)
+/*---------------------------------------------------------------------------------
+ read all the value registers LED2VAL ~ LED1ABSVAL in one burst
+
+ SPI_READ is left set in CONTROL0 by init(), so there is no CONTROL0 write before
+ the reads. AFE4490 has no register address auto-increment, each register is still 
+ one 32-bit frame (address + 24 bits data), but all frames are sent back to back 
+ through the SPI hardware FIFO by transferBytes(), not byte by byte.
+ Clear SPI_READ before using writeData() again.
+---------------------------------------------------------------------------------*/
+void AFE4490 :: readValues(int32_t *value)
 {
-  unsigned long data = 0;
-  digitalWrite (AFE4490_CS_PIN, LOW);     // enable device
-  SPI.transfer (address);                 // send address to device
-  data |= ((unsigned long)SPI.transfer (0) << 16); // read top 8 bits data
-  data |= ((unsigned long)SPI.transfer (0) << 8); // read middle 8 bits  data
-  data |= SPI.transfer (0);               // read bottom 8 bits data
-  digitalWrite (AFE4490_CS_PIN, HIGH);    // disable device
-  return data;                            // return with 24 bits of read data
+  uint8_t tx[4], rx[4];
+  int32_t data;
+
+  for (int i = 0; i < VALUE_REG_NUM; i++)
+  {
+    tx[0] = LED2VAL + i;                  // address
+    tx[1] = tx[2] = tx[3] = 0;
+    afe4490Bus.select(afe4490Spi);        // enable device
+    afe4490Bus.transferBytes(tx, rx, sizeof(tx));
+    afe4490Bus.deselect(afe4490Spi);      // disable device
+
+    data = ((uint32_t)rx[1] << 16) | ((uint32_t)rx[2] << 8) | rx[3];
+    value[i] = (data << 10) >> 10;        // 22 bits two's complement -> int32
+  }
 }
 
 #endif   //(SPO2_TYPE==OXI_AFE4490)
\ No newline at end of file
@@ -72,6 +72,7 @@ https://github.com/aromring/MAX30102_by_RF
 #include <Wire.h>
 #include "spo2_max3010x.h"
 #include "cppQueue.h"
+#include "dc_blocker.h"
 extern  Queue ppg_queue;
 
 MAX3010X spo2Sensor;
@@ -83,32 +84,15 @@ uint32_t unblocked_IR_value;
 
 /*---------------------------------------------------------------------------------
  DC offset filter (high pass)
- use EMA Exponential Moving Average to remove DC signal from the samples.
+ use EMA Exponential Moving Average to remove DC signal from the samples,
+ y = x - EMA(x) with alpha 0.2, in fixed point (pole 1 - alpha in Q31)
  
  Reference:
  https://www.norwegiancreations.com/2015/10/tutorial-potentiometers-with-arduino-and-filtering/
  https://www.norwegiancreations.com/2016/03/arduino-tutorial-simple-high-pass-band-pass-and-band-stop-filtering/ 
 
 ---------------------------------------------------------------------------------*/
-class EMA_algorithm{
-  private:
-    const float  EMA_a = 0.2;     //initialization of EMA alpha
-    uint32_t EMA_S;
-  
-  public:
-    EMA_algorithm(void)           //constrator
-    {
-      static uint32_t EMA_S = 0;   //initialization of EMA S 
-    }  
-  
-    int32_t high_pass_filter(uint32_t data_input)
-    {
-      // data_input equivalent to EMA Y
-      EMA_S = (EMA_a * data_input) + ((1-EMA_a)*EMA_S);  //run the EMA
-      return data_input - EMA_S;
-    }
-};
-EMA_algorithm EMA_ppg;
+DCBlocker<int32_t, int64_t, 31, Q31(1 - 0.2), true> EMA_ppg;
 /*---------------------------------------------------------------------------------
  init the spo2 sensor
 ---------------------------------------------------------------------------------*/
@@ -157,8 +141,11 @@ void initMax3010xSpo2()
 #define SPO2_BUFFER_SIZE      100
 #define SPO2_READ_SIZE        5         //each time read so many samples
 #define SPO2_EACH_CALCULATION 25
+#define SPO2_SAMPLE_US        40000     //100 SPS averaged by 4
 uint32_t irBuffer [SPO2_BUFFER_SIZE]; //infrared LED samples
 uint32_t redBuffer[SPO2_BUFFER_SIZE]; //red LED samples
+uint32_t    sample_count = 0;               //samples read so far
+SampleClock sampleClock(SPO2_SAMPLE_US);    //the MAX3010x oscillator -> micros()
 
 void calculate_spo2(uint32_t *ir_buffer)
 { 
@@ -167,6 +154,14 @@ void calculate_spo2(uint32_t *ir_buffer)
   int32_t heart_rate_value;     
   int8_t  heart_rate_valid; // = 1 when the heart rate calculation is valid
 
+  // no pulse in the buffer, do not run the algorithm on it
+  if (ppgQuality(irBuffer, SPO2_BUFFER_SIZE) < SQI_PASS)
+  {
+    spo2_percent   = 0;
+    ppg_heart_rate = 0;
+    return;
+  }
+
   maxim_heart_rate_and_oxygen_saturation
       (irBuffer, SPO2_BUFFER_SIZE, redBuffer, 
       &spo2_value, &spo2_valid, 
@@ -177,7 +172,10 @@ void calculate_spo2(uint32_t *ir_buffer)
   else //invalid data
     spo2_percent = 0;
     
-  if (heart_rate_valid)
+  // updated at each beat by ppgBeatAdd(), the window is the fallback
+  if (ppgBeatTracking())
+    ;
+  else if (heart_rate_valid)
     ppg_heart_rate = (uint8_t)heart_rate_value;       
   else
     ppg_heart_rate = 0; 
@@ -188,6 +186,8 @@ void handleMax3010xSpo2()
   int i;
   int32_t  sample32; 
   int16_t  sample16;
+  uint32_t timestamp;
+  int      pending;
 
   // keep track average Ir reading
   static uint32_t averageIrValue = 0;
@@ -195,9 +195,22 @@ void handleMax3010xSpo2()
   // count how many new samples received, then call calculate_spo2
   static int newSampleCounter = 0; 
 
-  spo2Sensor.check(); //Check the sensor, read up to 3 samples
-  if (spo2Sensor.available() < SPO2_READ_SIZE) 
+  // FIFO overflow count already taken
+  static uint32_t overflow_seen = 0;
+
+  spo2Sensor.checkAsync(); //Ask the I2C task to read new samples, do not wait
+
+  // samples the sensor dropped when its FIFO was full
+  if (spo2Sensor.getFIFOOverflow() != overflow_seen)
+  {
+    overrunMissed(OVR_PPG, spo2Sensor.getFIFOOverflow() - overflow_seen);
+    overflow_seen = spo2Sensor.getFIFOOverflow();
+  }
+  pending = spo2Sensor.available();
+  if (pending < SPO2_READ_SIZE) 
     return;
+  TRACE_BEGIN(TR_PPG_DATA);
+  sampleClock.received(micros(), sample_count + pending);
 
   // dump old samples, and shift buffer forward
   for (i = SPO2_READ_SIZE; i < SPO2_BUFFER_SIZE; i++)
@@ -208,15 +221,23 @@ void handleMax3010xSpo2()
 
   for (i = SPO2_BUFFER_SIZE - SPO2_READ_SIZE; i < SPO2_BUFFER_SIZE; i++)
   {
+    // the oldest sample first
+    timestamp = sampleClock.time(sample_count++);
+    motionReference(timestamp);
+
     //FIXME red and infrared LED data swapped.
-    redBuffer[i] = spo2Sensor.getFIFOIR();
-    irBuffer [i] = spo2Sensor.getFIFORed();
+    int32_t raw[2] = {(int32_t)spo2Sensor.getFIFORed(), (int32_t)spo2Sensor.getFIFOIR()};   // IR, RED
+    serialStreamSample(SER_PPG, timestamp, raw);
+    redBuffer[i] = motionCancel(MOTION_RED, raw[1]);
+    irBuffer [i] = motionCancel(MOTION_IR,  raw[0]);
 
     spo2Sensor.nextSample(); //We're finished with this sample so move to next sample
 
+    ppgBeatAdd(irBuffer[i], timestamp);   // beat by beat pulse rate
+
     //the ADC is 18 bits -> 16 bits by removing DC offset, and push to BLE tx queue
     sample32 = irBuffer [i];  //uint32 -> int32
-    sample32 = EMA_ppg.high_pass_filter(sample32);
+    sample32 = EMA_ppg.process(sample32);
     sample16 = (int16_t)sample32;
     sample16 = - sample16;        //reverse the signal
 
@@ -226,20 +247,26 @@ void handleMax3010xSpo2()
 
     averageIrValue += irBuffer[i] / SPO2_EACH_CALCULATION;
     
-    // only push data to ble tx buffer when 
-    // 1. ble is connected, and
-    // 2. human boy present to spo2 sensor
-    if ((bleDeviceConnected)&&(averageIrValue>unblocked_IR_value))
-      ppg_queue.push(&sample16);    //FIFO for BLE
+    // only push data when human boy present to spo2 sensor,
+    // to ble tx buffer when ble is connected, else to the recorder
+    if (averageIrValue>unblocked_IR_value)
+      overrunSample(OVR_PPG, sample16);   //FIFO for BLE, or the recorder
 
     if (++newSampleCounter>=SPO2_EACH_CALCULATION)
     {
-      calculate_spo2(irBuffer);
+      // a window with motion is skipped until it is out of the buffer
+      if (motionUsable(SPO2_BUFFER_SIZE/SPO2_EACH_CALCULATION))
+      {
+        TRACE_BEGIN(TR_SPO2);
+        calculate_spo2(irBuffer);
+        TRACE_END(TR_SPO2);
+      }
       newSampleCounter = 0;
       averageIrValue   = 0;
     }
 
   }
+  TRACE_END(TR_PPG_DATA);
 }
 
 /*
@@ -208,7 +208,9 @@ class MAX3010X {
   
   //FIFO Reading
   uint16_t check(void); //Checks for new data and fills FIFO
+  void checkAsync(void); //Same as check(), through the I2C scheduler, returns at once
   uint8_t available(void); //Tells caller how many new samples are available (head - tail)
+  uint32_t getFIFOOverflow(void); //Samples lost in the full FIFO so far (OVF_COUNTER), checkAsync() only
   void nextSample(void); //Advances the tail of the sense array
   uint32_t getFIFORed(void); //Returns the FIFO sample pointed to by tail
   uint32_t getFIFOIR(void); //Returns the FIFO sample pointed to by tail
@@ -242,6 +244,18 @@ class MAX3010X {
   uint8_t revisionID; 
 
   void bitMask(uint8_t reg, uint8_t mask, uint8_t thing);
+
+  //checkAsync(): read pointers, then FIFO data chunk by chunk in the I2C task
+  I2CTransaction pointerRead;
+  I2CTransaction fifoRead;
+  uint8_t pointers[3];                 //FIFO_WR_PTR, OVF_COUNTER, FIFO_RD_PTR
+  uint8_t fifoData[I2C_BUFFER_LENGTH];
+  uint16_t fifoBytesLeft;
+  volatile bool fifoBusy;
+  volatile uint32_t fifoOverflow;      //sum of OVF_COUNTER, written by the I2C task
+  static void onPointers(I2CTransaction *t);
+  static void onFIFOData(I2CTransaction *t);
+  void readFIFOChunk(void);
  
   #define STORAGE_SIZE 250  //Each long is 4 bytes so limit this to fit on your micro
 
@@ -250,8 +264,8 @@ class MAX3010X {
     uint32_t red[STORAGE_SIZE];
     uint32_t IR[STORAGE_SIZE];
     uint32_t green[STORAGE_SIZE];
-    byte head;
-    byte tail;
+    volatile byte head; //written by the I2C task in checkAsync()
+    volatile byte tail;
   } sense_struct; //This is our circular buffer of readings from the sensor
 
   sense_struct sense;
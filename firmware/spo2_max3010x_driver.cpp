@@ -604,6 +604,115 @@ uint16_t MAX3010X::check(void)
   return (numberOfSamples); //Let the world know how much new data we found
 }
 
+//Non-blocking check(), for loop()
+//The I2C scheduler reads the three pointer registers in one burst, then the FIFO
+//in chunks, new samples are stored by the callbacks in the I2C task.
+//The head is moved after a sample is stored, so loop() never reads a half sample.
+void MAX3010X::checkAsync(void)
+{
+  if (fifoBusy) return; //previous read is not finished yet
+
+  fifoBusy = true;
+  pointerRead.address  = _i2c_read_addr;
+  pointerRead.reg      = MAX3010X_FIFOWRITEPTR;
+  pointerRead.data     = pointers;
+  pointerRead.length   = sizeof(pointers);
+  pointerRead.op       = I2C_READ;
+  pointerRead.priority = I2C_PRIORITY_HIGH;
+  pointerRead.deadline = 0;
+  pointerRead.callback = onPointers;
+  pointerRead.context  = this;
+  if (!i2cBus.submit(&pointerRead))
+    fifoBusy = false;
+}
+
+uint32_t MAX3010X::getFIFOOverflow(void)
+{
+  return fifoOverflow;
+}
+
+void MAX3010X::onPointers(I2CTransaction *t)
+{
+  MAX3010X *sensor = (MAX3010X *)t->context;
+  int numberOfSamples;
+
+  if (t->error)
+  {
+    sensor->fifoBusy = false;
+    return;
+  }
+
+  numberOfSamples = sensor->pointers[0] - sensor->pointers[2]; //write - read pointer
+  if (numberOfSamples < 0) numberOfSamples += 32; //Wrap condition
+  if ((numberOfSamples == 0) && (sensor->pointers[1] != 0))
+    numberOfSamples = 32; //full FIFO: the pointers are equal, read all of it or it stays full
+  sensor->fifoOverflow += sensor->pointers[1]; //OVF_COUNTER, cleared by the FIFO read
+
+  sensor->fifoBytesLeft = numberOfSamples * sensor->activeLEDs * 3;
+  sensor->readFIFOChunk();
+}
+
+void MAX3010X::readFIFOChunk(void)
+{
+  uint8_t toGet = fifoBytesLeft;
+
+  if (toGet == 0)
+  {
+    fifoBusy = false;
+    return;
+  }
+  if (fifoBytesLeft > I2C_BUFFER_LENGTH)
+    toGet = I2C_BUFFER_LENGTH - (I2C_BUFFER_LENGTH % (activeLEDs * 3)); //whole samples only
+
+  fifoRead.address  = _i2c_read_addr;
+  fifoRead.reg      = MAX3010X_FIFODATA;
+  fifoRead.data     = fifoData;
+  fifoRead.length   = toGet;
+  fifoRead.op       = I2C_READ;
+  fifoRead.priority = I2C_PRIORITY_HIGH;
+  fifoRead.deadline = 0;
+  fifoRead.callback = onFIFOData;
+  fifoRead.context  = this;
+  if (!i2cBus.submit(&fifoRead))
+    fifoBusy = false;
+}
+
+void MAX3010X::onFIFOData(I2CTransaction *t)
+{
+  MAX3010X *sensor = (MAX3010X *)t->context;
+  sense_struct *sense = &sensor->sense;
+  uint8_t  *p = t->data;
+  uint8_t   head;
+
+  if (t->error)
+  {
+    sensor->fifoBusy = false;
+    return;
+  }
+
+  for (int i = 0; i < t->length; i += sensor->activeLEDs * 3)
+  {
+    head = (sense->head + 1) % STORAGE_SIZE;
+
+    sense->red[head] = (((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) & 0x3FFFF;
+    p += 3;
+    if (sensor->activeLEDs > 1)
+    {
+      sense->IR[head] = (((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) & 0x3FFFF;
+      p += 3;
+    }
+    if (sensor->activeLEDs > 2)
+    {
+      sense->green[head] = (((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) & 0x3FFFF;
+      p += 3;
+    }
+    sense->head = head; //publish the sample
+  }
+
+  sensor->fifoBytesLeft -= t->length;
+  sensor->readFIFOChunk();
+}
+
 //Check for new data but give up after a certain amount of time
 //Returns true if new data was found
 //Returns false if new data was not found
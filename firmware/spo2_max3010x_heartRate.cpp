@@ -54,7 +54,7 @@
 * ownership rights.
 * 
 */
-#include "Arduino.h"
+#include "firmware.h"
 
 int16_t averageDCEstimator(int32_t *p, uint16_t x);
 int16_t lowPassFIRFilter(int16_t din);
@@ -73,10 +73,22 @@ int16_t positiveEdge = 0;
 int16_t negativeEdge = 0;
 int32_t ir_avg_reg = 0;
 
+uint16_t IR_AC_Signal_min_age = 0;  // samples since the minimum of the negative cycle (pulse foot)
+uint16_t IR_AC_Signal_max_age = 0;  // samples since the maximum of the positive cycle (pulse peak)
+
 int16_t cbuf[32];
 uint8_t offset = 0;
 
+#if (PBA_SAMPLE_RATE == 100)
 static const uint16_t FIRCoeffs[12] = {172, 321, 579, 927, 1360, 1858, 2390, 2916, 3391, 3768, 4012, 4096};
+#elif (PBA_SAMPLE_RATE == 25)
+// taps 11, 7 and 3 of the 100 SPS half window (every 4th from the center, the
+// outer 3 dropped), x4 for about the same gain (1.44 vs 1.45): the response
+// follows the 100 SPS one within 0.02 up to 5Hz, -3dB at 3Hz
+static const uint16_t FIRCoeffs[3] = {3708, 11664, 16384};
+#else
+  #error PBA_SAMPLE_RATE must be 25 or 100
+#endif
 
 //  Heart Rate Monitor functions takes a sample value and the sample number
 //  Returns true if a beat is detected
@@ -87,6 +99,8 @@ bool checkForBeat(int32_t sample)
 
   //  Save current state
   IR_AC_Signal_Previous = IR_AC_Signal_Current;
+  IR_AC_Signal_min_age++;
+  IR_AC_Signal_max_age++;
   
   //This is good to view for debugging
   //Serial.print("Signal_Current: ");
@@ -106,6 +120,7 @@ bool checkForBeat(int32_t sample)
     positiveEdge = 1;
     negativeEdge = 0;
     IR_AC_Signal_max = 0;
+    IR_AC_Signal_max_age = 0;
 
     //if ((IR_AC_Max - IR_AC_Min) > 100 & (IR_AC_Max - IR_AC_Min) < 1000)
     if ((IR_AC_Max - IR_AC_Min) > 20 & (IR_AC_Max - IR_AC_Min) < 1000)
@@ -121,18 +136,21 @@ bool checkForBeat(int32_t sample)
     positiveEdge = 0;
     negativeEdge = 1;
     IR_AC_Signal_min = 0;
+    IR_AC_Signal_min_age = 0;
   }
 
   //  Find Maximum value in positive cycle
   if (positiveEdge & (IR_AC_Signal_Current > IR_AC_Signal_Previous))
   {
     IR_AC_Signal_max = IR_AC_Signal_Current;
+    IR_AC_Signal_max_age = 0;
   }
 
   //  Find Minimum value in negative cycle
   if (negativeEdge & (IR_AC_Signal_Current < IR_AC_Signal_Previous))
   {
     IR_AC_Signal_min = IR_AC_Signal_Current;
+    IR_AC_Signal_min_age = 0;
   }
   
   return(beatDetected);
@@ -148,13 +166,15 @@ int16_t averageDCEstimator(int32_t *p, uint16_t x)
 //  Low Pass FIR Filter
 int16_t lowPassFIRFilter(int16_t din)
 {  
+  const uint8_t center = PBA_FIR_DELAY;
+
   cbuf[offset] = din;
 
-  int32_t z = mul16(FIRCoeffs[11], cbuf[(offset - 11) & 0x1F]);
+  int32_t z = mul16(FIRCoeffs[center], cbuf[(offset - center) & 0x1F]);
   
-  for (uint8_t i = 0 ; i < 11 ; i++)
+  for (uint8_t i = 0 ; i < center ; i++)
   {
-    z += mul16(FIRCoeffs[i], cbuf[(offset - i) & 0x1F] + cbuf[(offset - 22 + i) & 0x1F]);
+    z += mul16(FIRCoeffs[i], cbuf[(offset - i) & 0x1F] + cbuf[(offset - 2*center + i) & 0x1F]);
   }
 
   offset++;
@@ -69,28 +69,35 @@ class MAX30205
    float getTemperature(void);
 
   private:
+    I2CTransaction tempRead;      // temperature register, read by the I2C task
+    uint8_t readRaw[2];
+    float   temperature = 0;
+
     uint8_t writeByte(uint8_t address, uint8_t subAddress, uint8_t data);
     void    readBytes(uint8_t address, uint8_t subAddress, uint8_t * dest, uint8_t count);
     uint8_t readByte(uint8_t address, uint8_t subAddress);   
 };
 
 
+/*
+ return the temperature of the last read, and start the next read in the I2C task.
+ loop() does not wait for the I2C bus, the value is one read interval old.
+*/
 float MAX30205::getTemperature(void)
 {
-  static float last_temperature = 0; 
-  float current_temperature;
-  uint8_t readRaw[2] = {0};
-  readBytes(MAX30205_ADDRESS,MAX30205_TEMPERATURE, &readRaw[0] ,2); // read two bytes
-  uint16_t raw = readRaw[0] << 8 | readRaw[1];  //combine two bytes
-  current_temperature = raw  * 0.00390625;     // convert to temperature
-
-  current_temperature = ((int)(current_temperature * 10) / 10.0); //keep 0.1 resolution
-
-  if (current_temperature != last_temperature){
-    last_temperature = current_temperature;
-    //Serial.printf("body = %3.1f°C\r\n",current_temperature);
+  if (!tempRead.done)
+    return temperature;   // previous read still in the queue
+
+  if (tempRead.error == 0)
+  {
+    uint16_t raw = readRaw[0] << 8 | readRaw[1];  //combine two bytes
+    temperature = raw  * 0.00390625;             // convert to temperature
+    temperature = ((int)(temperature * 10) / 10.0); //keep 0.1 resolution
   }
-  return  current_temperature;
+
+  tempRead.deadline = millis() + MAX30205_READ_INTERVAL;  // too old after that
+  i2cBus.submit(&tempRead);
+  return  temperature;
 }
 
 void MAX30205::shutdown(void)
@@ -101,6 +108,16 @@ void MAX30205::shutdown(void)
 
 bool MAX30205::begin(void)
 { uint8_t error = 0;
+  tempRead.address  = MAX30205_ADDRESS;
+  tempRead.reg      = MAX30205_TEMPERATURE;
+  tempRead.data     = readRaw;
+  tempRead.length   = sizeof(readRaw);
+  tempRead.op       = I2C_READ;
+  tempRead.priority = I2C_PRIORITY_LOW;
+  tempRead.callback = NULL;
+  tempRead.done     = true;
+  tempRead.error    = I2C_EXPIRED;  // no data yet
+
   error += writeByte(MAX30205_ADDRESS, MAX30205_CONFIGURATION, 0x00); //mode config
   error += writeByte(MAX30205_ADDRESS, MAX30205_THYST , 		 0x00); // set threshold
   error += writeByte(MAX30205_ADDRESS, MAX30205_TOS, 			 0x00); //
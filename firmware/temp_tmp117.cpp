@@ -793,9 +793,14 @@ TMP117 tempSensor;
 
 float getTemperature()
 {
+	float temperature;
+
 	// Data Ready is a flag for the conversion modes
 	// the dataReady flag should always be high in continuous conversion 
-	return tempSensor.readTempC();;
+	i2cBus.lock();		// blocking Wire access, share the bus with the I2C task
+	temperature = tempSensor.readTempC();
+	i2cBus.unlock();
+	return temperature;
 }
 
 boolean initTemperature()
@@ -0,0 +1,144 @@
+/*---------------------------------------------------------------------------------
+  Trace - timed events in a RAM ring, to see how the ISRs, handlers and BLE sends
+  fall on each other (profile.cpp only has the totals)
+
+  Built only with TRACE_FEATURE true, otherwise TRACE_BEGIN/END/MARK() are empty.
+
+    TRACE_BEGIN(TR_ECG_DATA);           a slice, begin and end of one event
+    TRACE_END  (TR_ECG_DATA);
+    TRACE_MARK (TR_ECG_DRDY, count);    an instant, with a 16 bits argument
+
+  A record is 8 bytes: CCOUNT, event, phase and core, argument. traceAdd() is in
+  IRAM and takes its slot with an atomic add, so the ISRs and the tasks of both
+  cores write to the ring at once. The ring keeps the last TRACE_RING_SIZE events.
+
+  CLI:
+    trace start           from an empty ring
+    trace start missed    stops by itself 1/4 ring after a lost sample (overrun.cpp),
+                          the ring then holds what came before it
+    trace stop
+    trace dump            stops, then prints the ring as text
+  host/trace_json.cpp turns the dump (the serial log) into Chrome trace JSON, for
+  chrome://tracing or ui.perfetto.dev. The CCOUNTs of the two cores are not
+  synchronized exactly, compare the times of events on the same core.
+---------------------------------------------------------------------------------*/
+#include "firmware.h"
+
+#if TRACE_FEATURE
+#define TRACE_RING_SIZE       1024      // events, power of 2
+
+struct TraceRecord
+{
+  uint32_t  cycles;
+  uint8_t   event;
+  uint8_t   flags;                      // phase | core << 2
+  uint16_t  arg;
+};
+
+static const char *event_names[TR_EVENTS] = {
+  "ecg_drdy", "ppg_drdy", "accel_drdy", "ecg_data", "ppg_data", "ecg_filter",
+  "spo2", "i2c", "ble_ecg", "ble_ppg", "missed_ecg", "missed_ppg", "missed_accel",
+  "queue_full"};
+
+static TraceRecord        ring[TRACE_RING_SIZE];
+static uint32_t           head     = 0;
+static volatile bool      tracing  = false;
+static uint32_t           stop_at  = UINT32_MAX;    // head which ends a triggered trace
+static bool               trigger  = false;
+
+static inline uint32_t IRAM_ATTR traceCycles(void)
+{
+#ifdef HOST_BUILD
+  return micros();
+#else
+  return xthal_get_ccount();
+#endif
+}
+
+/*---------------------------------------------------------------------------------
+ any task or ISR
+---------------------------------------------------------------------------------*/
+void IRAM_ATTR traceAdd(TraceEvent event, TracePhase phase, uint16_t arg)
+{
+  uint32_t     i;
+  TraceRecord *r;
+
+  if (!tracing)
+    return;
+
+  i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+  if (i >= stop_at)
+  {
+    tracing = false;
+    return;
+  }
+  r         = &ring[i & (TRACE_RING_SIZE - 1)];
+  r->cycles = traceCycles();
+  r->event  = event;
+  r->flags  = phase | (xPortGetCoreID() << 2);
+  r->arg    = arg;
+
+  if (trigger && (event >= TR_MISSED_ECG) && (event <= TR_MISSED_ACCEL))
+  {
+    trigger = false;
+    stop_at = i + TRACE_RING_SIZE / 4;
+  }
+}
+
+/*---------------------------------------------------------------------------------
+ CLI "trace start [missed]|stop|dump"
+---------------------------------------------------------------------------------*/
+static void dumpTrace(void)
+{
+  uint32_t  end = min(head, stop_at);
+  uint32_t  n   = min(end, (uint32_t)TRACE_RING_SIZE);
+
+  tracing = false;
+  delay(1);                             // a writer on the other core finishes its record
+
+  Serial.printf("trace %u MHz, %u events, %u overwritten\r\n",
+#ifdef HOST_BUILD
+                1,
+#else
+                getCpuFrequencyMhz(),
+#endif
+                n, end - n);
+  for (int i = 0; i < TR_EVENTS; i++)
+    Serial.printf("trace name %u %s\r\n", i, event_names[i]);
+  for (uint32_t i = end - n; i < end; i++)
+  {
+    TraceRecord &r = ring[i & (TRACE_RING_SIZE - 1)];
+    Serial.printf("trace ev %u %u %u %u %u\r\n", r.cycles, r.event, r.flags & 3, r.flags >> 2, r.arg);
+  }
+  Serial.println("trace end");
+}
+
+static int cmdTrace(void)
+{
+  if (strcmp(cliArg(1), "start") == 0)
+  {
+    tracing = false;
+    head    = 0;
+    stop_at = UINT32_MAX;
+    trigger = (strcmp(cliArg(2), "missed") == 0);
+    tracing = true;
+  }
+  else if (strcmp(cliArg(1), "stop") == 0)
+    tracing = false;
+  else if (strcmp(cliArg(1), "dump") == 0)
+  {
+    dumpTrace();
+    return 0;
+  }
+  Serial.printf("trace %s%s, %u events\r\n", tracing ? "on" : "off",
+                trigger ? ", waits for a missed sample" : "", min(head, stop_at));
+  return 0;
+}
+
+void initTrace(void)
+{
+  cliAddCommand("trace", cmdTrace, "trace start [missed]|stop|dump, timed events for host/trace_json");
+}
+#else
+void initTrace(void){}
+#endif //TRACE_FEATURE